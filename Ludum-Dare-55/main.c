@@ -2,10 +2,24 @@
 
 #include "raylib.h"
 #include "raymath.h"
+#include "workers.h"
 #include <assert.h>
 #include <stdio.h>   
 #include <stdlib.h> 
+#include <string.h>
 #include <math.h>
+#include <limits.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+// /arch:AVX2 or -mavx2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#endif
 
 
 
@@ -32,6 +46,12 @@
 
 #define ITERATE(IDX, MAX) (int IDX = 0; IDX < MAX; IDX++)
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 
 //------------------------------------------------------------------------------------
 // C Utils
@@ -40,9 +60,88 @@
 
 //
 
+// Quality
+// Cosmetic detail the render thread sheds when frames run over budget. Every detail is
+// kept from its level up, updateQuality moves the level one step at a time.
+#define MAX_QUALITY_LEVEL 3
+#define FULL_PARTICLES_QUALITY 3 // Below it every other dust / explosion particle is dropped
+#define SQUASH_QUALITY 2
+#define DISTANT_SHADOWS_QUALITY 2 // Minion shadows away from the view center
+#define MINION_SHADOWS_QUALITY 1
+#define CAMERA_SHAKE_QUALITY 1
+
+#define FRAME_BUDGET (1.0 / 120) // Same as SetTargetFPS
+#define QUALITY_SMOOTHING 0.1 // Weight of the newest frame in the average
+#define QUALITY_LOWER_THRESHOLD 1.0 // Fractions of the budget
+#define QUALITY_RAISE_THRESHOLD 0.6
+#define QUALITY_LOWER_COOLDOWN 0.25 // Seconds since the last step
+#define QUALITY_RAISE_COOLDOWN 2.0
+
+typedef struct QualityController {
+    int level;
+    float averageFrameTime; // Work per frame, not counting the wait for the next one
+    double lastStepTime;
+} QualityController;
+
+QualityController quality = { .level = MAX_QUALITY_LEVEL };
+
+// frameTime is the time spent on the frame, before presenting it
+void updateQuality(float frameTime) {
+    quality.averageFrameTime = Lerp(quality.averageFrameTime, frameTime, QUALITY_SMOOTHING);
+
+    double time = GetTime();
+    double sinceLastStep = time - quality.lastStepTime;
+    if (quality.averageFrameTime > FRAME_BUDGET * QUALITY_LOWER_THRESHOLD
+        && quality.level > 0 && sinceLastStep >= QUALITY_LOWER_COOLDOWN) {
+        quality.level--;
+        quality.lastStepTime = time;
+    } else if (quality.averageFrameTime < FRAME_BUDGET * QUALITY_RAISE_THRESHOLD
+        && quality.level < MAX_QUALITY_LEVEL && sinceLastStep >= QUALITY_RAISE_COOLDOWN) {
+        quality.level++;
+        quality.lastStepTime = time;
+    }
+}
+
+// Animation Tables
+// Sampled once by initAnimationTables so sprites don't call exp / sin each
+#define SQUASH_TABLE_SIZE 256
+#define SQUASH_TABLE_DURATION 1.0 // Seconds, the squash has settled by then
+#define BOB_TABLE_SIZE 256 // Over one period of the minion bob
+#define MINION_BOB_FREQUENCY 10.0 // Radians per second
+#define MINION_BOB_HEIGHT 7
+
+float squashTable[SQUASH_TABLE_SIZE + 1]; // 1 - e^-10t
+float bobTable[BOB_TABLE_SIZE]; // |sin| * height in whole pixels, like the sprites snap to
+
+void initAnimationTables() {
+    for ITERATE(i, SQUASH_TABLE_SIZE + 1) {
+        float t = i * SQUASH_TABLE_DURATION / SQUASH_TABLE_SIZE;
+        squashTable[i] = 1 - expf(-t * 10);
+    }
+    for ITERATE(i, BOB_TABLE_SIZE) {
+        bobTable[i] = truncf(fabsf(sinf(i * 2 * PI / BOB_TABLE_SIZE)) * MINION_BOB_HEIGHT);
+    }
+}
+
+float getSquashAmount(float t) {
+    if (t < 0) return 1 - expf(-t * 10);
+
+    float index = t * (SQUASH_TABLE_SIZE / SQUASH_TABLE_DURATION);
+    if (index >= SQUASH_TABLE_SIZE) return 1.0;
+    int i = (int) index;
+    return Lerp(squashTable[i], squashTable[i + 1], index - i);
+}
+
+float getMinionBob(float lifeTime) {
+    int i = (int) (lifeTime * MINION_BOB_FREQUENCY * BOB_TABLE_SIZE / (2 * PI));
+    return bobTable[i & (BOB_TABLE_SIZE - 1)];
+}
+
 Vector2 getSquashScale(float t, float scaler) {
+    if (quality.level < SQUASH_QUALITY) return Vector2One();
+
     static float squashMax = 1.1;
-    float squashAmount = 1 - exp( -t * 10);
+    float squashAmount = getSquashAmount(t);
     return (Vector2){ Lerp(squashMax * scaler, 1.0, squashAmount), Lerp(1.0 / squashMax / scaler, 1.0, squashAmount) };
 }
 
@@ -58,9 +157,29 @@ Color ColorLerp(Color c1, Color c2, float amount) {
 
 // RandRange
 
+// Set on the preview thread. It simulates without sound, particles, camera shake or level
+// changes
+THREAD_LOCAL bool isGhostThread;
+// Set on the simulation thread, its sounds, shakes and particles go to the render thread
+// (see EffectQueue)
+THREAD_LOCAL bool isSimulationThread;
+// raylib's random state isn't thread safe, threads other than the main one seed their own
+THREAD_LOCAL unsigned int threadRandomState;
+
+// [min, max]
+int randInt(int min, int max) {
+    if (threadRandomState == 0) return GetRandomValue(min, max);
+
+    // xorshift32
+    threadRandomState ^= threadRandomState << 13;
+    threadRandomState ^= threadRandomState >> 17;
+    threadRandomState ^= threadRandomState << 5;
+    return min + (int) (threadRandomState % ((unsigned int) (max - min) + 1));
+}
+
 // [0, 1]
 float randFloat() {
-    return (float)GetRandomValue(0, INT_MAX) / (float) INT_MAX;
+    return (float)randInt(0, INT_MAX) / (float) INT_MAX;
 }
 
 // [min, max]
@@ -68,30 +187,175 @@ float randRange(float min, float max) {
     return Lerp(min, max, randFloat());
 }
 
+// Allocations
+// Every heap allocation the game makes goes through these, counted per subsystem. Atomic
+// since the simulation, preview and writer threads allocate as well.
+#define ARENA_MEMORY 0
+#define ARRAY_MEMORY 1
+#define ENTITY_MEMORY 2
+#define COMMAND_MEMORY 3
+#define TIMER_MEMORY 4
+#define EFFECT_MEMORY 5
+#define RENDER_MEMORY 6
+#define PARTICLE_MEMORY 7
+#define LEVEL_MEMORY 8
+#define SNAPSHOT_MEMORY 9
+#define PREVIEW_MEMORY 10
+#define INPUT_MEMORY 11
+#define NETWORK_MEMORY 12
+#define RECORDING_MEMORY 13
+#define MEMORY_SUBSYSTEM_COUNT 14
+
+const char* MEMORY_SUBSYSTEM_NAMES[] = {
+    "Arena",
+    "Array",
+    "Entity",
+    "Command",
+    "Timer",
+    "Effect",
+    "Render",
+    "Particle",
+    "Level",
+    "Snapshot",
+    "Preview",
+    "Input",
+    "Network",
+    "Recording"
+};
+
+volatile long allocationCounts[MEMORY_SUBSYSTEM_COUNT]; // realloc counts as one
+volatile long allocationBytes[MEMORY_SUBSYSTEM_COUNT];
+
+void countAllocation(int subsystem, size_t size) {
+    atomicAdd(&allocationCounts[subsystem], 1);
+    atomicAdd(&allocationBytes[subsystem], (long) size);
+}
+
+void* allocate(int subsystem, size_t size) {
+    countAllocation(subsystem, size);
+    return malloc(size);
+}
+
+void* allocateZeroed(int subsystem, size_t count, size_t size) {
+    countAllocation(subsystem, count * size);
+    return calloc(count, size);
+}
+
+void* reallocate(int subsystem, void* data, size_t size) {
+    countAllocation(subsystem, size);
+    return realloc(data, size);
+}
+
+// Arena
+// Bump allocator, everything in it is released at once by resetArena. Blocks are kept
+// across resets, so repeating the same allocations after a reset mallocs nothing.
+#define ARENA_BLOCK_SIZE (4 * 1024 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+// Aligned, not zeroed
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+    ArenaBlock* block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        // Blocks after the current one are free since the last reset
+        block = block->next;
+        if (block != NULL) block->used = 0;
+    }
+
+    if (block == NULL) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = allocate(ARENA_MEMORY, sizeof(ArenaBlock) + ARENA_ALIGNMENT + blockSize);
+        block->size = blockSize;
+        block->used = 0;
+
+        // Goes after the current block so the blocks it skipped are still reused next time
+        if (arena->current == NULL) {
+            block->next = arena->first;
+            arena->first = block;
+        } else {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+    arena->current = block;
+
+    unsigned char* data = (unsigned char*) (block + 1);
+    data += (ARENA_ALIGNMENT - (size_t) data % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+    void* result = data + block->used;
+    block->used += size;
+    return result;
+}
+
+// Growing a bump allocation copies it, the old copy stays until the reset
+void* arenaGrow(Arena* arena, void* data, size_t oldSize, size_t newSize) {
+    void* result = arenaAlloc(arena, newSize);
+    if (data != NULL) memcpy(result, data, oldSize);
+    return result;
+}
+
+void resetArena(Arena* arena) {
+    arena->current = arena->first;
+    if (arena->current != NULL) arena->current->used = 0;
+}
+
+void destroyArena(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = arena->current = NULL;
+}
+
 // Dynamic Int Array
 // from https://stackoverflow.com/questions/3536153/c-dynamically-growing-array
 typedef struct IntArray {
     int* array;
     size_t used;
     size_t size;
+    Arena* arena; // NULL for the heap
 } IntArray;
 
 void initIntArray(IntArray * a, size_t initialSize) {
-    a->array = malloc(initialSize * sizeof(int));
+    a->array = allocate(ARRAY_MEMORY, initialSize * sizeof(int));
+    a->used = 0;
+    a->size = initialSize;
+    a->arena = NULL;
+}
+
+void initArenaIntArray(IntArray* a, Arena* arena, size_t initialSize) {
+    a->array = arenaAlloc(arena, initialSize * sizeof(int));
     a->used = 0;
     a->size = initialSize;
+    a->arena = arena;
 }
 
 void insertIntArray(IntArray * a, int element) {
     if (a->used == a->size) {
         a->size *= 2;
-        a->array = realloc(a->array, a->size * sizeof(int));
+        if (a->arena != NULL)
+            a->array = arenaGrow(a->arena, a->array, a->used * sizeof(int), a->size * sizeof(int));
+        else
+            a->array = reallocate(ARRAY_MEMORY, a->array, a->size * sizeof(int));
     }
     a->array[a->used++] = element;
 }
 
 void freeIntArray(IntArray * a) {
-    free(a->array);
+    if (a->arena == NULL) free(a->array);
     a->array = NULL;
     a->used = a->size = 0;
 }
@@ -111,6 +375,92 @@ inline int imax(int i1, int i2) {
 }
 
 
+// Effect Queue
+// What the simulation thread wants heard and seen. Filled between publishes and replayed
+// by the render thread, which owns the audio device, the camera and the particles.
+typedef struct SoundEffect {
+    Sound sound;
+    float volume;
+    float pitch;
+} SoundEffect;
+
+typedef struct ParticleSpawn {
+    int emitter;
+    Vector3 position;
+    int sprite;
+    Vector3 velocity;
+    Vector3 acceleration;
+    float duration;
+    float dampening;
+    Color startColor;
+    Color endColor;
+    float startScale;
+    float endScale;
+} ParticleSpawn;
+
+typedef struct EffectQueue {
+    SoundEffect* sounds;
+    int soundCount;
+    int soundCapacity;
+    ParticleSpawn* particles;
+    int particleCount;
+    int particleCapacity;
+    float shakeIntensity;
+    float shakeTime;
+    bool isLevelWon;
+} EffectQueue;
+
+EffectQueue simulationEffects;
+
+void queueSoundEffect(EffectQueue* queue, SoundEffect sound) {
+    if (queue->soundCount == queue->soundCapacity) {
+        queue->soundCapacity = imax(16, queue->soundCapacity * 2);
+        queue->sounds = reallocate(EFFECT_MEMORY, queue->sounds, sizeof(SoundEffect) * queue->soundCapacity);
+    }
+    queue->sounds[queue->soundCount++] = sound;
+}
+
+void queueParticleSpawn(EffectQueue* queue, ParticleSpawn particle) {
+    if (queue->particleCount == queue->particleCapacity) {
+        queue->particleCapacity = imax(256, queue->particleCapacity * 2);
+        queue->particles = reallocate(EFFECT_MEMORY, queue->particles, sizeof(ParticleSpawn) * queue->particleCapacity);
+    }
+    queue->particles[queue->particleCount++] = particle;
+}
+
+void queueShake(EffectQueue* queue, float intensity, float time) {
+    queue->shakeIntensity = fmaxf(queue->shakeIntensity, intensity);
+    queue->shakeTime = fmaxf(queue->shakeTime, time);
+}
+
+void clearEffectQueue(EffectQueue* queue) {
+    queue->soundCount = 0;
+    queue->particleCount = 0;
+    queue->shakeIntensity = 0;
+    queue->shakeTime = 0;
+    queue->isLevelWon = false;
+}
+
+// Moves everything in from onto the end of to
+void appendEffectQueue(EffectQueue* to, EffectQueue* from) {
+    for ITERATE(i, from->soundCount) {
+        queueSoundEffect(to, from->sounds[i]);
+    }
+    for ITERATE(i, from->particleCount) {
+        queueParticleSpawn(to, from->particles[i]);
+    }
+    queueShake(to, from->shakeIntensity, from->shakeTime);
+    to->isLevelWon |= from->isLevelWon;
+    clearEffectQueue(from);
+}
+
+void freeEffectQueue(EffectQueue* queue) {
+    free(queue->sounds);
+    free(queue->particles);
+    *queue = (EffectQueue){ 0 };
+}
+
+
 // Draw anchored
 
 void drawSpriteAnchored(Texture2D texture, Vector2 position, float rotation, Vector2 anchor, Color tint) {
@@ -147,11 +497,31 @@ float shakeTime = 0.0;
 Vector2 shakeOffset = {0, 0};
 Vector2 cameraCenter = { 0, 0 };
 
+// Towers are drawn well above their base position
+#define VIEW_CULL_MARGIN 200
+
 void setCameraCenter(Camera2D* c, Vector2 center) {
     cameraCenter = center;
 }
 
+// World area the camera shows on a target of the given size, grown by margin on every side
+Rectangle getCameraView(Camera2D* c, Vector2 size, float margin) {
+    Vector2 topLeft = GetScreenToWorld2D((Vector2) { 0, 0 }, *c);
+    Vector2 bottomRight = GetScreenToWorld2D(size, *c);
+    return (Rectangle) {
+        topLeft.x - margin, topLeft.y - margin,
+        bottomRight.x - topLeft.x + margin * 2, bottomRight.y - topLeft.y + margin * 2
+    };
+}
+
 void shakeCamera(float newIntensity, float newTime) {
+    if (isGhostThread) return;
+    if (isSimulationThread) {
+        queueShake(&simulationEffects, newIntensity, newTime);
+        return;
+    }
+    if (quality.level < CAMERA_SHAKE_QUALITY) return;
+
     if (newIntensity >= shakeIntensity) {
         shakeIntensity = newIntensity;
         if (newTime >= shakeTime) {
@@ -239,69 +609,84 @@ Sound LAUNCH_ARROW_SOUND;
 Sound LAUNCH_BOMB_SOUND;
 Sound MINION_HURT_SOUND;
 
-#define SOUND_INSTANCE_COUNT 1000
+// Every sound gets its aliases up front, so playing one doesn't allocate
+#define SOUND_ALIAS_COUNT 64 // Copies of one sound that can play at once
+#define MAX_SOUND_COUNT 16
+
+typedef struct SoundAliases {
+    Sound sound;
+    Sound aliases[SOUND_ALIAS_COUNT];
+    int lastPlayed;
+} SoundAliases;
 
-Sound soundInstances[SOUND_INSTANCE_COUNT];
+SoundAliases soundAliases[MAX_SOUND_COUNT];
+int soundAliasesCount;
 
 float placeSoundCooldown = 0.0;
 bool isSoundOn = true;
 
+Sound loadSoundWithAliases(const char* path) {
+    assert(soundAliasesCount < MAX_SOUND_COUNT);
+    SoundAliases* entry = &soundAliases[soundAliasesCount++];
+    entry->sound = LoadSound(path);
+    for ITERATE(i, SOUND_ALIAS_COUNT) {
+        entry->aliases[i] = LoadSoundAlias(entry->sound);
+    }
+    return entry->sound;
+}
+
 bool playSoundInstance(Sound sound, float volume, float pitch) {
-    static lastPlayedSoundInt = 0;
-    for (int i = (lastPlayedSoundInt + 1) % SOUND_INSTANCE_COUNT;
-        i != lastPlayedSoundInt; i = (i + 1) % SOUND_INSTANCE_COUNT)
+    if (isGhostThread) return false;
+    if (isSimulationThread) {
+        queueSoundEffect(&simulationEffects, (SoundEffect){ sound, volume, pitch });
+        return true;
+    }
+
+    SoundAliases* entry = NULL;
+    for ITERATE(i, soundAliasesCount) {
+        if (soundAliases[i].sound.stream.buffer == sound.stream.buffer) entry = &soundAliases[i];
+    }
+    if (entry == NULL) return false;
+
+    for (int i = (entry->lastPlayed + 1) % SOUND_ALIAS_COUNT;
+        i != entry->lastPlayed; i = (i + 1) % SOUND_ALIAS_COUNT)
     {
-        assert(i >= 0);
-        assert(i < SOUND_INSTANCE_COUNT);
-        Sound currentSound = soundInstances[i];
-        if (!IsSoundPlaying(currentSound))
+        Sound alias = entry->aliases[i];
+        if (!IsSoundPlaying(alias))
         {
-            UnloadSoundAlias(currentSound);
-            soundInstances[i] = LoadSoundAlias(sound);
-            SetSoundVolume(soundInstances[i], volume);
-            SetSoundPitch(soundInstances[i], pitch);
-            PlaySound(soundInstances[i]);
-            lastPlayedSoundInt = i;
+            SetSoundVolume(alias, volume);
+            SetSoundPitch(alias, pitch);
+            PlaySound(alias);
+            entry->lastPlayed = i;
             return true;
         }
-        
     }
     return false;
 }
 
 void loadSounds() {
-    LOSE_SOUND = LoadSound("Sounds/Lose.wav");
-    WIN_SOUND = LoadSound("Sounds/Win.wav");
-    TOWER_DESTROY_SOUND = LoadSound("Sounds/TowerDestroy.wav");
-    GAIN_MINIONS_SOUND = LoadSound("Sounds/GainMoreMinions.wav");
-    PLACE_SOUND = LoadSound("Sounds/Place.wav");
-    WIN_SOUND_2 = LoadSound("Sounds/Win2.wav");
-    EXPLOSION_SOUND = LoadSound("Sounds/Explosion.wav");
-    MINION_WALK_SOUND = LoadSound("Sounds/MinionWalk.wav");
-    TOWER_HURT_SOUND = LoadSound("Sounds/TowerHurt.wav");
-    LAUNCH_ARROW_SOUND = LoadSound("Sounds/LaunchArrow.wav");
-    LAUNCH_BOMB_SOUND = LoadSound("Sounds/LaunchBomb.wav");
-    MINION_HURT_SOUND = LoadSound("Sounds/MinionDie.wav");
-
-    for ITERATE(i, SOUND_INSTANCE_COUNT) {
-        soundInstances[i] = LoadSoundAlias(LOSE_SOUND);
-    }
+    LOSE_SOUND = loadSoundWithAliases("Sounds/Lose.wav");
+    WIN_SOUND = loadSoundWithAliases("Sounds/Win.wav");
+    TOWER_DESTROY_SOUND = loadSoundWithAliases("Sounds/TowerDestroy.wav");
+    GAIN_MINIONS_SOUND = loadSoundWithAliases("Sounds/GainMoreMinions.wav");
+    PLACE_SOUND = loadSoundWithAliases("Sounds/Place.wav");
+    WIN_SOUND_2 = loadSoundWithAliases("Sounds/Win2.wav");
+    EXPLOSION_SOUND = loadSoundWithAliases("Sounds/Explosion.wav");
+    MINION_WALK_SOUND = loadSoundWithAliases("Sounds/MinionWalk.wav");
+    TOWER_HURT_SOUND = loadSoundWithAliases("Sounds/TowerHurt.wav");
+    LAUNCH_ARROW_SOUND = loadSoundWithAliases("Sounds/LaunchArrow.wav");
+    LAUNCH_BOMB_SOUND = loadSoundWithAliases("Sounds/LaunchBomb.wav");
+    MINION_HURT_SOUND = loadSoundWithAliases("Sounds/MinionDie.wav");
 }
 
 void unloadSounds() {
-    UnloadSound(LOSE_SOUND);
-    UnloadSound(WIN_SOUND);
-    UnloadSound(TOWER_DESTROY_SOUND);
-    UnloadSound(GAIN_MINIONS_SOUND);
-    UnloadSound(PLACE_SOUND);
-    UnloadSound(WIN_SOUND_2);
-    UnloadSound(EXPLOSION_SOUND);
-    UnloadSound(MINION_WALK_SOUND);
-    UnloadSound(TOWER_HURT_SOUND);
-
-    for ITERATE(i, SOUND_INSTANCE_COUNT) {
-        UnloadSoundAlias(soundInstances[i]);
+    for ITERATE(i, soundAliasesCount) {
+        for ITERATE(alias, SOUND_ALIAS_COUNT) {
+            UnloadSoundAlias(soundAliases[i].aliases[alias]);
+        }
+        UnloadSound(soundAliases[i].sound);
     }
+    soundAliasesCount = 0;
 }
 
 
@@ -335,6 +720,11 @@ const float MINION_ACCELERATION = 10.0;
 const Vector2 SCREEN_SIZE = { 900, 18 * 30 };
 const float SPAWN_PERIOD = 0.01;
 
+// Fixed simulation step
+#define SIMULATION_TICK_RATE 120
+#define MAX_TICKS_PER_FRAME 8
+const float TICK_DELTA = 1.0 / SIMULATION_TICK_RATE;
+
 
 enum GetMinionMode {
     PLAYER_ONLY,
@@ -342,6 +732,10 @@ enum GetMinionMode {
     BOTH,
 };
 
+#define PLAYER_FACTION 0
+#define ENEMY_FACTION 1
+#define FACTION_COUNT 2
+
 // Colors
 const unsigned int GROUND_COLOR = 0xF1BB87FF;
 const unsigned int GROUND_COLOR_2 = 0xF2B47AFF;
@@ -349,6 +743,8 @@ const unsigned int PLACEABLE_COLOR = 0x2E86ABFF;
 const unsigned int PLACEABLE_COLOR_2 = 0x207295FF;
 const unsigned int PLAYER_COLOR = 0x2E86ABFF;
 const unsigned int ENEMY_COLOR = 0xA4243BFF;
+const Color PLAYER_TINT = { 0x2E, 0x86, 0xAB, 0xFF };
+const Color ENEMY_TINT = { 0xA4, 0x24, 0x3B, 0xFF };
 const unsigned int BACKGROUND_COLOR = 0x281611FF;
 const unsigned int BACKGROUND_COLOR_2 = 0x241410FF;
 
@@ -361,8 +757,10 @@ const unsigned int BACKGROUND_COLOR_2 = 0x241410FF;
 typedef struct Entity {
     Vector2 position;
     float height;
-    float lifeTime;
+    unsigned int spawnTick;
+    unsigned int generation; // Bumped every time the slot is reused
     bool isSpawned;
+    bool isDestroyQueued;
 } Entity;
 
 typedef struct Minion {
@@ -372,6 +770,12 @@ typedef struct Minion {
     bool isPlayer;
     bool isProjectileTargeted;
     bool isMinionTargeted;
+
+    // Straight line movement, position is moveStartPosition + velocity * time since moveStartTick
+    bool isMovingStraight;
+    Vector2 moveStartPosition;
+    unsigned int moveStartTick;
+    unsigned int arrivalTick;
 } Minion;
 
 
@@ -380,7 +784,6 @@ typedef struct Tower {
 	int type;
     int health;
     int value;
-    float attackCooldown;
     float lastHitAt;
     float lastShot;
 } Tower;
@@ -390,8 +793,8 @@ typedef struct Projectile {
     Vector2 startPosition;
     Vector2 targetPosition;
     int targetMinionId;
+    unsigned int targetMinionGeneration;
     int type;
-    float aliveTime;
     float totalAliveTime;
     float angle;
 } Projectile;
@@ -401,25 +804,95 @@ typedef struct Trap {
     Entity entity;
 } Trap;
 
-typedef struct Particle {
-    Entity entity;
-    Texture2D* sprite;
-    Vector3 velocity;
-    Vector3 acceleration;
-    float duration;
-    float dampening;
-    Color startColor;
-    Color endColor;
-    float startScale;
-    float endScale;
-} Particle;
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+typedef struct TimerEvent {
+    int kind;
+    int type;
+    int id;
+    unsigned int generation;
+    unsigned int dueTick;
+    int next;
+} TimerEvent;
+
+typedef struct TimerWheel {
+    int slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    unsigned int currentTick; // Next tick to fire
+    TimerEvent* events;
+    int eventCapacity;
+    int freeEvent;
+} TimerWheel;
+
+// Explosions go first, their kills join the same destroy batch
+#define EXPLOSION_COMMAND 0
+#define DAMAGE_TOWER_COMMAND 1
+#define DESTROY_COMMAND 2
+#define SPAWN_MINION_COMMAND 3
+#define SPAWN_PROJECTILE_COMMAND 4
+#define COMMAND_KIND_COUNT 5
+
+typedef struct Command {
+    int type;
+    int id;
+    int amount;
+    union {
+        struct {
+            Vector2 position;
+            bool isPlayer;
+        } minion;
+        struct {
+            int type;
+            Vector2 startPosition;
+            float totalAliveTime;
+        } projectile;
+        struct {
+            Vector2 position;
+            float radius;
+        } explosion;
+    };
+} Command;
+
+typedef struct CommandArray {
+    Command* array;
+    size_t used;
+    size_t size;
+} CommandArray;
+
+#define SPAWN_PLAYER_MINION_ACTION 0
+#define SPAWN_ENEMY_MINION_ACTION 1
+#define SPAWN_TOWER_ACTION 2
+#define SPAWN_TRAP_ACTION 3
+#define SET_TILE_ACTION 4
+#define ENTER_LEVEL_ACTION 5
+#define PREVIEW_ACTION 6
+
+typedef struct PlayerAction {
+    int kind;
+    Vector2 position;
+    int value; // Tower type, tile type, level number or minion count
+} PlayerAction;
+
 
+// What an entity looks like this frame, submitted after every sprite has been prepared
+typedef struct SpriteInstance {
+    Texture2D* texture; // NULL draws nothing
+    Vector2 position;
+    float rotation;
+    Vector2 scale;
+    Vector2 anchor;
+    Color tint;
+    int label; // Number drawn at labelPosition, NULLID for none
+    Vector2 labelPosition;
+} SpriteInstance;
 
 typedef struct EntityClass {
     //void (*spawnCallback);
     void (*destroyCallback)(int);
-    void (*update)(int, float);
-    void (*draw)(int);
+    void (*updateAll)(float); // Every live entity of the type, NULL if it's driven by timers only
+    void (*evaluateAll)(); // Works out lazily computed state before drawing, can be NULL
+    void (*prepareSprite)(int, SpriteInstance*); // Reads only, runs on the worker pool
     void* bank;
     int bankSize;
     int structSize;
@@ -429,22 +902,117 @@ typedef struct EntityClass {
 
 typedef struct TileData {
     unsigned int type;
-    IntArray minionIds;
+    int minionStarts[FACTION_COUNT];
+    int minionCounts[FACTION_COUNT];
+    int minionSums[FACTION_COUNT]; // minionCounts summed over the chunk's tiles up to and left of this one, see Minion Density
 } TileData;
 
+// Tiles live in square chunks, allocated the first time a chunk holds anything but ground
+// or a minion walks into it. Missing chunks read as EMPTY_TILE
+#define TILE_CHUNK_SHIFT 4
+#define TILE_CHUNK_SIZE (1 << TILE_CHUNK_SHIFT)
+#define TILE_CHUNK_MASK (TILE_CHUNK_SIZE - 1)
+#define TILE_CHUNK_AREA (TILE_CHUNK_SIZE * TILE_CHUNK_SIZE)
+
+typedef struct TileChunk {
+    TileData tiles[TILE_CHUNK_AREA];
+    int gridBuild; // Last grid build the chunk had minions in
+    int activeIndex; // Place in activeChunks as of that build
+} TileChunk;
+
+typedef struct FlowField {
+    int goalTileIndex;
+    bool isValid;
+    int minX; // Tiles the field covers, inclusive, see FLOW_FIELD_REACH
+    int minY;
+    int maxX;
+    int maxY;
+    unsigned char* directions; // Per covered tile, rows FLOW_FIELD_SIZE apart. FLOW_OFFSETS index, FLOW_DIRECT or FLOW_NONE
+} FlowField;
+
 typedef struct TileMap {
+    Arena* arena; // Owns everything below
     int width;
     int height;
-    TileData* tiles;
+    int chunkColumns;
+    int chunkRows;
+    TileChunk** chunks; // Row major, NULL until needed
+    FlowField* flowFields; // Per tower slot
+    int flowFieldCount;
+    int* flowCosts; // Flow field build scratch, one field's worth
+    int* flowQueue;
+    int flowQueueCapacity; // In (cost, field index) pairs
+    // Minion grid, rebuilt every tick by updateTileMap
+    // A faction's minions in a tile are minionIds[tile->minionStarts[f] .. + tile->minionCounts[f]).
+    // Only chunks with minions take part (the active chunks). All player minions come first,
+    // then all enemies, each in tile order over the active chunks, so a filtered query over a
+    // row of tiles is one contiguous run
+    int gridBuild;
+    int* activeChunks; // Chunk indices, ascending
+    int activeChunkCount;
+    int* previousActiveChunks;
+    int previousActiveChunkCount;
+    int* minionIds;
+    float* minionXs; // Per grid slot, positions when the grid was built
+    float* minionYs;
+    int* minionAliveMasks; // Per grid slot, -1 until the minion is queued for destroy, 0 after
+    int* minionSlots; // Per minion slot, index into minionIds, NULLID if not on the map
+    int minionGridCount;
+    int* minionCellIndices; // Per minion slot, (chunk index * chunk area + tile in chunk) * faction count + faction, NULLID if not on the map
+    int* chunkMinionIds; // Minion ids bucketed by active chunk, each bucket in slot order
+    int* chunkMinionStarts; // Per active chunk, its first entry in chunkMinionIds, then the total
+    int* jobChunkCounts; // Per build job and active chunk
+    int jobChunkCountsCapacity;
+    int* gridRowOffsets; // Per faction, active chunk and tile row in it: its minion count, then its first grid slot
+    int gridRowOffsetsCapacity;
+    int jobCount;
 } TileMap;
 
+#define BAKED_DESCRIPTION_LENGTH 64
+
 typedef struct Level {
-    char* imagePath;
+    char* imagePath; // Source for the bake
+    char* bakedPath;
     char* description;
     int startingMinionCount;
     bool isDebugLevel;
+    char bakedDescription[BAKED_DESCRIPTION_LENGTH];
 } Level;
 
+// Baked level file, made from the map images by running the game with --bake-levels.
+// Header, then width * height tile types, then the tower, enemy minion and trap spawns
+#define BAKED_LEVEL_MAGIC 0x564C444C // "LDLV"
+#define BAKED_LEVEL_VERSION 1
+
+typedef struct BakedLevelHeader {
+    unsigned int magic;
+    unsigned int version;
+    int width;
+    int height;
+    int startingMinionCount;
+    int isDebugLevel;
+    int towerCount;
+    int minionGroupCount;
+    int trapCount;
+    char description[BAKED_DESCRIPTION_LENGTH];
+} BakedLevelHeader;
+
+typedef struct BakedTower {
+    int type;
+    int x, y;
+    float health;
+} BakedTower;
+
+// Enemy minions scattered over one tile
+typedef struct BakedMinionGroup {
+    int x, y;
+    int count;
+} BakedMinionGroup;
+
+typedef struct BakedTrap {
+    int x, y;
+} BakedTrap;
+
 typedef struct GlobalId {
     int type;
     int id;
@@ -455,8 +1023,7 @@ typedef struct GlobalId {
 #define TOWER_TYPE 1
 #define PROJECTILE_TYPE 2
 #define TRAP_TYPE 3
-#define PARTICLE_TYPE 4
-#define TYPE_COUNT 5
+#define TYPE_COUNT 4
 
 #define ARROW_PROJECTILE_TYPE 0
 #define BOMB_PROJECTILE_TYPE 1
@@ -464,8 +1031,40 @@ typedef struct GlobalId {
 #define ARCHER_TOWER_TYPE 0
 #define BOMB_TOWER_TYPE 1
 #define SUMMONER_TOWER_TYPE 2
-
-EntityClass entityClasses[TYPE_COUNT];
+#define TOWER_TYPE_COUNT 3
+
+#define DUST_EMITTER 0
+#define EXPLOSION_EMITTER 1
+#define FLASH_EMITTER 2
+#define DEBRIS_EMITTER 3
+#define EMITTER_COUNT 4
+
+#define DUST_PARTICLE 0
+#define FLASH_PARTICLE 1
+#define BRICK_PARTICLE 2
+
+// Everything the simulation reads and writes. The game plays in mainWorld; the placement
+// preview binds its own copy on its thread and runs the same code on it (see C Preview).
+// The render thread draws from copies of it (see C SimulationThread)
+typedef struct World {
+    EntityClass entityClasses[TYPE_COUNT];
+    unsigned int simulationTick;
+    TimerWheel timerWheel;
+    CommandArray commandBuffers[COMMAND_KIND_COUNT];
+    Arena levelArena; // Level lifetime memory, reset by loadLevel
+    TileMap currentTileMap;
+    IntArray minionIdsInRange;
+    int minionInventoryCount;
+    int enemyMinionCount;
+    bool hasPlacedMinion;
+    bool isMinionTargetRecalculationPending;
+    int levelNumber;
+    int levelLoadCount; // Bumped by every load and restart
+    unsigned int tileVersion; // Bumped whenever tile types change
+} World;
+
+World mainWorld;
+THREAD_LOCAL World* world = &mainWorld;
 
 
 //------------------------------------------------------------------------------------
@@ -473,38 +1072,56 @@ EntityClass entityClasses[TYPE_COUNT];
 //------------------------------------------------------------------------------------
 
 void damageTower(int id, int damageAmount);
-void updateMinion(int id, float delta);
-void updateTower(int id, float delta);
-void updateProjectile(int id, float delta);
-void updateTrap(int id, float delta);
-void updateParticle(int id, float delta);
-void drawMinion(int id);
-void drawTower(int id);
-void drawProjectile(int id);
-void drawTrap(int id);
-void drawParticle(int id);
+void updateMinions(float delta);
+void updateTraps(float delta);
+void onTowerAttackTimer(int id);
+void onProjectileImpactTimer(int id);
+void onMinionArrivalTimer(int id);
+void evaluateProjectile(int id);
+void evaluateProjectiles();
+void evaluateMinions();
+void prepareMinionSprite(int id, SpriteInstance* sprite);
+void prepareTowerSprite(int id, SpriteInstance* sprite);
+void prepareProjectileSprite(int id, SpriteInstance* sprite);
+void prepareTrapSprite(int id, SpriteInstance* sprite);
 void onMinionDestroyed(int id);
 void onTowerDestroyed(int id);
 void onProjectileDestroyed(int id);
 void onTrapDestroyed(int id);
-void onParticleDestroyed(int id);
 Entity* getEntity(int type, int id);
 TileData* getTile(TileMap* tileMap, int x, int y);
-TileMap loadTileMap(Image* mapImage);
+TileMap loadTileMap(const unsigned char* bakedLevel, Arena* arena);
 TileData* getTileAt(TileMap* tileMap, Vector2 position);
+bool isChunkActive(TileMap* tileMap, int chunkX, int chunkY);
+int* getTileMinionIds(TileMap* tileMap, TileData* tile, int faction, int* count);
+int findSlotsInRange(TileMap* tileMap, int start, int end, Vector2 position, float radiusSqr, int* slots, float* distancesSqr);
+void removeMinionFromGrid(int id);
+Vector2 getFlowDirection(TileMap* tileMap, int towerId, Vector2 position, Vector2 targetPosition);
+bool hasDirectFlow(TileMap* tileMap, int towerId, Vector2 position);
 void getMinionIdsInRange(IntArray* result, TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode);
+bool anyMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode);
+int getNearestMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode);
+int getRandomMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode, bool (*predicate)(Minion*, void*), void* context);
+bool isMinionNotTargetedByMinion(Minion* minion, void* context);
+bool isMinionNotTargetedByProjectile(Minion* minion, void* context);
+Vector2 getMinionSteering(TileMap* tileMap, int id);
 int spawnProjectile(int type, Vector2 startPosition, int targetMinionId, float totalAliveTime);
+int spawnMinionAt(Vector2 position, bool isPlayer);
 float calculateProjectileHeight(float timePercent);
+float calculateProjectileHeightSlope(float timePercent);
 void loadLevel(Level* level);
+void applyPlayerAction(PlayerAction* action);
 void gotoNextLevel();
+void onLevelWon();
 void reloadLevel();
 void resetClass(int type);
 void gotoPreviousLevel();
 void quickSortGlobalId(GlobalId arr[], int low, int high);
-int explodeAt(Vector2 position, float radius);
-int spawnParticle(
+void resolveExplosions(Command* explosions, int count);
+bool spawnParticle(
+    int emitter,
     Vector3 position,
-    Texture2D* sprite,
+    int sprite,
     Vector3 velocity,
     Vector3 acceleration,
     float duration,
@@ -515,55 +1132,52 @@ int spawnParticle(
     float endScale
 );
 
-
 //------------------------------------------------------------------------------------
 // C EntityClass
 //------------------------------------------------------------------------------------
 
 void initClass(int type) {
-    EntityClass* entityClass = &entityClasses[type];
+    EntityClass* entityClass = &world->entityClasses[type];
 
     switch(type) {
         case MINION_TYPE:
             entityClass->bankSize = 1000;
             entityClass->structSize = sizeof(Minion);
-            entityClass->update = &updateMinion;
-            entityClass->draw = &drawMinion;
+            entityClass->updateAll = &updateMinions;
+            entityClass->evaluateAll = &evaluateMinions;
+            entityClass->prepareSprite = &prepareMinionSprite;
             entityClass->destroyCallback = &onMinionDestroyed;
             break;
         case TOWER_TYPE:
             entityClass->bankSize = 10;
             entityClass->structSize = sizeof(Tower);
-            entityClass->update = &updateTower;
-            entityClass->draw = &drawTower;
+            entityClass->updateAll = NULL;
+            entityClass->evaluateAll = NULL;
+            entityClass->prepareSprite = &prepareTowerSprite;
             entityClass->destroyCallback = &onTowerDestroyed;
             break;
         case PROJECTILE_TYPE:
             entityClass->bankSize = 1000;
             entityClass->structSize = sizeof(Projectile);
-            entityClass->update = &updateProjectile;
-            entityClass->draw = &drawProjectile;
+            entityClass->updateAll = NULL;
+            entityClass->evaluateAll = &evaluateProjectiles;
+            entityClass->prepareSprite = &prepareProjectileSprite;
             entityClass->destroyCallback = &onProjectileDestroyed;
             break;
         case TRAP_TYPE:
             entityClass->bankSize = 30;
             entityClass->structSize = sizeof(Trap);
-            entityClass->update = &updateTrap;
-            entityClass->draw = &drawTrap;
+            entityClass->updateAll = &updateTraps;
+            entityClass->evaluateAll = NULL;
+            entityClass->prepareSprite = &prepareTrapSprite;
             entityClass->destroyCallback = &onTrapDestroyed;
             break;
-        case PARTICLE_TYPE:
-            entityClass->bankSize = 1000;
-            entityClass->structSize = sizeof(Particle);
-            entityClass->update = &updateParticle;
-            entityClass->draw = &drawParticle;
-            entityClass->destroyCallback = &onParticleDestroyed;
-            break;
     }
     
 
     int allocSize = entityClass->bankSize * entityClass->structSize;
-    entityClass->bank = malloc(allocSize);
+    entityClass->bank = allocate(ENTITY_MEMORY, allocSize);
+    memset(entityClass->bank, 0, allocSize);
     
     resetClass(type);
 
@@ -574,7 +1188,7 @@ void initClass(int type) {
 }
 
 void resetClass(int type) {
-    EntityClass* entityClass = &entityClasses[type];
+    EntityClass* entityClass = &world->entityClasses[type];
 
     for ITERATE(id, entityClass->bankSize) {
         Entity* entity = getEntity(type, id);
@@ -584,7 +1198,7 @@ void resetClass(int type) {
 }
 
 void destroyClass(int type) {
-    EntityClass* entityClass = &entityClasses[type];
+    EntityClass* entityClass = &world->entityClasses[type];
     free(entityClass->bank);
 }
 
@@ -596,12 +1210,29 @@ void destroyClass(int type) {
 
 
 Entity* getEntity(int type, int id) {
-    return ((intptr_t)entityClasses[type].bank + id * entityClasses[type].structSize);
+    return ((intptr_t)world->entityClasses[type].bank + id * world->entityClasses[type].structSize);
+}
+
+// For code that knows the type, the stride is a compile time constant instead of structSize
+inline Minion* getMinion(int id) {
+    return (Minion*) world->entityClasses[MINION_TYPE].bank + id;
+}
+
+inline Tower* getTower(int id) {
+    return (Tower*) world->entityClasses[TOWER_TYPE].bank + id;
+}
+
+inline Projectile* getProjectile(int id) {
+    return (Projectile*) world->entityClasses[PROJECTILE_TYPE].bank + id;
+}
+
+inline Trap* getTrap(int id) {
+    return (Trap*) world->entityClasses[TRAP_TYPE].bank + id;
 }
 
 
 int createEntity(int type) {
-    EntityClass* entityClass = &entityClasses[type];
+    EntityClass* entityClass = &world->entityClasses[type];
     for(int i = (entityClass->lastSpawnedId + 1) % entityClass->bankSize; 
         i != entityClass->lastSpawnedId; i = (i+1) % entityClass->bankSize)
     {
@@ -611,7 +1242,9 @@ int createEntity(int type) {
         if (!entity->isSpawned)
         {
             entity->isSpawned = true;
-            entity->lifeTime = 0;
+            entity->isDestroyQueued = false;
+            entity->spawnTick = world->simulationTick;
+            entity->generation++;
             entityClass->spawnCount++;
             entityClass->lastSpawnedId = i;
             return i;
@@ -624,8 +1257,167 @@ int createEntity(int type) {
 void destroyEntity(int type, int id) {
     Entity* entity = getEntity(type, id);
     entity->isSpawned = false;
-    entityClasses[type].spawnCount--;
-    entityClasses[type].destroyCallback(id);
+    entity->isDestroyQueued = false;
+    world->entityClasses[type].spawnCount--;
+    world->entityClasses[type].destroyCallback(id);
+}
+
+// Seconds since spawning, in whole simulation ticks
+float getLifeTime(const Entity* entity) {
+    return (world->simulationTick - entity->spawnTick) * TICK_DELTA;
+}
+
+// Spawned and not waiting to be destroyed at the end of the tick
+bool isEntityAlive(int type, int id) {
+    Entity* entity = getEntity(type, id);
+    return entity->isSpawned && !entity->isDestroyQueued;
+}
+
+
+//------------------------------------------------------------------------------------
+// C Commands
+//------------------------------------------------------------------------------------
+
+// Structural changes made while the banks are being iterated (spawns, destroys, damage)
+// are recorded here and applied together by applyCommands() once the update pass is done.
+
+
+
+
+void initCommandArray(CommandArray* a, size_t initialSize) {
+    a->array = allocate(COMMAND_MEMORY, initialSize * sizeof(Command));
+    a->used = 0;
+    a->size = initialSize;
+}
+
+Command* pushCommandArray(CommandArray* a) {
+    if (a->used == a->size) {
+        a->size *= 2;
+        a->array = reallocate(COMMAND_MEMORY, a->array, a->size * sizeof(Command));
+    }
+    return &a->array[a->used++];
+}
+
+void freeCommandArray(CommandArray* a) {
+    free(a->array);
+    a->array = NULL;
+    a->used = a->size = 0;
+}
+
+void initCommandBuffers() {
+    for ITERATE(kind, COMMAND_KIND_COUNT) {
+        initCommandArray(&world->commandBuffers[kind], 64);
+    }
+}
+
+void clearCommandBuffers() {
+    for ITERATE(kind, COMMAND_KIND_COUNT) {
+        world->commandBuffers[kind].used = 0;
+    }
+}
+
+void destroyCommandBuffers() {
+    for ITERATE(kind, COMMAND_KIND_COUNT) {
+        freeCommandArray(&world->commandBuffers[kind]);
+    }
+}
+
+// Returns false if the entity is already dead or already queued
+bool queueDestroyEntity(int type, int id) {
+    if (!isEntityAlive(type, id)) return false;
+    getEntity(type, id)->isDestroyQueued = true;
+    if (type == MINION_TYPE) removeMinionFromGrid(id);
+
+    Command* command = pushCommandArray(&world->commandBuffers[DESTROY_COMMAND]);
+    command->type = type;
+    command->id = id;
+    return true;
+}
+
+void queueDamageTower(int id, int damageAmount) {
+    Command* command = pushCommandArray(&world->commandBuffers[DAMAGE_TOWER_COMMAND]);
+    command->type = TOWER_TYPE;
+    command->id = id;
+    command->amount = damageAmount;
+}
+
+void queueSpawnMinion(Vector2 position, bool isPlayer) {
+    Command* command = pushCommandArray(&world->commandBuffers[SPAWN_MINION_COMMAND]);
+    command->type = MINION_TYPE;
+    command->minion.position = position;
+    command->minion.isPlayer = isPlayer;
+}
+
+void queueSpawnProjectile(int type, Vector2 startPosition, int targetMinionId, float totalAliveTime) {
+    Command* command = pushCommandArray(&world->commandBuffers[SPAWN_PROJECTILE_COMMAND]);
+    command->type = PROJECTILE_TYPE;
+    command->id = targetMinionId;
+    command->projectile.type = type;
+    command->projectile.startPosition = startPosition;
+    command->projectile.totalAliveTime = totalAliveTime;
+}
+
+// Resolved together with every other explosion of the tick, see C Explosion
+void queueExplosion(Vector2 position, float radius) {
+    Command* command = pushCommandArray(&world->commandBuffers[EXPLOSION_COMMAND]);
+    command->explosion.position = position;
+    command->explosion.radius = radius;
+}
+
+int compareDestroyCommands(const void* a, const void* b) {
+    const Command* c1 = a;
+    const Command* c2 = b;
+    if (c1->type != c2->type) return c1->type - c2->type;
+    return c1->id - c2->id;
+}
+
+void applyCommand(int kind, Command* command) {
+    switch (kind) {
+        case DAMAGE_TOWER_COMMAND:
+            if (isEntityAlive(TOWER_TYPE, command->id))
+                damageTower(command->id, command->amount);
+            break;
+        case DESTROY_COMMAND:
+            destroyEntity(command->type, command->id);
+            break;
+        case SPAWN_MINION_COMMAND:
+            spawnMinionAt(command->minion.position, command->minion.isPlayer);
+            break;
+        case SPAWN_PROJECTILE_COMMAND:
+            // Target may have died later in the same tick
+            if (isEntityAlive(MINION_TYPE, command->id))
+                spawnProjectile(command->projectile.type, command->projectile.startPosition, command->id, command->projectile.totalAliveTime);
+            break;
+    }
+}
+
+// Applies every queued command, one kind at a time. Destroy callbacks may queue
+// more commands, so keep going until all the buffers are drained.
+void applyCommands() {
+    bool hasPending = true;
+    while (hasPending) {
+        hasPending = false;
+        for ITERATE(kind, COMMAND_KIND_COUNT) {
+            CommandArray* buffer = &world->commandBuffers[kind];
+            if (buffer->used == 0) continue;
+            hasPending = true;
+
+            if (kind == EXPLOSION_COMMAND) {
+                resolveExplosions(buffer->array, buffer->used);
+                buffer->used = 0;
+                continue;
+            }
+            if (kind == DESTROY_COMMAND)
+                qsort(buffer->array, buffer->used, sizeof(Command), compareDestroyCommands);
+
+            // Commands pushed by callbacks while applying are picked up by this loop
+            for (size_t i = 0; i < buffer->used; i++) {
+                Command command = buffer->array[i];
+                applyCommand(kind, &command);
+            }
+            buffer->used = 0;
+        }
+    }
 }
 
 //------------------------------------------------------------------------------------
@@ -641,7 +1433,7 @@ typedef struct GlobalIdArray {
 
 
 void initGlobalIdArray(GlobalIdArray* a, size_t initialSize) {
-    a->array = malloc(initialSize * sizeof(GlobalId));
+    a->array = allocate(ARRAY_MEMORY, initialSize * sizeof(GlobalId));
     a->used = 0;
     a->size = initialSize;
 }
@@ -649,7 +1441,7 @@ void initGlobalIdArray(GlobalIdArray* a, size_t initialSize) {
 void insertGlobalIdArray(GlobalIdArray* a, GlobalId element) {
     if (a->used == a->size) {
         a->size *= 2;
-        a->array = realloc(a->array, a->size * sizeof(GlobalId));
+        a->array = reallocate(ARRAY_MEMORY, a->array, a->size * sizeof(GlobalId));
     }
     a->array[a->used++] = element;
 }
@@ -720,21 +1512,27 @@ void sortGlobalIdArrayByDepth(GlobalIdArray* a) {
 #define LEVEL_COUNT 8
 
 Level levels[LEVEL_COUNT];
-bool isMinionTargetRecalculationPending;
-int minionInventoryCount;
 float timeSinceLastInventoryIncrease;
 float timeSinceLastInventoryDecrease;
 int currentLevelNumber = 0;
 int pendingLevelNumber = -1;
 float levelStartTime = 0.0;
-TileMap currentTileMap;
-IntArray minionIdsInRange;
 GlobalIdArray allEntities;
+IntArray visibleMinionIds;
+
+// Reset every frame
+typedef struct CullStats {
+    int drawnSprites;
+    int culledSprites;
+    int drawnTiles;
+    int culledTiles;
+} CullStats;
+
+CullStats cullStats;
+bool isDebugOverlayVisible;
 RenderTexture2D worldRenderTexture;
 float LEVEL_TRANSITION_TIME_MAX = 1.0;
 float levelTransitionTime = 0.0;
-int enemyMinionCount;
-bool hasPlacedMinion;
 bool inMenu = true;;
 
 const int spawnDeltaDis = 10;
@@ -746,92 +1544,278 @@ Vector2 lastSpawnPoint;
 
 
 //------------------------------------------------------------------------------------
-// C Utils
+// C Timers
 //------------------------------------------------------------------------------------
 
+// Hierarchical timing wheel keyed on simulationTick. Three levels of 256 slots: level 0
+// holds events due within 256 ticks, level 1 within 65536, level 2 the rest. When level 0
+// wraps, the matching slot of the level above is re-inserted one level down, so each event
+// is touched once per level instead of every tick. Events point at an entity and are
+// dropped when they fire if that entity slot has since died or been reused.
 
+#define MAX_TIMER_DELAY ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
 
-//------------------------------------------------------------------------------------
-// C Minions
-//------------------------------------------------------------------------------------
+#define TOWER_ATTACK_TIMER 0
+#define PROJECTILE_IMPACT_TIMER 1
+#define MINION_ARRIVAL_TIMER 2
 
-#define ENEMY_MINION_VIEW_RADIUS_LONG 600
-#define ENEMY_MINION_VIEW_RADIUS_SHORT 300
 
-void particleKickDust(Vector2 position, float height) {
-    spawnParticle(
-        (Vector3) { position.x - 10, position.y, height},
-        &DUST_PARTICLE_SPRITE,
-        (Vector3) { -20, 0, 0 }, (Vector3) { 0, 0, 100 },
-        1.0, 0.5, WHITE, GetColor(0xFFFFFF00), 1.0, 0.2
-    );
+void clearTimers() {
+    for ITERATE(level, TIMER_WHEEL_LEVELS) {
+        for ITERATE(slot, TIMER_WHEEL_SLOTS) {
+            world->timerWheel.slots[level][slot] = NULLID;
+        }
+    }
 
-    spawnParticle(
-        (Vector3) { position.x + 10, position.y, height },
-        &DUST_PARTICLE_SPRITE,
-        (Vector3) { 20, 0, 0 }, (Vector3) { 0, 0, 100 },
-        1.0, 0.5, WHITE, GetColor(0xFFFFFF00), 1.0, 0.2
-    );
+    // Thread every event onto the free list
+    for ITERATE(i, world->timerWheel.eventCapacity) {
+        world->timerWheel.events[i].next = i + 1 < world->timerWheel.eventCapacity ? i + 1 : NULLID;
+    }
+    world->timerWheel.freeEvent = 0;
+    world->timerWheel.currentTick = world->simulationTick;
 }
 
-void updateMinion(int id, float delta) {
-    Minion* minion = getEntity(MINION_TYPE, id);
+void initTimers() {
+    world->timerWheel.eventCapacity = 256;
+    world->timerWheel.events = allocate(TIMER_MEMORY, sizeof(TimerEvent) * world->timerWheel.eventCapacity);
+    clearTimers();
+}
 
-    if (minion->isPlayer) {
-        if (isMinionTargetRecalculationPending) {
-            minion->targetId = calculateMinionTarget(id);
+void destroyTimers() {
+    free(world->timerWheel.events);
+    world->timerWheel.events = NULL;
+    world->timerWheel.eventCapacity = 0;
+}
+
+int allocateTimerEvent() {
+    if (world->timerWheel.freeEvent == NULLID) {
+        int oldCapacity = world->timerWheel.eventCapacity;
+        world->timerWheel.eventCapacity *= 2;
+        world->timerWheel.events = reallocate(TIMER_MEMORY, world->timerWheel.events, sizeof(TimerEvent) * world->timerWheel.eventCapacity);
+        for (int i = oldCapacity; i < world->timerWheel.eventCapacity; i++) {
+            world->timerWheel.events[i].next = i + 1 < world->timerWheel.eventCapacity ? i + 1 : NULLID;
         }
+        world->timerWheel.freeEvent = oldCapacity;
+    }
 
-        
+    int index = world->timerWheel.freeEvent;
+    world->timerWheel.freeEvent = world->timerWheel.events[index].next;
+    return index;
+}
 
-        // UPDATE POSITION
-       
-    } else {
-        getMinionIdsInRange(&minionIdsInRange, &currentTileMap, minion->entity.position, MINION_ATTACK_RANGE, PLAYER_ONLY);
+void insertTimerEvent(int index) {
+    TimerEvent* event = &world->timerWheel.events[index];
+    if (event->dueTick < world->timerWheel.currentTick) event->dueTick = world->timerWheel.currentTick;
 
-        if (minionIdsInRange.used) {
-            minion->targetId = minionIdsInRange.array[0];
-        }
-        else if (minion->targetId == NULLID || !getEntity(MINION_TYPE, minion->targetId)->isSpawned) {
-            minion->targetId = NULLID;
+    unsigned int delay = event->dueTick - world->timerWheel.currentTick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delay >= 1u << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
 
-            // Find new minion to attack
-            getMinionIdsInRange(&minionIdsInRange, &currentTileMap, minion->entity.position, ENEMY_MINION_VIEW_RADIUS_SHORT, PLAYER_ONLY);
+    int slot = (event->dueTick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    event->next = world->timerWheel.slots[level][slot];
+    world->timerWheel.slots[level][slot] = index;
+}
 
-            // Filter to only non targted minions
-            int count = minionIdsInRange.used;
-            int newTargetId = NULLID;
+// Fires kind for the entity delayTicks from now (at least one tick)
+void scheduleEntityTimer(int kind, int type, int id, unsigned int delayTicks) {
+    delayTicks = imax(1, imin(delayTicks, MAX_TIMER_DELAY));
+
+    int index = allocateTimerEvent();
+    TimerEvent* event = &world->timerWheel.events[index];
+    event->kind = kind;
+    event->type = type;
+    event->id = id;
+    event->generation = getEntity(type, id)->generation;
+    event->dueTick = world->simulationTick + delayTicks;
+    insertTimerEvent(index);
+}
 
-            if (count)
-            {
-                int newI = GetRandomValue(0, minionIdsInRange.used - 1);
-                newTargetId = minionIdsInRange.array[newI];
-            }
+void fireTimerEvent(TimerEvent* event) {
+    Entity* entity = getEntity(event->type, event->id);
+    if (!entity->isSpawned || entity->isDestroyQueued || entity->generation != event->generation) return;
 
-            getMinionIdsInRange(&minionIdsInRange, &currentTileMap, minion->entity.position, ENEMY_MINION_VIEW_RADIUS_LONG, PLAYER_ONLY);
-            count = minionIdsInRange.used;
-            int j = 0;
-            // PREFER NON USED MINION
-            for ITERATE(i, count) {
-                int id = minionIdsInRange.array[i];
-                Minion* minion = getEntity(MINION_TYPE, id);
+    switch (event->kind) {
+        case TOWER_ATTACK_TIMER: onTowerAttackTimer(event->id); break;
+        case PROJECTILE_IMPACT_TIMER: onProjectileImpactTimer(event->id); break;
+        case MINION_ARRIVAL_TIMER: onMinionArrivalTimer(event->id); break;
+    }
+}
 
-                if (!minion->isMinionTargeted) {
-                    minionIdsInRange.array[j++] = minionIdsInRange.array[i];
-                }
-                else {
-                    minionIdsInRange.used--;
-                }
-            }
+// Fires everything due on the current simulationTick
+void advanceTimers() {
+    unsigned int tick = world->simulationTick;
+    if (world->timerWheel.currentTick != tick) return;
+
+    // Pull the next block of events down a level when a lower level wraps
+    for (int level = TIMER_WHEEL_LEVELS - 1; level >= 1; level--) {
+        unsigned int levelMask = (1u << (TIMER_WHEEL_BITS * level)) - 1;
+        if ((tick & levelMask) != 0) continue;
+
+        int slot = (tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+        int index = world->timerWheel.slots[level][slot];
+        world->timerWheel.slots[level][slot] = NULLID;
+        while (index != NULLID) {
+            int next = world->timerWheel.events[index].next;
+            insertTimerEvent(index);
+            index = next;
+        }
+    }
+
+    int* slot = &world->timerWheel.slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+    world->timerWheel.currentTick = tick + 1;
+
+    while (*slot != NULLID) {
+        int index = *slot;
+        *slot = world->timerWheel.events[index].next;
+
+        // Copy out and free first, firing may schedule new events
+        TimerEvent event = world->timerWheel.events[index];
+        world->timerWheel.events[index].next = world->timerWheel.freeEvent;
+        world->timerWheel.freeEvent = index;
+
+        fireTimerEvent(&event);
+    }
+}
+
+
+//------------------------------------------------------------------------------------
+// C Utils
+//------------------------------------------------------------------------------------
+
+
+
+//------------------------------------------------------------------------------------
+// C Minions
+//------------------------------------------------------------------------------------
+
+#define ENEMY_MINION_VIEW_RADIUS_LONG 600
+#define ENEMY_MINION_VIEW_RADIUS_SHORT 300
+// Steering above this keeps a minion on per tick movement, cohesion alone isn't enough
+#define STRAIGHT_MOVE_MAX_STEERING 0.1
+
+void particleKickDust(Vector2 position, float height) {
+    spawnParticle(
+        DUST_EMITTER,
+        (Vector3) { position.x - 10, position.y, height},
+        DUST_PARTICLE,
+        (Vector3) { -20, 0, 0 }, (Vector3) { 0, 0, 100 },
+        1.0, 0.5, WHITE, GetColor(0xFFFFFF00), 1.0, 0.2
+    );
+
+    spawnParticle(
+        DUST_EMITTER,
+        (Vector3) { position.x + 10, position.y, height },
+        DUST_PARTICLE,
+        (Vector3) { 20, 0, 0 }, (Vector3) { 0, 0, 100 },
+        1.0, 0.5, WHITE, GetColor(0xFFFFFF00), 1.0, 0.2
+    );
+}
+
+// Works for minions in either movement mode
+Vector2 getMinionPosition(Minion* minion) {
+    if (!minion->isMovingStraight) return minion->entity.position;
+
+    float time = (world->simulationTick - minion->moveStartTick) * TICK_DELTA;
+    return Vector2Add(minion->moveStartPosition, Vector2Scale(minion->velocity, time));
+}
+
+// Walk to the target tower without per tick updates, the arrival timer does the attack.
+// Returns false if the tower is already in range
+bool startMinionStraightMove(int id, Vector2 targetPosition, float speed) {
+    Minion* minion = getMinion(id);
+    float distance = Vector2Distance(minion->entity.position, targetPosition);
+    if (distance < MINION_ATTACK_RANGE) return false;
+
+    // First tick at which the minion is within attack range
+    unsigned int travelTicks = (unsigned int) ((distance - MINION_ATTACK_RANGE) / (speed * TICK_DELTA)) + 1;
+
+    minion->velocity = Vector2Scale(Vector2Normalize(Vector2Subtract(targetPosition, minion->entity.position)), speed);
+    minion->moveStartPosition = minion->entity.position;
+    minion->moveStartTick = world->simulationTick;
+    minion->arrivalTick = world->simulationTick + travelTicks;
+    minion->isMovingStraight = true;
+
+    scheduleEntityTimer(MINION_ARRIVAL_TIMER, MINION_TYPE, id, travelTicks);
+    return true;
+}
+
+// Back to per tick movement from wherever the minion is now
+void stopMinionStraightMove(Minion* minion) {
+    if (!minion->isMovingStraight) return;
+
+    minion->entity.position = getMinionPosition(minion);
+    minion->isMovingStraight = false;
+}
+
+void attackWithMinion(int id) {
+    Minion* minion = getMinion(id);
+
+    if (minion->isPlayer) {
+        queueDamageTower(minion->targetId, 1);
+    } else {
+        queueDestroyEntity(MINION_TYPE, minion->targetId);
+    }
+    playSoundInstance(MINION_HURT_SOUND, 0.5, randRange(0.9, 1.1));
+    shakeCamera(1.0, 0.1);
+    queueDestroyEntity(MINION_TYPE, id);
+}
+
+void onMinionArrivalTimer(int id) {
+    Minion* minion = getMinion(id);
+
+    // Stale event from an earlier straight move
+    if (!minion->isMovingStraight || minion->arrivalTick != world->simulationTick) return;
+
+    stopMinionStraightMove(minion);
+    if (minion->targetId != NULLID && isEntityAlive(TOWER_TYPE, minion->targetId)) {
+        attackWithMinion(id);
+    }
+}
+
+// Only minions moving in a straight line have a stale position
+void evaluateMinions() {
+    Minion* minions = world->entityClasses[MINION_TYPE].bank;
+    for ITERATE(id, world->entityClasses[MINION_TYPE].bankSize) {
+        Minion* minion = &minions[id];
+        if (minion->entity.isSpawned && minion->isMovingStraight) minion->entity.position = getMinionPosition(minion);
+    }
+}
+
+void updateMinion(Minion* minion, int id, float delta) {
+    if (minion->isPlayer) {
+        if (world->isMinionTargetRecalculationPending) {
+            int targetId = calculateMinionTarget(id);
+            if (targetId != minion->targetId) stopMinionStraightMove(minion);
+            minion->targetId = targetId;
+        }
+
+        // Nothing to do until the arrival timer
+        if (minion->isMovingStraight) return;
+
+        // UPDATE POSITION
+       
+    } else {
+        int closestId = getNearestMinionInRange(&world->currentTileMap, minion->entity.position, MINION_ATTACK_RANGE, PLAYER_ONLY);
+
+        if (closestId != NULLID) {
+            minion->targetId = closestId;
+        }
+        else if (minion->targetId == NULLID || !isEntityAlive(MINION_TYPE, minion->targetId)) {
+            minion->targetId = NULLID;
 
-            if (minionIdsInRange.used > 0) {
-                int i = GetRandomValue(0, minionIdsInRange.used - 1);
-                newTargetId = minionIdsInRange.array[i];
+            // Find new minion to attack, prefer ones nobody is going for yet
+            int newTargetId = getRandomMinionInRange(&world->currentTileMap, minion->entity.position, ENEMY_MINION_VIEW_RADIUS_LONG, PLAYER_ONLY,
+                isMinionNotTargetedByMinion, NULL);
+
+            if (newTargetId == NULLID) {
+                newTargetId = getRandomMinionInRange(&world->currentTileMap, minion->entity.position, ENEMY_MINION_VIEW_RADIUS_SHORT, PLAYER_ONLY, NULL, NULL);
             }
 
             if (newTargetId != NULLID)
             {
-                Minion* targetMinion = getEntity(MINION_TYPE, newTargetId);
+                Minion* targetMinion = getMinion(newTargetId);
                 targetMinion->isMinionTargeted = true;
                 minion->targetId = newTargetId;
                 particleKickDust(minion->entity.position, 5);
@@ -840,17 +1824,32 @@ void updateMinion(int id, float delta) {
         }
     }
 
-    int opponentType = minion->isPlayer ? TOWER_TYPE : MINION_TYPE;
+    Vector2 targetPosition = Vector2Zero();
+    if (minion->targetId != NULLID) {
+        targetPosition = minion->isPlayer
+            ? getTower(minion->targetId)->entity.position
+            : getMinionPosition(getMinion(minion->targetId));
+    }
     bool inRange = minion->targetId != NULLID
-        && Vector2Distance(minion->entity.position, getEntity(opponentType, minion->targetId)->position) < MINION_ATTACK_RANGE;
+        && Vector2Distance(minion->entity.position, targetPosition) < MINION_ATTACK_RANGE;
     // UPDATE VELOCITY
     if (minion->targetId != NULLID && !inRange) {
-        Entity* targetEntity = getEntity(opponentType, minion->targetId);
-        Vector2 moveDirection = Vector2Normalize(
-            Vector2Subtract(targetEntity->position, minion->entity.position)
-        );
+        float speed = minion->isPlayer ? PLAYER_MINION_SPEED : ENEMY_MINION_SPEED;
+        Vector2 steering = getMinionSteering(&world->currentTileMap, id);
+
+        // Clear line to the tower and nobody to avoid
+        if (minion->isPlayer && Vector2Length(steering) <= STRAIGHT_MOVE_MAX_STEERING
+            && hasDirectFlow(&world->currentTileMap, minion->targetId, minion->entity.position)
+            && startMinionStraightMove(id, targetPosition, speed)) {
+            return;
+        }
 
-        minion->velocity = Vector2Scale(moveDirection, minion->isPlayer ? PLAYER_MINION_SPEED : ENEMY_MINION_SPEED);
+        Vector2 moveDirection = minion->isPlayer
+            ? getFlowDirection(&world->currentTileMap, minion->targetId, minion->entity.position, targetPosition)
+            : Vector2Normalize(Vector2Subtract(targetPosition, minion->entity.position));
+
+        moveDirection = Vector2Add(moveDirection, steering);
+        minion->velocity = Vector2ClampValue(Vector2Scale(moveDirection, speed), 0, speed);
     }
     else {
         minion->velocity = Vector2Zero();
@@ -860,61 +1859,60 @@ void updateMinion(int id, float delta) {
 
     // ATTACK
     if (minion->targetId != NULLID && inRange) {
-        if (minion->isPlayer) {
-            damageTower(minion->targetId, 1);
-        } else {
-            destroyEntity(MINION_TYPE, minion->targetId);
-        }
-        playSoundInstance(MINION_HURT_SOUND, 0.5, randRange(0.9, 1.1));
-        shakeCamera(1.0, 0.1);
-        destroyEntity(MINION_TYPE, id);
+        attackWithMinion(id);
         return;
     }
 
     minion->entity.position = Vector2Add(minion->entity.position, Vector2Scale(minion->velocity, delta));
 }
 
-void drawMinion(int id) {
-    Minion* minion = getEntity(MINION_TYPE, id);
-    if (!minion->entity.isSpawned) return;
+// The whole bank in one call over the typed array, so updateMinion inlines into the loop.
+// Straight moving player minions wait for their arrival timer and are skipped here
+void updateMinions(float delta) {
+    Minion* minions = world->entityClasses[MINION_TYPE].bank;
 
-    Vector2 p = minion->entity.position;
-    //DrawRectangle(p.x - 5, p.y - 5, 10, 10, RED);
-    Vector2 p2 = p;
-    float oldNotAbs = minion->entity.height;
-    float notAbs = sin(minion->entity.lifeTime * 10) * 7;
-    minion->entity.height = notAbs; // very hacky
-    /*if ((oldNotAbs > 0 && notAbs <= 0) || (oldNotAbs <= 0 && notAbs > 0)) {
-        playSoundInstance(MINION_WALK_SOUND);
-    }*/
+    for ITERATE(id, world->entityClasses[MINION_TYPE].bankSize) {
+        Minion* minion = &minions[id];
+        if (!minion->entity.isSpawned || minion->entity.isDestroyQueued) continue;
+        if (minion->isMovingStraight && minion->isPlayer && !world->isMinionTargetRecalculationPending) continue;
+        updateMinion(minion, id, delta);
+    }
+}
 
-    p2.y -= abs(notAbs);
-    Texture2D* sprite = minion->isPlayer ? &PLAYER_MINION_SPRITE : &ENEMY_MINION_SPRITE;
-    Color color = minion->isPlayer ? GetColor(PLAYER_COLOR) : GetColor(ENEMY_COLOR);
+void prepareMinionSprite(int id, SpriteInstance* sprite) {
+    const Minion* minion = getMinion(id);
+    float lifeTime = getLifeTime(&minion->entity);
 
     Vector2 scale = Vector2One();
-    if (minion->entity.lifeTime < 5.0) {
-        scale = getSquashScale(minion->entity.lifeTime, 1.2);
+    if (lifeTime < 5.0) {
+        scale = getSquashScale(lifeTime, 1.2);
     }
-    drawSpriteAnchoredScaled(*sprite, p2, 0, scale, (Vector2) { 0.5, 1.0 }, color);
-    
-   
-    
+
+    *sprite = (SpriteInstance){
+        .texture = minion->isPlayer ? &PLAYER_MINION_SPRITE : &ENEMY_MINION_SPRITE,
+        .position = { minion->entity.position.x, minion->entity.position.y - getMinionBob(lifeTime) },
+        .scale = scale,
+        .anchor = { 0.5, 1.0 },
+        .tint = minion->isPlayer ? PLAYER_TINT : ENEMY_TINT,
+        .label = NULLID,
+    };
 }
 
 
 void onMinionDestroyed(int id) {
     
-    Minion* minion = getEntity(MINION_TYPE, id);
-    if (!minion->isPlayer) enemyMinionCount--;
+    Minion* minion = getMinion(id);
+    if (!minion->isPlayer) world->enemyMinionCount--;
+    stopMinionStraightMove(minion);
     particleKickDust(minion->entity.position, 5);
 
    /* for ITERATE(i, 6) {
         float startSize = randRange(1.2, 1.4);
         int colorHex = minion->isPlayer ? PLAYER_COLOR : ENEMY_COLOR;
         spawnParticle(
+            DUST_EMITTER,
             (Vector3) {minion->entity.position.x + randRange(-5, 5), minion->entity.position.y + randRange(-3, 3), randRange(0, 30) },
-            &DUST_PARTICLE_SPRITE,
+            DUST_PARTICLE,
             (Vector3) { randRange(-50, 50), randRange(-20, 20), randRange(0, 300) }, (Vector3) { 0, 0, -500 },
             randRange(1.1, 1.6), 2.0, GetColor(colorHex), GetColor(colorHex & 0xFFFFFF00), startSize, startSize - 0.3
         );
@@ -923,16 +1921,16 @@ void onMinionDestroyed(int id) {
 
 
 int calculateMinionTarget(int id) {
-    Minion* minion = getEntity(MINION_TYPE, id);
+    Minion* minion = getMinion(id);
 
     bool towerExists = false;
     int closestTowerId = NULLID;
     float sqrDistance = INFINITY;
-    for ITERATE(i, entityClasses[TOWER_TYPE].bankSize) {
-        Tower* tower = getEntity(TOWER_TYPE, i);
+    for ITERATE(i, world->entityClasses[TOWER_TYPE].bankSize) {
+        Tower* tower = getTower(i);
         if (!tower->entity.isSpawned) continue;
 
-        float sqrDistance2 = Vector2DistanceSqr(minion->entity.position, tower->entity.position);
+        float sqrDistance2 = Vector2DistanceSqr(getMinionPosition(minion), tower->entity.position);
         if (sqrDistance2 < sqrDistance)
         {
             closestTowerId = i;
@@ -946,14 +1944,15 @@ int calculateMinionTarget(int id) {
 
 int spawnMinionAt(Vector2 position, bool isPlayer) {
     
-    if (!isPlayer && enemyMinionCount >= MAX_ENEMY_MINION_COUNT) return NULLID;
+    if (!isPlayer && world->enemyMinionCount >= MAX_ENEMY_MINION_COUNT) return NULLID;
 
     int id = createEntity(MINION_TYPE);
     if (id == NULLID) return NULLID;
 
-    Minion* minion = getEntity(MINION_TYPE, id);
+    Minion* minion = getMinion(id);
 
     minion->entity.position = position;
+    minion->isMovingStraight = false;
     minion->velocity = (Vector2){ 0, 0 };
     minion->targetId = isPlayer ? calculateMinionTarget(id) : NULLID;
     minion->isPlayer = isPlayer;
@@ -963,41 +1962,394 @@ int spawnMinionAt(Vector2 position, bool isPlayer) {
 
     particleKickDust(minion->entity.position, 5);
 
-    if (!minion->isPlayer) enemyMinionCount++;
+    if (!minion->isPlayer) world->enemyMinionCount++;
 
     return id;
 }
 
 
 
+//------------------------------------------------------------------------------------
+// Minion Queries
+// Every query walks the grid through visitMinionsInRange, the visitor returns false
+// to stop early. Use the specific variants so nothing fills an array it throws away.
+
+// Return false to stop visiting
+typedef bool (*MinionVisitor)(int id, float distanceSqr, void* context);
+typedef bool (*MinionPredicate)(Minion* minion, void* context);
+
+#define MAX_NEAREST_MINIONS 32
+#define MINION_QUERY_BATCH 64
+
+typedef struct MinionQueryArea {
+    Vector2 position;
+    float radiusSqr;
+    int minX, maxX, minY, maxY;
+    int firstFaction, lastFaction;
+} MinionQueryArea;
+
+MinionQueryArea getMinionQueryArea(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode) {
+    MinionQueryArea area;
+    area.position = position;
+    area.radiusSqr = radius * radius;
+    area.minX = imax((position.x - radius) / TILE_SIZE, 0);
+    area.maxX = imin((position.x + radius) / TILE_SIZE, tileMap->width - 1);
+    area.minY = imax((position.y - radius) / TILE_SIZE, 0);
+    area.maxY = imin((position.y + radius) / TILE_SIZE, tileMap->height - 1);
+    area.firstFaction = mode == ENEMY_ONLY ? ENEMY_FACTION : PLAYER_FACTION;
+    area.lastFaction = mode == PLAYER_ONLY ? PLAYER_FACTION : ENEMY_FACTION;
+    return area;
+}
+
+// Tiles of row y the circle reaches, returns false if there are none
+bool getMinionQueryRowSpan(MinionQueryArea* area, int y, int* minX, int* maxX) {
+    Vector2 position = area->position;
+    float rowDistance = position.y < y * TILE_SIZE ? y * TILE_SIZE - position.y
+        : position.y > (y + 1) * TILE_SIZE ? position.y - (y + 1) * TILE_SIZE : 0;
+    float halfWidth = sqrtf(max(area->radiusSqr - rowDistance * rowDistance, 0));
+    *minX = imax((position.x - halfWidth) / TILE_SIZE, area->minX);
+    *maxX = imin((position.x + halfWidth) / TILE_SIZE, area->maxX);
+    return *minX <= *maxX;
+}
+
+// Grid slots of one faction's minions in tiles [minX, maxX] of row y.
+// They are contiguous, returns false if there are none
+bool getMinionGridRun(TileMap* tileMap, int faction, int y, int minX, int maxX, int* start, int* end) {
+    // Only the active chunks have cells, trim the row to them
+    int chunkY = y >> TILE_CHUNK_SHIFT;
+    int firstChunkX = minX >> TILE_CHUNK_SHIFT;
+    int lastChunkX = maxX >> TILE_CHUNK_SHIFT;
+    while (firstChunkX <= lastChunkX && !isChunkActive(tileMap, firstChunkX, chunkY)) firstChunkX++;
+    while (lastChunkX >= firstChunkX && !isChunkActive(tileMap, lastChunkX, chunkY)) lastChunkX--;
+    if (firstChunkX > lastChunkX) return false;
+    minX = imax(minX, firstChunkX << TILE_CHUNK_SHIFT);
+    maxX = imin(maxX, (lastChunkX << TILE_CHUNK_SHIFT) + TILE_CHUNK_MASK);
+
+    TileData* firstTile = getTile(tileMap, minX, y);
+    TileData* lastTile = getTile(tileMap, maxX, y);
+    *start = firstTile->minionStarts[faction];
+    *end = lastTile->minionStarts[faction] + lastTile->minionCounts[faction];
+    return *start < *end;
+}
+
+// Grid slots of one faction's minions in the tiles of row y the circle reaches
+bool getMinionQueryRow(TileMap* tileMap, MinionQueryArea* area, int faction, int y, int* start, int* end) {
+    int minX, maxX;
+    if (!getMinionQueryRowSpan(area, y, &minX, &maxX)) return false;
+    return getMinionGridRun(tileMap, faction, y, minX, maxX, start, end);
+}
+
+// Returns false if the visitor stopped early
+bool visitMinionsInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode, MinionVisitor visitor, void* context) {
+    MinionQueryArea area = getMinionQueryArea(tileMap, position, radius, mode);
+    int slots[MINION_QUERY_BATCH + 4];
+    float distancesSqr[MINION_QUERY_BATCH + 4];
+
+    for (int faction = area.firstFaction; faction <= area.lastFaction; faction++) {
+        for (int y = area.minY; y <= area.maxY; y++) {
+            int start, end;
+            if (!getMinionQueryRow(tileMap, &area, faction, y, &start, &end)) continue;
+
+            for (int batchStart = start; batchStart < end; batchStart += MINION_QUERY_BATCH) {
+                int batchEnd = imin(batchStart + MINION_QUERY_BATCH, end);
+                int matchCount = findSlotsInRange(tileMap, batchStart, batchEnd, position, area.radiusSqr, slots, distancesSqr);
+
+                for ITERATE(i, matchCount) {
+                    if (!visitor(tileMap->minionIds[slots[i]], distancesSqr[i], context)) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Straight from the kernel without visiting, stops once limit is reached
+int countMinionsInRangeUpTo(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode, int limit) {
+    MinionQueryArea area = getMinionQueryArea(tileMap, position, radius, mode);
+    int slots[MINION_QUERY_BATCH + 4];
+    float distancesSqr[MINION_QUERY_BATCH + 4];
+    int count = 0;
+
+    for (int faction = area.firstFaction; faction <= area.lastFaction; faction++) {
+        for (int y = area.minY; y <= area.maxY; y++) {
+            int start, end;
+            if (!getMinionQueryRow(tileMap, &area, faction, y, &start, &end)) continue;
+
+            for (int batchStart = start; batchStart < end; batchStart += MINION_QUERY_BATCH) {
+                int batchEnd = imin(batchStart + MINION_QUERY_BATCH, end);
+                count += findSlotsInRange(tileMap, batchStart, batchEnd, position, area.radiusSqr, slots, distancesSqr);
+                if (count >= limit) return limit;
+            }
+        }
+    }
+    return count;
+}
+
+bool collectMinionVisitor(int id, float distanceSqr, void* context) {
+    insertIntArray(context, id);
+    return true;
+}
+
 void getMinionIdsInRange(IntArray* result, TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode) {
-    int minX = imax((position.x - radius) / TILE_SIZE, 0);
-    int maxX = imin((position.x + radius) / TILE_SIZE, tileMap->width - 1);
-    int minY = imax((position.y - radius) / TILE_SIZE, 0);
-    int maxY = imin((position.y + radius) / TILE_SIZE, tileMap->height - 1);
+    result->used = 0;
+    visitMinionsInRange(tileMap, position, radius, mode, collectMinionVisitor, result);
+}
+
+bool anyMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode) {
+    return countMinionsInRangeUpTo(tileMap, position, radius, mode, 1) > 0;
+}
 
-    float radiusSqr = radius * radius;
+int countMinionsInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode) {
+    return countMinionsInRangeUpTo(tileMap, position, radius, mode, INT_MAX);
+}
 
+// Minion Density
+// Each active chunk keeps per faction prefix sums of its tile counts (TileData.minionSums),
+// built along with the grid. A block of tiles sums in O(1) per chunk it touches, cheap
+// enough to check crowds every tick. Counts are as of the last grid build.
 
-    
+// Minions in the chunk's tiles [0, x] x [0, y], 0 if either is negative
+int getChunkMinionSum(TileChunk* chunk, int faction, int x, int y) {
+    if (x < 0 || y < 0) return 0;
+    return chunk->tiles[(y << TILE_CHUNK_SHIFT) + x].minionSums[faction];
+}
+
+// Minions in tiles [minX, maxX] x [minY, maxY], clamped to the map
+int countMinionsInTiles(TileMap* tileMap, int minX, int minY, int maxX, int maxY, enum GetMinionMode mode) {
+    minX = imax(minX, 0);
+    minY = imax(minY, 0);
+    maxX = imin(maxX, tileMap->width - 1);
+    maxY = imin(maxY, tileMap->height - 1);
+    int firstFaction = mode == ENEMY_ONLY ? ENEMY_FACTION : PLAYER_FACTION;
+    int lastFaction = mode == PLAYER_ONLY ? PLAYER_FACTION : ENEMY_FACTION;
+    int count = 0;
+
+    for (int chunkY = minY >> TILE_CHUNK_SHIFT; chunkY <= maxY >> TILE_CHUNK_SHIFT; chunkY++) {
+        for (int chunkX = minX >> TILE_CHUNK_SHIFT; chunkX <= maxX >> TILE_CHUNK_SHIFT; chunkX++) {
+            if (!isChunkActive(tileMap, chunkX, chunkY)) continue;
+            TileChunk* chunk = tileMap->chunks[chunkY * tileMap->chunkColumns + chunkX];
+
+            int x0 = imax(minX - (chunkX << TILE_CHUNK_SHIFT), 0) - 1;
+            int y0 = imax(minY - (chunkY << TILE_CHUNK_SHIFT), 0) - 1;
+            int x1 = imin(maxX - (chunkX << TILE_CHUNK_SHIFT), TILE_CHUNK_MASK);
+            int y1 = imin(maxY - (chunkY << TILE_CHUNK_SHIFT), TILE_CHUNK_MASK);
+            for (int faction = firstFaction; faction <= lastFaction; faction++) {
+                count += getChunkMinionSum(chunk, faction, x1, y1) - getChunkMinionSum(chunk, faction, x0, y1)
+                    - getChunkMinionSum(chunk, faction, x1, y0) + getChunkMinionSum(chunk, faction, x0, y0);
+            }
+        }
+    }
+    return count;
+}
+
+// Of the tiles whose centres are within radius, the one whose block of tiles reaching
+// clusterRadius around it holds the most minions. Ties go to the first in row order.
+// Returns how many the block holds, 0 if there are no minions in range
+int getDensestMinionCluster(TileMap* tileMap, Vector2 position, float radius, float clusterRadius, enum GetMinionMode mode, Vector2* center) {
+    MinionQueryArea area = getMinionQueryArea(tileMap, position, radius, mode);
+    if (countMinionsInTiles(tileMap, area.minX, area.minY, area.maxX, area.maxY, mode) == 0) return 0;
+
+    int reach = roundf(clusterRadius / TILE_SIZE);
+    int bestCount = 0;
+    for (int y = area.minY; y <= area.maxY; y++) {
+        for (int x = area.minX; x <= area.maxX; x++) {
+            Vector2 tileCenter = { (x + 0.5) * TILE_SIZE, (y + 0.5) * TILE_SIZE };
+            if (Vector2DistanceSqr(tileCenter, position) > area.radiusSqr) continue;
+
+            int count = countMinionsInTiles(tileMap, x - reach, y - reach, x + reach, y + reach, mode);
+            if (count > bestCount) {
+                bestCount = count;
+                *center = tileCenter;
+            }
+        }
+    }
+    return bestCount;
+}
+
+typedef struct NearestMinions {
+    int k;
+    int count;
+    int ids[MAX_NEAREST_MINIONS];
+    float distancesSqr[MAX_NEAREST_MINIONS];
+} NearestMinions;
+
+// Keeps the k closest sorted by distance, ties go to the lower id
+bool nearestMinionVisitor(int id, float distanceSqr, void* context) {
+    NearestMinions* nearest = context;
+
+    int i = nearest->count;
+    while (i > 0 && (nearest->distancesSqr[i - 1] > distanceSqr
+        || (nearest->distancesSqr[i - 1] == distanceSqr && nearest->ids[i - 1] > id))) {
+        i--;
+    }
+    if (i >= nearest->k) return true;
+
+    int last = imin(nearest->count, nearest->k - 1);
+    for (int j = last; j > i; j--) {
+        nearest->ids[j] = nearest->ids[j - 1];
+        nearest->distancesSqr[j] = nearest->distancesSqr[j - 1];
+    }
+    nearest->ids[i] = id;
+    nearest->distancesSqr[i] = distanceSqr;
+    nearest->count = imin(nearest->count + 1, nearest->k);
+    return true;
+}
+
+// NULLID if there is none
+int getNearestMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode) {
+    NearestMinions nearest = { .k = 1 };
+    visitMinionsInRange(tileMap, position, radius, mode, nearestMinionVisitor, &nearest);
+    return nearest.count ? nearest.ids[0] : NULLID;
+}
+
+// Closest first, k is capped at MAX_NEAREST_MINIONS
+void getNearestMinionsInRange(IntArray* result, TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode, int k) {
+    NearestMinions nearest = { .k = imin(k, MAX_NEAREST_MINIONS) };
     result->used = 0;
+    if (nearest.k <= 0) return;
 
-    for(int x = minX; x <= maxX; x++) {
-        for (int y = minY; y <= maxY; y++) {
-            TileData* tile = getTile(tileMap, x, y);
-            for ITERATE(i, tile->minionIds.used) {
-                int id = tile->minionIds.array[i];
-                Minion* minion = getEntity(MINION_TYPE, id);
-                if (!minion->entity.isSpawned) continue;
-                if (minion->isPlayer && mode == ENEMY_ONLY)  continue;
-                if (!minion->isPlayer && mode == PLAYER_ONLY)  continue;
-
-                if (Vector2DistanceSqr(minion->entity.position, position) <= radiusSqr) {
-                    insertIntArray(result, id);
-                }
+    visitMinionsInRange(tileMap, position, radius, mode, nearestMinionVisitor, &nearest);
+    for ITERATE(i, nearest.count) {
+        insertIntArray(result, nearest.ids[i]);
+    }
+}
+
+typedef struct MatchingMinions {
+    IntArray* result;
+    int maxCount;
+    MinionPredicate predicate;
+    void* context;
+} MatchingMinions;
+
+bool matchingMinionVisitor(int id, float distanceSqr, void* context) {
+    MatchingMinions* matching = context;
+    if (!matching->predicate(getMinion(id), matching->context)) return true;
+
+    insertIntArray(matching->result, id);
+    return (int) matching->result->used < matching->maxCount;
+}
+
+// Stops at the first maxCount minions the predicate accepts, in grid order
+void getMatchingMinionsInRange(IntArray* result, TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode,
+    int maxCount, MinionPredicate predicate, void* context) {
+    result->used = 0;
+    if (maxCount <= 0) return;
+
+    MatchingMinions matching = { result, maxCount, predicate, context };
+    visitMinionsInRange(tileMap, position, radius, mode, matchingMinionVisitor, &matching);
+}
+
+typedef struct RandomMinion {
+    int id;
+    int seen;
+    MinionPredicate predicate;
+    void* context;
+} RandomMinion;
+
+// Reservoir sampling, every match ends up picked with the same chance
+bool randomMinionVisitor(int id, float distanceSqr, void* context) {
+    RandomMinion* random = context;
+    if (random->predicate != NULL && !random->predicate(getMinion(id), random->context)) return true;
+
+    random->seen++;
+    if (randInt(0, random->seen - 1) == 0) random->id = id;
+    return true;
+}
+
+// Uniformly random minion the predicate accepts, NULLID if there is none. predicate can be NULL
+int getRandomMinionInRange(TileMap* tileMap, Vector2 position, float radius, enum GetMinionMode mode, MinionPredicate predicate, void* context) {
+    RandomMinion random = { NULLID, 0, predicate, context };
+    visitMinionsInRange(tileMap, position, radius, mode, randomMinionVisitor, &random);
+    return random.id;
+}
+
+bool isMinionNotTargetedByMinion(Minion* minion, void* context) {
+    return !minion->isMinionTargeted;
+}
+
+bool isMinionNotTargetedByProjectile(Minion* minion, void* context) {
+    return !minion->isProjectileTargeted;
+}
+
+// Boids
+// Separation pushes apart minions of the same side that overlap, cohesion pulls gently
+// toward the local group. Neighbours come from the 3x3 tiles around the minion, and at most
+// STEERING_SAMPLES_PER_TILE / MAX_STEERING_SAMPLES of them are looked at, so a packed tile
+// costs the same as a sparse one. Sampling starts at a different slot in each tile list
+// every tick so the whole crowd gets seen over a few ticks.
+
+#define SEPARATION_RADIUS 14
+#define COHESION_RADIUS 40
+#define SEPARATION_STRENGTH 2.5
+#define COHESION_STRENGTH 0.1
+#define STEERING_SAMPLES_PER_TILE 6
+#define MAX_STEERING_SAMPLES 24
+
+// Steering to add to the velocity, in multiples of the minion's speed
+Vector2 getMinionSteering(TileMap* tileMap, int id) {
+    Minion* minion = getMinion(id);
+    Vector2 position = getMinionPosition(minion);
+    TileData* tile = getTileAt(tileMap, position);
+    if (tile == NULL) return Vector2Zero();
+
+    int tileX = position.x / TILE_SIZE;
+    int tileY = position.y / TILE_SIZE;
+
+    Vector2 separation = Vector2Zero();
+    Vector2 groupCenter = Vector2Zero();
+    int groupCount = 0;
+    int samples = 0;
+
+    unsigned int sampleOffset = (unsigned int)id * 2654435761u + world->simulationTick;
+    int faction = minion->isPlayer ? PLAYER_FACTION : ENEMY_FACTION;
+
+    for (int i = 0; i < 9 && samples < MAX_STEERING_SAMPLES; i++) {
+        // Own tile first
+        int x = tileX + (i + 1) % 3 - 1;
+        int y = tileY + (i / 3 + 1) % 3 - 1;
+        TileData* neighbourTile = getTile(tileMap, x, y);
+        if (neighbourTile == NULL) continue;
+
+        int count;
+        int* tileMinionIds = getTileMinionIds(tileMap, neighbourTile, faction, &count);
+        if (count == 0) continue;
+
+        int tileSamples = imin(count, STEERING_SAMPLES_PER_TILE);
+        int start = sampleOffset % count;
+
+        for (int j = 0; j < tileSamples && samples < MAX_STEERING_SAMPLES; j++) {
+            int otherId = tileMinionIds[(start + j) % count];
+            if (otherId == id) continue;
+            samples++;
+
+            Minion* other = getMinion(otherId);
+            if (!isEntityAlive(MINION_TYPE, otherId)) continue;
+
+            Vector2 otherPosition = getMinionPosition(other);
+            Vector2 away = Vector2Subtract(position, otherPosition);
+            float distanceSqr = Vector2LengthSqr(away);
+            if (distanceSqr > COHESION_RADIUS * COHESION_RADIUS) continue;
+
+            groupCenter = Vector2Add(groupCenter, otherPosition);
+            groupCount++;
+
+            if (distanceSqr < SEPARATION_RADIUS * SEPARATION_RADIUS) {
+                float distance = sqrtf(distanceSqr);
+                // Exactly on top of each other, split by id
+                if (distance < 0.001) away = (Vector2){ id < otherId ? -1 : 1, 0 };
+                else away = Vector2Scale(away, 1.0 / distance);
+                separation = Vector2Add(separation, Vector2Scale(away, 1 - distance / SEPARATION_RADIUS));
             }
         }
     }
+
+    Vector2 steering = Vector2Scale(separation, SEPARATION_STRENGTH);
+    if (groupCount > 0) {
+        groupCenter = Vector2Scale(groupCenter, 1.0 / groupCount);
+        Vector2 toCenter = Vector2Subtract(groupCenter, position);
+        steering = Vector2Add(steering, Vector2Scale(Vector2Normalize(toCenter), COHESION_STRENGTH));
+    }
+    return steering;
 }
 
 
@@ -1023,6 +2375,15 @@ const float TOWER_PROJECTILE_SPEED[] = {
     0
 };
 
+// How long an idle tower waits before looking for a target again
+#define TOWER_RETARGET_DELAY 0.05
+
+#define BOMB_EXPLOSION_RADIUS 70
+
+unsigned int secondsToTicks(float seconds) {
+    return imax(1, (int) roundf(seconds * SIMULATION_TICK_RATE));
+}
+
 
 
 
@@ -1030,132 +2391,126 @@ int spawnTower(int type, Vector2 position, float health) {
     assert(health > 0);
 
     int id = createEntity(TOWER_TYPE);
-    if (id == NULLID) return;
+    if (id == NULLID) return NULLID;
     
-    Tower* tower = getEntity(TOWER_TYPE, id);
+    Tower* tower = getTower(id);
     tower->type = type;
     tower->health = health;
     tower->entity.position = position;
     tower->value = health * 2;
-    tower->attackCooldown = TOWER_ATTACK_PERIOD[type];
     tower->lastHitAt = 0.0;
     tower->lastShot = 0.0;
 
-    isMinionTargetRecalculationPending = true;
+    scheduleEntityTimer(TOWER_ATTACK_TIMER, TOWER_TYPE, id, secondsToTicks(TOWER_ATTACK_PERIOD[type]));
+
+    world->isMinionTargetRecalculationPending = true;
 
     return id;
 }
 
-void drawTower(int id) {
-    Tower* tower = getEntity(TOWER_TYPE, id);
+void prepareTowerSprite(int id, SpriteInstance* sprite) {
+    const Tower* tower = getTower(id);
     
-    Texture2D* sprite = &ARCHER_TOWER_SPRITE;
+    Texture2D* texture = &ARCHER_TOWER_SPRITE;
     switch(tower->type) {
-        case ARCHER_TOWER_TYPE: sprite = &ARCHER_TOWER_SPRITE; break;
-        case BOMB_TOWER_TYPE: sprite = &BOMB_TOWER_SPRITE; break;
-        case SUMMONER_TOWER_TYPE: sprite = &SUMMONER_TOWER_SPRITE; break;
+        case ARCHER_TOWER_TYPE: texture = &ARCHER_TOWER_SPRITE; break;
+        case BOMB_TOWER_TYPE: texture = &BOMB_TOWER_SPRITE; break;
+        case SUMMONER_TOWER_TYPE: texture = &SUMMONER_TOWER_SPRITE; break;
     }
     
-    
-    Vector2 scale = Vector2Multiply(getSquashScale(tower->entity.lifeTime - tower->lastHitAt, 0.98), getSquashScale(tower->entity.lifeTime - tower->lastShot, 0.98));
-    drawSpriteAnchoredScaled(*sprite, tower->entity.position, 0, scale, (Vector2) { 0.5, 1.0 }, GetColor(ENEMY_COLOR));
-    
-
-    
-    char str[8];
-    sprintf(str, "%d", (int) ceil(tower->health));
-    /*DrawText(str, tower->entity.position.x, tower->entity.position.y - ARCHER_TOWER_SPRITE.height / 2, 30, BLACK);*/
-
-    Vector2 textPosition = tower->entity.position;
-    textPosition.y -= (ARCHER_TOWER_SPRITE.height / 2 - 4) * scale.y;
-
-    drawTextAnchored(textPosition, (Vector2) { 0.5, 0.5 }, MAIN_FONT, str, 32, 0.0, BLACK);
+    float lifeTime = getLifeTime(&tower->entity);
+    Vector2 scale = Vector2Multiply(getSquashScale(lifeTime - tower->lastHitAt, 0.98), getSquashScale(lifeTime - tower->lastShot, 0.98));
+
+    Vector2 labelPosition = tower->entity.position;
+    labelPosition.y -= (ARCHER_TOWER_SPRITE.height / 2 - 4) * scale.y;
+
+    *sprite = (SpriteInstance){
+        .texture = texture,
+        .position = tower->entity.position,
+        .scale = scale,
+        .anchor = { 0.5, 1.0 },
+        .tint = ENEMY_TINT,
+        .label = (int) ceil(tower->health),
+        .labelPosition = labelPosition,
+    };
 }
 
 void damageTower(int id, int damageAmount) {
-    Tower* tower = getEntity(TOWER_TYPE, id);
+    Tower* tower = getTower(id);
     tower->health -= damageAmount;
-    tower->lastHitAt = tower->entity.lifeTime;
+    tower->lastHitAt = getLifeTime(&tower->entity);
     playSoundInstance(TOWER_HURT_SOUND, 0.8, 1.0);
+
+    if (tower->health <= 0 && queueDestroyEntity(TOWER_TYPE, id)) {
+        world->minionInventoryCount += tower->value;
+        world->isMinionTargetRecalculationPending = true;
+    }
 }
 
 
+// Returns true if the tower fired / summoned
+bool attackWithTower(int id) {
+    Tower* tower = getTower(id);
 
-void updateTower(int id, float delta) {
-    Tower* tower = getEntity(TOWER_TYPE, id);
-    if (tower->health <= 0) {
-        minionInventoryCount += tower->value;
-        timeSinceLastInventoryIncrease = GetTime();
-        isMinionTargetRecalculationPending = true;
-        destroyEntity(TOWER_TYPE, id);
-    }
-    if (tower->attackCooldown > 0) {
-        tower->attackCooldown -= delta;
-        
+    if (tower->type == SUMMONER_TOWER_TYPE) {
+        if (world->entityClasses[MINION_TYPE].spawnCount - world->enemyMinionCount <= 0) return false;
+
+        float radius = randRange(30.0, 50.0);
+        float angle = randRange(0, PI);
+        Vector2 spawnPosition = Vector2Add(tower->entity.position, Vector2Rotate((Vector2) { radius }, angle));
+        queueSpawnMinion(spawnPosition, false);
+        return true;
     }
 
-    else {
-        
-        if (tower->type == SUMMONER_TOWER_TYPE) {
-            if (entityClasses[MINION_TYPE].spawnCount - enemyMinionCount > 0)
-            {
-                float radius = randRange(30.0, 50.0);
-                float angle = randRange(0, PI);
-                Vector2 spawnPosition = Vector2Add(tower->entity.position, Vector2Rotate((Vector2) { radius }, angle));
-                spawnMinionAt(spawnPosition, false);
-                tower->attackCooldown += TOWER_ATTACK_PERIOD[tower->type];
-                tower->lastShot = tower->entity.lifeTime;
-            }
-        } else {
-            getMinionIdsInRange(&minionIdsInRange, &currentTileMap, tower->entity.position, TOWER_ATTACK_RADIUS[tower->type], PLAYER_ONLY);
-
-            // Filter to only non targted minions
-            int count = minionIdsInRange.used;
-            int j = 0;
-            for ITERATE(i, count) {
-                int id = minionIdsInRange.array[i];
-                Minion* minion = getEntity(MINION_TYPE, id);
-
-                if (!minion->isProjectileTargeted) {
-                    minionIdsInRange.array[j++] = minionIdsInRange.array[i];
-                } else {
-                    minionIdsInRange.used--;
-                }
-            }
+    float attackRadius = TOWER_ATTACK_RADIUS[tower->type];
+    int minionId = NULLID;
 
-            if (minionIdsInRange.used > 0) {
-                int i = GetRandomValue(0, minionIdsInRange.used - 1);
-                int id = minionIdsInRange.array[i];
-                Minion* minion = getEntity(MINION_TYPE, id);
-                float distanceToMinion = Vector2Distance(tower->entity.position, minion->entity.position);
-                float attackTime = distanceToMinion / TOWER_PROJECTILE_SPEED[tower->type];
-                minion->isProjectileTargeted = true;
-                int projectileType = tower->type == ARCHER_TOWER_TYPE ? ARROW_PROJECTILE_TYPE : BOMB_PROJECTILE_TYPE;
-                
-                tower->attackCooldown += TOWER_ATTACK_PERIOD[tower->type];
-                tower->lastShot = tower->entity.lifeTime;
-
-                int projectileId = spawnProjectile(projectileType, tower->entity.position, id, max(attackTime, 0.1));
-
-                /*if (projectileId != NULLID) {
-                    Projectile* projectile = getEntity(PROJECTILE_TYPE, projectileId);
-                    particleKickDust(projectile->entity.position, projectile->entity.height);
-                }*/
-            }
-        }
+    // Bombs go for the densest crowd in range, at the minion closest to its centre
+    Vector2 clusterCenter;
+    if (tower->type == BOMB_TOWER_TYPE
+        && getDensestMinionCluster(&world->currentTileMap, tower->entity.position, attackRadius, BOMB_EXPLOSION_RADIUS, PLAYER_ONLY, &clusterCenter) > 1) {
+        minionId = getNearestMinionInRange(&world->currentTileMap, clusterCenter, BOMB_EXPLOSION_RADIUS, PLAYER_ONLY);
+        if (minionId != NULLID && Vector2Distance(tower->entity.position, getMinionPosition(getMinion(minionId))) > attackRadius)
+            minionId = NULLID;
     }
 
-    
+    // Only minions no other projectile is going for
+    if (minionId == NULLID) {
+        minionId = getRandomMinionInRange(&world->currentTileMap, tower->entity.position, attackRadius, PLAYER_ONLY,
+            isMinionNotTargetedByProjectile, NULL);
+    }
+    if (minionId == NULLID) return false;
+
+    Minion* minion = getMinion(minionId);
+    float distanceToMinion = Vector2Distance(tower->entity.position, getMinionPosition(minion));
+    float attackTime = distanceToMinion / TOWER_PROJECTILE_SPEED[tower->type];
+    minion->isProjectileTargeted = true;
+    int projectileType = tower->type == ARCHER_TOWER_TYPE ? ARROW_PROJECTILE_TYPE : BOMB_PROJECTILE_TYPE;
+
+    queueSpawnProjectile(projectileType, tower->entity.position, minionId, max(attackTime, 0.1));
+    return true;
+}
+
+void onTowerAttackTimer(int id) {
+    Tower* tower = getTower(id);
+
+    if (attackWithTower(id)) {
+        tower->lastShot = getLifeTime(&tower->entity);
+        scheduleEntityTimer(TOWER_ATTACK_TIMER, TOWER_TYPE, id, secondsToTicks(TOWER_ATTACK_PERIOD[tower->type]));
+    } else {
+        scheduleEntityTimer(TOWER_ATTACK_TIMER, TOWER_TYPE, id, secondsToTicks(TOWER_RETARGET_DELAY));
+    }
 }
 
 void onTowerDestroyed(int id) {
-    Tower* tower = getEntity(TOWER_TYPE, id);
+    Tower* tower = getTower(id);
 
     for ITERATE(i, 40) {
         float startSize = randRange(1.0, 2.5);
         spawnParticle(
+            DEBRIS_EMITTER,
             (Vector3) {tower->entity.position.x + randRange(-35, 35), tower->entity.position.y + randRange(-3, 3), randRange(0, 70) },
-            &DUST_PARTICLE_SPRITE,
+            DUST_PARTICLE,
             (Vector3) { randRange(-50, 50), randRange(-20, 20), randRange(0, 300) }, (Vector3) { 0, 0, -500 },
             randRange(1.1, 1.6), 2.0, GetColor(ENEMY_COLOR), GetColor(ENEMY_COLOR & 0xFFFFFF00), startSize, startSize - 0.6
         );
@@ -1167,45 +2522,55 @@ void onTowerDestroyed(int id) {
     playSoundInstance(TOWER_DESTROY_SOUND, 1.0, 1.0);
     
 
-    if (entityClasses[TOWER_TYPE].spawnCount == 0 && !levels[currentLevelNumber].isDebugLevel) {
-        gotoNextLevel();
-        
-        playSoundInstance(WIN_SOUND_2, 1.0, 1.0);
-        if (currentLevelNumber == LEVEL_COUNT - 1)
-            playSoundInstance(WIN_SOUND, 1.0, 1.0);
+    if (isGhostThread) return;
+
+    if (world->entityClasses[TOWER_TYPE].spawnCount == 0 && !levels[world->levelNumber].isDebugLevel) {
+        // Level changes are up to the render thread
+        if (isSimulationThread)
+            simulationEffects.isLevelWon = true;
+        else
+            onLevelWon();
     } else {
         playSoundInstance(GAIN_MINIONS_SOUND, 1.0, 1.0);
     }
 }
 
+void onLevelWon() {
+    gotoNextLevel();
+
+    playSoundInstance(WIN_SOUND_2, 1.0, 1.0);
+    if (currentLevelNumber == LEVEL_COUNT - 1)
+        playSoundInstance(WIN_SOUND, 1.0, 1.0);
+}
+
 
 //------------------------------------------------------------------------------------
 // C Projectile
 //------------------------------------------------------------------------------------
 
-#define BOMB_EXPLOSION_RADIUS 70
-
 int spawnProjectile(int type, Vector2 startPosition, int targetMinionId, float totalAliveTime) {
     assert(getEntity(MINION_TYPE, targetMinionId)->isSpawned);
     assert(targetMinionId >= 0);
-    assert(targetMinionId < entityClasses[MINION_TYPE].bankSize);
+    assert(targetMinionId < world->entityClasses[MINION_TYPE].bankSize);
 
     int id = createEntity(PROJECTILE_TYPE);
     if (id == NULLID) return NULLID;
 
-    Projectile* projectile = getEntity(PROJECTILE_TYPE, id);
+    Projectile* projectile = getProjectile(id);
+
+    Minion* targetMinion = getMinion(targetMinionId);
+    unsigned int flightTicks = secondsToTicks(totalAliveTime);
 
     projectile->startPosition = startPosition;
     projectile->targetMinionId = targetMinionId;
+    projectile->targetMinionGeneration = targetMinion->entity.generation;
     projectile->type = type;
 
-    Minion* targetMinion = getEntity(MINION_TYPE, targetMinionId);
+    projectile->targetPosition = Vector2Add(getMinionPosition(targetMinion), Vector2Scale(targetMinion->velocity, totalAliveTime));
+    projectile->totalAliveTime = flightTicks * TICK_DELTA;
+    evaluateProjectile(id);
 
-    projectile->targetPosition = Vector2Add(targetMinion->entity.position, Vector2Scale(targetMinion->velocity, totalAliveTime));
-    projectile->aliveTime = 0.0;
-    projectile->totalAliveTime = totalAliveTime;
-    projectile->entity.position = startPosition;
-    projectile->entity.height = calculateProjectileHeight(0);
+    scheduleEntityTimer(PROJECTILE_IMPACT_TIMER, PROJECTILE_TYPE, id, flightTicks);
 
     if (projectile->type == BOMB_PROJECTILE_TYPE)
         playSoundInstance(LAUNCH_BOMB_SOUND, 0.5, randRange(0.9, 1.1));
@@ -1216,77 +2581,81 @@ int spawnProjectile(int type, Vector2 startPosition, int targetMinionId, float t
 }
 
 
-void drawProjectile(int id) {
-    Projectile* projectile = getEntity(PROJECTILE_TYPE, id);
-    Vector2 drawPosition = projectile->entity.position;
-    drawPosition.y -= projectile->entity.height;
-    float angle = projectile->type == ARROW_PROJECTILE_TYPE ? 
-        90 + projectile->angle * RAD2DEG : projectile->angle * RAD2DEG * 0.4;
-        
-    drawSpriteAnchored(projectile->type == ARROW_PROJECTILE_TYPE ? ARROW_SPRITE : BOMB_SPRITE, drawPosition, angle, (Vector2) { 0.5, 0 }, GetColor(ENEMY_COLOR));
-}
-
+void prepareProjectileSprite(int id, SpriteInstance* sprite) {
+    const Projectile* projectile = getProjectile(id);
+    bool isArrow = projectile->type == ARROW_PROJECTILE_TYPE;
 
-void updateProjectile(int id, float delta) {
-    Projectile* projectile = getEntity(PROJECTILE_TYPE, id);
+    *sprite = (SpriteInstance){
+        .texture = isArrow ? &ARROW_SPRITE : &BOMB_SPRITE,
+        .position = { projectile->entity.position.x, projectile->entity.position.y - projectile->entity.height },
+        .rotation = isArrow ? 90 + projectile->angle * RAD2DEG : projectile->angle * RAD2DEG * 0.4,
+        .scale = Vector2One(),
+        .anchor = { 0.5, 0 },
+        .tint = ENEMY_TINT,
+        .label = NULLID,
+    };
+}
 
-    // Update target position
-    if (projectile->targetMinionId != NULLID) {
-        Minion* targetMinion = getEntity(MINION_TYPE, projectile->targetMinionId);
-        if (!targetMinion->entity.isSpawned) {
-            projectile->targetMinionId = NULLID;
-        } else {
-            //projectile->targetPosition = targetMinion->entity.position;
-        }
-    }
 
-    // Update alive time
-    projectile->aliveTime += delta;
-    float totalTime = projectile->totalAliveTime;
-    float alivePercentage = projectile->aliveTime / projectile->totalAliveTime;
+void onProjectileImpactTimer(int id) {
+    Projectile* projectile = getProjectile(id);
 
-    if (alivePercentage >= 1.0) {
-        switch(projectile->type) {
-            case ARROW_PROJECTILE_TYPE:
-                if (projectile->targetMinionId != NULLID) {
-                    destroyEntity(MINION_TYPE, projectile->targetMinionId);
-                }
-                break;
-            case BOMB_PROJECTILE_TYPE:
-                explodeAt(projectile->targetPosition, BOMB_EXPLOSION_RADIUS);
-                break;
-                
-        }
-        playSoundInstance(MINION_HURT_SOUND, 1.0, randRange(0.9, 1.1));
-        shakeCamera(1.0, 0.1);
-        return destroyEntity(PROJECTILE_TYPE, id);
-        
+    switch(projectile->type) {
+        case ARROW_PROJECTILE_TYPE:
+            // Only if the target is still the same minion
+            if (isEntityAlive(MINION_TYPE, projectile->targetMinionId)
+                && getEntity(MINION_TYPE, projectile->targetMinionId)->generation == projectile->targetMinionGeneration) {
+                queueDestroyEntity(MINION_TYPE, projectile->targetMinionId);
+            }
+            break;
+        case BOMB_PROJECTILE_TYPE:
+            queueExplosion(projectile->targetPosition, BOMB_EXPLOSION_RADIUS);
+            break;
     }
+    playSoundInstance(MINION_HURT_SOUND, 1.0, randRange(0.9, 1.1));
+    shakeCamera(1.0, 0.1);
+    queueDestroyEntity(PROJECTILE_TYPE, id);
+}
 
-    float oldY = projectile->entity.position.y - projectile->entity.height;
-    float oldX = projectile->entity.position.x;
+// Position, height and angle are pure functions of the flight time,
+// so they are only worked out when the projectile is drawn
+void evaluateProjectileFlight(Projectile* projectile) {
+    float alivePercentage = Clamp(getLifeTime(&projectile->entity) / projectile->totalAliveTime, 0, 1);
 
-    // Update position / height
     projectile->entity.position = Vector2Lerp(projectile->startPosition, projectile->targetPosition, alivePercentage);
     projectile->entity.height = calculateProjectileHeight(alivePercentage);
 
-    float y = projectile->entity.position.y - projectile->entity.height;
-    float x = projectile->entity.position.x;
-    
+    // Direction of travel on screen
+    Vector2 travel = Vector2Subtract(projectile->targetPosition, projectile->startPosition);
+    projectile->angle = atan2f(travel.y - calculateProjectileHeightSlope(alivePercentage), travel.x);
+}
 
-    projectile->angle = atan2f(y - oldY, x - oldX);
+void evaluateProjectile(int id) {
+    evaluateProjectileFlight(getProjectile(id));
 }
 
-float calculateProjectileHeight(float timePercent) {
-    static const float startHeight = 60.0;
-    static const float peakHeight = 100.0; // this is not actually peak height, but I'm too lazy to make the equation better
-    static const float endHeight = 10.0;
+void evaluateProjectiles() {
+    Projectile* projectiles = world->entityClasses[PROJECTILE_TYPE].bank;
+    for ITERATE(id, world->entityClasses[PROJECTILE_TYPE].bankSize) {
+        if (projectiles[id].entity.isSpawned) evaluateProjectileFlight(&projectiles[id]);
+    }
+}
+
+#define PROJECTILE_START_HEIGHT 60.0
+#define PROJECTILE_PEAK_HEIGHT 100.0 // this is not actually peak height, but I'm too lazy to make the equation better
+#define PROJECTILE_END_HEIGHT 10.0
 
-    float result = -peakHeight * (timePercent - 1) * (timePercent + startHeight / peakHeight) + endHeight;
+float calculateProjectileHeight(float timePercent) {
+    float result = -PROJECTILE_PEAK_HEIGHT * (timePercent - 1) * (timePercent + PROJECTILE_START_HEIGHT / PROJECTILE_PEAK_HEIGHT) + PROJECTILE_END_HEIGHT;
 
     return result;
 }
 
+// d(height) / d(timePercent)
+float calculateProjectileHeightSlope(float timePercent) {
+    return -PROJECTILE_PEAK_HEIGHT * (2 * timePercent - 1 + PROJECTILE_START_HEIGHT / PROJECTILE_PEAK_HEIGHT);
+}
+
 
 void onProjectileDestroyed(int id) {
     
@@ -1299,21 +2668,31 @@ void onProjectileDestroyed(int id) {
 #define TRAP_RANGE 40
 #define TRAP_EXPLOSION_RADIUS 120
 
-void updateTrap(int id, float delta) {
-    Trap* trap = getEntity(TRAP_TYPE, id);
+void updateTraps(float delta) {
+    Trap* traps = world->entityClasses[TRAP_TYPE].bank;
 
-    // Can optimize to check hasMinionInRange
-    getMinionIdsInRange(&minionIdsInRange, &currentTileMap, trap->entity.position, TRAP_RANGE, PLAYER_ONLY);
+    for ITERATE(id, world->entityClasses[TRAP_TYPE].bankSize) {
+        Trap* trap = &traps[id];
+        if (!trap->entity.isSpawned || trap->entity.isDestroyQueued) continue;
 
-    if (minionIdsInRange.used > 0) {
-        explodeAt(trap->entity.position, TRAP_EXPLOSION_RADIUS);
-        destroyEntity(TRAP_TYPE, id);
+        if (anyMinionInRange(&world->currentTileMap, trap->entity.position, TRAP_RANGE, PLAYER_ONLY)) {
+            queueExplosion(trap->entity.position, TRAP_EXPLOSION_RADIUS);
+            queueDestroyEntity(TRAP_TYPE, id);
+        }
     }
 }
 
-void drawTrap(int id) {
-    Trap* trap = getEntity(TRAP_TYPE, id);
-    drawSpriteAnchoredScaled(TRAP_SPRITE, trap->entity.position, 0, getSquashScale(trap->entity.lifeTime, 1.2), (Vector2) { 0.5, 0.9 }, GetColor(ENEMY_COLOR));
+void prepareTrapSprite(int id, SpriteInstance* sprite) {
+    const Trap* trap = getTrap(id);
+
+    *sprite = (SpriteInstance){
+        .texture = &TRAP_SPRITE,
+        .position = trap->entity.position,
+        .scale = getSquashScale(getLifeTime(&trap->entity), 1.2),
+        .anchor = { 0.5, 0.9 },
+        .tint = ENEMY_TINT,
+        .label = NULLID,
+    };
 }
 
 void onTrapDestroyed(int id) {
@@ -1322,105 +2701,525 @@ void onTrapDestroyed(int id) {
 
 
 //------------------------------------------------------------------------------------
-// C Particle
+// C RenderList
 //------------------------------------------------------------------------------------
 
-int spawnParticle(
-    Vector3 position,
-    Texture2D* sprite,
-    Vector3 velocity,
-    Vector3 acceleration,
-    float duration,
-    float dampening,
-    Color startColor,
-    Color endColor,
-    float startScale,
-    float endScale
-) {
-    int id = createEntity(PARTICLE_TYPE);
-    if (id == NULLID) return NULLID;
+// Drawing the entities is split in two. Preparing turns every visible entity into a
+// SpriteInstance (and a shadow) in parallel; it only reads the render world, so the jobs
+// can't step on each other. Submitting then hands them to raylib in depth order on the
+// render thread, which is the only one allowed to draw.
 
-    Particle* particle = getEntity(PARTICLE_TYPE, id);
+#define SPRITES_PER_JOB 256
 
-    particle->entity.position = * (Vector2*) &position;
-    particle->entity.height = position.z;
-    particle->sprite = sprite;
-    particle->velocity = velocity;
-    particle->acceleration = acceleration;
-    particle->duration = duration;
-    particle->dampening = dampening;
-    particle->startColor = startColor;
-    particle->endColor = endColor;
-    particle->startScale = startScale;
-    particle->endScale = endScale;
+typedef struct RenderList {
+    SpriteInstance* sprites; // Parallel to the entities it was built from
+    SpriteInstance* shadows;
+    int count;
+    int capacity;
+    int jobCount;
+    World* world;
+    GlobalId* entities;
+    float nearShadowDistance;
+} RenderList;
 
-    return id;
-}
+RenderList renderList;
 
-void updateParticle(int id, float delta) {
-    Particle* particle = getEntity(PARTICLE_TYPE, id);
+void prepareShadow(GlobalId globalId, SpriteInstance* shadow) {
+    const Entity* entity = getEntity(globalId.type, globalId.id);
 
-    if (particle->entity.lifeTime > particle->duration) {
-        destroyEntity(PARTICLE_TYPE, id);
-        return;
-    } 
+    Texture2D* texture = NULL;
+    switch (globalId.type) {
+        case MINION_TYPE:
+            if (quality.level < MINION_SHADOWS_QUALITY) break;
+            if (quality.level < DISTANT_SHADOWS_QUALITY && Vector2Distance(entity->position, cameraCenter) > renderList.nearShadowDistance)
+                break;
+            texture = &MINION_SHADOW_SPRITE;
+            break;
+        case TOWER_TYPE:
+            texture = &TOWER_SHADOW_SPRITE;
+            break;
+        case TRAP_TYPE:
+            texture = &TRAP_SHADOW_SPRITE;
+            break;
+    }
+
+    *shadow = (SpriteInstance){
+        .texture = texture,
+        .position = entity->position,
+        .scale = Vector2One(),
+        .anchor = { 0.5, 0.5 },
+        .tint = WHITE,
+        .label = NULLID,
+    };
+}
+
+void prepareSpritesJob(void* context, int jobIndex) {
+    RenderList* list = context;
+    world = list->world;
+
+    int spritesPerJob = (list->count + list->jobCount - 1) / list->jobCount;
+    int start = imin(jobIndex * spritesPerJob, list->count);
+    int end = imin(start + spritesPerJob, list->count);
+    for (int i = start; i < end; i++) {
+        GlobalId globalId = list->entities[i];
+        world->entityClasses[globalId.type].prepareSprite(globalId.id, &list->sprites[i]);
+        prepareShadow(globalId, &list->shadows[i]);
+    }
+}
+
+// From the bound world, entities already culled and sorted by depth
+void buildRenderList(GlobalIdArray* entities, Rectangle view) {
+    int count = (int) entities->used;
+    if (count > renderList.capacity) {
+        renderList.capacity = imax(count, renderList.capacity * 2);
+        renderList.sprites = reallocate(RENDER_MEMORY, renderList.sprites, sizeof(SpriteInstance) * renderList.capacity);
+        renderList.shadows = reallocate(RENDER_MEMORY, renderList.shadows, sizeof(SpriteInstance) * renderList.capacity);
+    }
+
+    renderList.count = count;
+    renderList.world = world;
+    renderList.entities = entities->array;
+    renderList.nearShadowDistance = fminf(view.width, view.height) * 0.25;
+
+    int jobsNeeded = (renderList.count + SPRITES_PER_JOB - 1) / SPRITES_PER_JOB;
+    renderList.jobCount = imax(1, imin(getWorkerCount(), jobsNeeded));
+    runParallelJobs(prepareSpritesJob, &renderList, renderList.jobCount);
+}
+
+void drawSpriteInstance(SpriteInstance* sprite) {
+    if (sprite->texture == NULL) return;
+
+    drawSpriteAnchoredScaled(*sprite->texture, sprite->position, sprite->rotation, sprite->scale, sprite->anchor, sprite->tint);
+
+    if (sprite->label != NULLID) {
+        char str[12];
+        sprintf(str, "%d", sprite->label);
+        drawTextAnchored(sprite->labelPosition, (Vector2) { 0.5, 0.5 }, MAIN_FONT, str, 32, 0.0, BLACK);
+    }
+}
+
+// Every shadow, then every sprite
+void submitRenderList() {
+    for ITERATE(i, renderList.count) {
+        drawSpriteInstance(&renderList.shadows[i]);
+    }
+    for ITERATE(i, renderList.count) {
+        drawSpriteInstance(&renderList.sprites[i]);
+    }
+}
+
+void destroyRenderList() {
+    free(renderList.sprites);
+    free(renderList.shadows);
+    renderList = (RenderList){ 0 };
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C Particle
+//------------------------------------------------------------------------------------
+
+// Particles don't live in an EntityClass bank. They are stored as parallel arrays, packed
+// into [0, count) with swap-remove, integrated in one pass and drawn after the depth
+// sorted entities. Every emit goes through its emitter's budget, and an emitter's priority
+// decides how much of the shared pool it may fill, so low priority dust can't crowd out
+// explosions and tower debris.
+
+#define MAX_PARTICLE_COUNT 100000
+
+#define LOW_PARTICLE_PRIORITY 0
+#define MEDIUM_PARTICLE_PRIORITY 1
+#define HIGH_PARTICLE_PRIORITY 2
+
+// Fraction of the pool an emitter of each priority may fill
+const float PARTICLE_PRIORITY_POOL_SHARE[] = {
+    0.5,
+    0.85,
+    1.0
+};
+
+typedef struct ParticleEmitter {
+    int budget;
+    int priority;
+    int liveCount;
+    int droppedCount; // Over budget
+    int thinnedCount; // Dropped for quality
+    bool isNextThinned; // Flips on every emit while thinning, dropping every other one
+} ParticleEmitter;
+
+typedef struct ParticleSystem {
+    int count;
+    float* x;
+    float* y;
+    float* z;
+    float* vx;
+    float* vy;
+    float* vz;
+    float* ax;
+    float* ay;
+    float* az;
+    float* dampening;
+    float* age;
+    float* duration;
+    Color* startColor;
+    Color* endColor;
+    float* startScale;
+    float* endScale;
+    unsigned char* sprite;
+    unsigned char* emitter;
+} ParticleSystem;
+
+ParticleSystem particles;
+ParticleEmitter particleEmitters[EMITTER_COUNT];
+
+Texture2D* getParticleSprite(int sprite) {
+    switch (sprite) {
+        case FLASH_PARTICLE: return &FLASH_PARTICLE_SPRITE;
+        case BRICK_PARTICLE: return &BRICK_PARTICLE_SPRITE;
+        default: return &DUST_PARTICLE_SPRITE;
+    }
+}
+
+void initParticles() {
+    particles.count = 0;
+    particles.x = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.y = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.z = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.vx = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.vy = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.vz = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.ax = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.ay = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.az = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.dampening = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.age = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.duration = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.startColor = allocate(PARTICLE_MEMORY, sizeof(Color) * MAX_PARTICLE_COUNT);
+    particles.endColor = allocate(PARTICLE_MEMORY, sizeof(Color) * MAX_PARTICLE_COUNT);
+    particles.startScale = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.endScale = allocate(PARTICLE_MEMORY, sizeof(float) * MAX_PARTICLE_COUNT);
+    particles.sprite = allocate(PARTICLE_MEMORY, sizeof(unsigned char) * MAX_PARTICLE_COUNT);
+    particles.emitter = allocate(PARTICLE_MEMORY, sizeof(unsigned char) * MAX_PARTICLE_COUNT);
+
+    particleEmitters[DUST_EMITTER] = (ParticleEmitter){ .budget = 30000, .priority = LOW_PARTICLE_PRIORITY };
+    particleEmitters[EXPLOSION_EMITTER] = (ParticleEmitter){ .budget = 50000, .priority = MEDIUM_PARTICLE_PRIORITY };
+    particleEmitters[FLASH_EMITTER] = (ParticleEmitter){ .budget = 2000, .priority = HIGH_PARTICLE_PRIORITY };
+    particleEmitters[DEBRIS_EMITTER] = (ParticleEmitter){ .budget = 8000, .priority = HIGH_PARTICLE_PRIORITY };
+}
+
+void clearParticles() {
+    particles.count = 0;
+    for ITERATE(i, EMITTER_COUNT) {
+        particleEmitters[i].liveCount = 0;
+    }
+}
+
+void destroyParticles() {
+    free(particles.x);
+    free(particles.y);
+    free(particles.z);
+    free(particles.vx);
+    free(particles.vy);
+    free(particles.vz);
+    free(particles.ax);
+    free(particles.ay);
+    free(particles.az);
+    free(particles.dampening);
+    free(particles.age);
+    free(particles.duration);
+    free(particles.startColor);
+    free(particles.endColor);
+    free(particles.startScale);
+    free(particles.endScale);
+    free(particles.sprite);
+    free(particles.emitter);
+    particles.count = 0;
+}
+
+// Returns false if the emitter is over budget or its share of the pool is used up
+bool spawnParticle(
+    int emitter,
+    Vector3 position,
+    int sprite,
+    Vector3 velocity,
+    Vector3 acceleration,
+    float duration,
+    float dampening,
+    Color startColor,
+    Color endColor,
+    float startScale,
+    float endScale
+) {
+    if (isGhostThread) return false;
+    if (isSimulationThread) {
+        // The budgets are checked when the render thread emits it
+        queueParticleSpawn(&simulationEffects, (ParticleSpawn){
+            emitter, position, sprite, velocity, acceleration, duration, dampening, startColor, endColor, startScale, endScale
+        });
+        return true;
+    }
+
+    ParticleEmitter* particleEmitter = &particleEmitters[emitter];
+    int poolLimit = MAX_PARTICLE_COUNT * PARTICLE_PRIORITY_POOL_SHARE[particleEmitter->priority];
+
+    // Half the emission, keeping tower debris and flashes
+    if (quality.level < FULL_PARTICLES_QUALITY && particleEmitter->priority < HIGH_PARTICLE_PRIORITY) {
+        particleEmitter->isNextThinned = !particleEmitter->isNextThinned;
+        if (particleEmitter->isNextThinned) {
+            particleEmitter->thinnedCount++;
+            return false;
+        }
+    }
+
+    if (particleEmitter->liveCount >= particleEmitter->budget || particles.count >= poolLimit) {
+        particleEmitter->droppedCount++;
+        return false;
+    }
+
+    int i = particles.count++;
+    particleEmitter->liveCount++;
+
+    particles.x[i] = position.x;
+    particles.y[i] = position.y;
+    particles.z[i] = position.z;
+    particles.vx[i] = velocity.x;
+    particles.vy[i] = velocity.y;
+    particles.vz[i] = velocity.z;
+    particles.ax[i] = acceleration.x;
+    particles.ay[i] = acceleration.y;
+    particles.az[i] = acceleration.z;
+    particles.dampening[i] = dampening;
+    particles.age[i] = 0.0;
+    particles.duration[i] = duration;
+    particles.startColor[i] = startColor;
+    particles.endColor[i] = endColor;
+    particles.startScale[i] = startScale;
+    particles.endScale[i] = endScale;
+    particles.sprite[i] = sprite;
+    particles.emitter[i] = emitter;
+
+    return true;
+}
 
-    particle->velocity = Vector3Add(particle->velocity, Vector3Scale(particle->acceleration, delta));
-    particle->velocity = Vector3Add(particle->velocity, Vector3Scale(particle->velocity, -particle->dampening * delta));
-    particle->entity.position.x += particle->velocity.x * delta;
-    particle->entity.position.y += particle->velocity.y * delta;
-    particle->entity.height += particle->velocity.z * delta;
-    particle->entity.height = max(0, particle->entity.height);
+void moveParticle(int to, int from) {
+    particles.x[to] = particles.x[from];
+    particles.y[to] = particles.y[from];
+    particles.z[to] = particles.z[from];
+    particles.vx[to] = particles.vx[from];
+    particles.vy[to] = particles.vy[from];
+    particles.vz[to] = particles.vz[from];
+    particles.ax[to] = particles.ax[from];
+    particles.ay[to] = particles.ay[from];
+    particles.az[to] = particles.az[from];
+    particles.dampening[to] = particles.dampening[from];
+    particles.age[to] = particles.age[from];
+    particles.duration[to] = particles.duration[from];
+    particles.startColor[to] = particles.startColor[from];
+    particles.endColor[to] = particles.endColor[from];
+    particles.startScale[to] = particles.startScale[from];
+    particles.endScale[to] = particles.endScale[from];
+    particles.sprite[to] = particles.sprite[from];
+    particles.emitter[to] = particles.emitter[from];
 }
 
-void drawParticle(int id) {
-    Particle* particle = getEntity(PARTICLE_TYPE, id);
-    float alivePercent = particle->entity.lifeTime / particle->duration;
+// v += a * dt, v *= 1 - dampening * dt, p += v * dt, height clamped to the ground
+void integrateParticles(int start, int end, float delta) {
+    int i = start;
+
+#if defined(SIMD_SSE2)
+    __m128 dt = _mm_set1_ps(delta);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    for (; i + 4 <= end; i += 4) {
+        __m128 damping = _mm_sub_ps(one, _mm_mul_ps(_mm_loadu_ps(&particles.dampening[i]), dt));
+
+        __m128 vx = _mm_add_ps(_mm_loadu_ps(&particles.vx[i]), _mm_mul_ps(_mm_loadu_ps(&particles.ax[i]), dt));
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(&particles.vy[i]), _mm_mul_ps(_mm_loadu_ps(&particles.ay[i]), dt));
+        __m128 vz = _mm_add_ps(_mm_loadu_ps(&particles.vz[i]), _mm_mul_ps(_mm_loadu_ps(&particles.az[i]), dt));
+        vx = _mm_mul_ps(vx, damping);
+        vy = _mm_mul_ps(vy, damping);
+        vz = _mm_mul_ps(vz, damping);
+        _mm_storeu_ps(&particles.vx[i], vx);
+        _mm_storeu_ps(&particles.vy[i], vy);
+        _mm_storeu_ps(&particles.vz[i], vz);
+
+        _mm_storeu_ps(&particles.x[i], _mm_add_ps(_mm_loadu_ps(&particles.x[i]), _mm_mul_ps(vx, dt)));
+        _mm_storeu_ps(&particles.y[i], _mm_add_ps(_mm_loadu_ps(&particles.y[i]), _mm_mul_ps(vy, dt)));
+        _mm_storeu_ps(&particles.z[i], _mm_max_ps(zero, _mm_add_ps(_mm_loadu_ps(&particles.z[i]), _mm_mul_ps(vz, dt))));
+        _mm_storeu_ps(&particles.age[i], _mm_add_ps(_mm_loadu_ps(&particles.age[i]), dt));
+    }
+#endif
 
-    Color color = ColorLerp(particle->startColor, particle->endColor, alivePercent);
-    float scale = Lerp(particle->startScale, particle->endScale, alivePercent);
+    for (; i < end; i++) {
+        float damping = 1.0f - particles.dampening[i] * delta;
+        particles.vx[i] = (particles.vx[i] + particles.ax[i] * delta) * damping;
+        particles.vy[i] = (particles.vy[i] + particles.ay[i] * delta) * damping;
+        particles.vz[i] = (particles.vz[i] + particles.az[i] * delta) * damping;
+        particles.x[i] += particles.vx[i] * delta;
+        particles.y[i] += particles.vy[i] * delta;
+        particles.z[i] = max(0, particles.z[i] + particles.vz[i] * delta);
+        particles.age[i] += delta;
+    }
+}
 
-    Vector2 drawPosition = particle->entity.position;
-    drawPosition.y -= particle->entity.height;
+void updateParticles(float delta) {
+    integrateParticles(0, particles.count, delta);
 
-    drawSpriteAnchoredScaled(*particle->sprite, drawPosition, 0, (Vector2){ scale , scale }, (Vector2) { 0.5, 0.5 }, color);
+    int i = 0;
+    while (i < particles.count) {
+        if (particles.age[i] > particles.duration[i]) {
+            particleEmitters[particles.emitter[i]].liveCount--;
+            particles.count--;
+            moveParticle(i, particles.count);
+        } else {
+            i++;
+        }
+    }
 }
 
-void onParticleDestroyed(int id) {
+void drawParticles(Rectangle view) {
+    for ITERATE(i, particles.count) {
+        if (!CheckCollisionPointRec((Vector2) { particles.x[i], particles.y[i] }, view)) {
+            cullStats.culledSprites++;
+            continue;
+        }
+        cullStats.drawnSprites++;
+
+        float alivePercent = particles.age[i] / particles.duration[i];
+
+        Color color = ColorLerp(particles.startColor[i], particles.endColor[i], alivePercent);
+        float scale = Lerp(particles.startScale[i], particles.endScale[i], alivePercent);
 
+        Vector2 drawPosition = { particles.x[i], particles.y[i] - particles.z[i] };
+
+        drawSpriteAnchoredScaled(*getParticleSprite(particles.sprite[i]), drawPosition, 0, (Vector2){ scale , scale }, (Vector2) { 0.5, 0.5 }, color);
+    }
 }
 
 //------------------------------------------------------------------------------------
 // C Explosion
 //------------------------------------------------------------------------------------
 
-int explodeAt(Vector2 position, float radius) {
-    getMinionIdsInRange(&minionIdsInRange, &currentTileMap, position, radius, BOTH);
-    playSoundInstance(EXPLOSION_SOUND, 1.0, randRange(0.9, 1.1));
-    shakeCamera(6.0, 0.3);
+// Blasts are queued as commands and resolved together at the start of applyCommands.
+// The tiles they reach are merged row by row, so a cell under several overlapping blasts
+// is read once and each of its minions is tested against every blast covering that row.
+// The batch makes one sound and one shake, its dust budget is shared between the blasts.
+
+#define EXPLOSION_BATCH 64
+#define EXPLOSION_DUST_PER_BLAST 40
+#define MAX_EXPLOSION_DUST 160
+
+typedef struct ExplosionSpan {
+    int minX;
+    int maxX;
+    int blast;
+} ExplosionSpan;
+
+// Kills every minion inside any of the blasts
+void sweepExplosions(TileMap* tileMap, MinionQueryArea* areas, int count) {
+    ExplosionSpan spans[EXPLOSION_BATCH];
+    int minY = INT_MAX;
+    int maxY = INT_MIN;
+
+    for ITERATE(i, count) {
+        minY = imin(minY, areas[i].minY);
+        maxY = imax(maxY, areas[i].maxY);
+    }
+
+    for (int y = minY; y <= maxY; y++) {
+        // This row's span of every blast reaching it, sorted by minX
+        int spanCount = 0;
+        for ITERATE(i, count) {
+            ExplosionSpan span = { .blast = i };
+            if (y < areas[i].minY || y > areas[i].maxY) continue;
+            if (!getMinionQueryRowSpan(&areas[i], y, &span.minX, &span.maxX)) continue;
+
+            int j = spanCount++;
+            while (j > 0 && spans[j - 1].minX > span.minX) {
+                spans[j] = spans[j - 1];
+                j--;
+            }
+            spans[j] = span;
+        }
+
+        // Each run of overlapping spans is one contiguous range of grid slots per faction
+        int first = 0;
+        while (first < spanCount) {
+            int last = first + 1;
+            int runMaxX = spans[first].maxX;
+            while (last < spanCount && spans[last].minX <= runMaxX) {
+                runMaxX = imax(runMaxX, spans[last].maxX);
+                last++;
+            }
+
+            for ITERATE(faction, FACTION_COUNT) {
+                int start, end;
+                if (!getMinionGridRun(tileMap, faction, y, spans[first].minX, runMaxX, &start, &end)) continue;
+
+                for (int slot = start; slot < end; slot++) {
+                    if (tileMap->minionAliveMasks[slot] == 0) continue;
+                    float x = tileMap->minionXs[slot];
+                    float minionY = tileMap->minionYs[slot];
+
+                    for (int i = first; i < last; i++) {
+                        MinionQueryArea* area = &areas[spans[i].blast];
+                        float dx = x - area->position.x;
+                        float dy = minionY - area->position.y;
+                        if (dx * dx + dy * dy > area->radiusSqr) continue;
+
+                        queueDestroyEntity(MINION_TYPE, tileMap->minionIds[slot]);
+                        break;
+                    }
+                }
+            }
+            first = last;
+        }
+    }
+}
+
+void resolveExplosions(Command* explosions, int count) {
+    MinionQueryArea areas[EXPLOSION_BATCH];
 
-    //printf("%d\n", minionIdsInRange.used);
-    for ITERATE(i, minionIdsInRange.used) {
-        int id = minionIdsInRange.array[i];
-        destroyEntity(MINION_TYPE, id);
+    for (int batchStart = 0; batchStart < count; batchStart += EXPLOSION_BATCH) {
+        int batchCount = imin(count - batchStart, EXPLOSION_BATCH);
+        for ITERATE(i, batchCount) {
+            Command* explosion = &explosions[batchStart + i];
+            areas[i] = getMinionQueryArea(&world->currentTileMap, explosion->explosion.position, explosion->explosion.radius, BOTH);
+        }
+        sweepExplosions(&world->currentTileMap, areas, batchCount);
     }
 
-    spawnParticle(
-        (Vector3) { position.x, position.y + 50, 55 },
-        &FLASH_PARTICLE_SPRITE,
-        (Vector3) { 0, 0, 0 }, (Vector3) { 0, 0, 100 },
-        0.2, 0.0, WHITE, GetColor(0xFFFF0000), radius / FLASH_PARTICLE_SPRITE.width * 2.2, 0.2
-    );
+    // Bigger batches sound deeper and shake harder
+    int extraBlasts = imin(count - 1, 4);
+    playSoundInstance(EXPLOSION_SOUND, 1.0, randRange(0.9, 1.1) - extraBlasts * 0.05);
+    shakeCamera(6.0 + extraBlasts * 1.5, 0.3 + extraBlasts * 0.05);
 
-    for ITERATE(i, 40) {
+    for ITERATE(i, count) {
+        Vector2 position = explosions[i].explosion.position;
+        float radius = explosions[i].explosion.radius;
+        spawnParticle(
+            FLASH_EMITTER,
+            (Vector3) { position.x, position.y + 50, 55 },
+            FLASH_PARTICLE,
+            (Vector3) { 0, 0, 0 }, (Vector3) { 0, 0, 100 },
+            0.2, 0.0, WHITE, GetColor(0xFFFF0000), radius / FLASH_PARTICLE_SPRITE.width * 2.2, 0.2
+        );
+    }
+
+    int dustCount = imin(count * EXPLOSION_DUST_PER_BLAST, MAX_EXPLOSION_DUST);
+    for ITERATE(i, dustCount) {
+        Vector2 position = explosions[i % count].explosion.position;
+        float radius = explosions[i % count].explosion.radius;
         spawnParticle(
+            EXPLOSION_EMITTER,
             (Vector3) { position.x + randRange(-radius / 2, radius / 2), position.y + randRange(-radius / 2, radius / 2), randRange(0, 10) },
-            &DUST_PARTICLE_SPRITE,
+            DUST_PARTICLE,
             (Vector3) { randRange(-50, 50), randRange(-10, 10), randRange(0, 30) }, (Vector3) { 0, 0, 100 },
             randRange(0.5, 0.8), 1.0, GetColor(ENEMY_COLOR), BLACK, 2.0, 0.2
         );
     }
-
 }
 
 
@@ -1436,256 +3235,2878 @@ int explodeAt(Vector2 position, float radius) {
 #define PLACEABLE_TILE 0x3294c4ff
 #define TRAP_TILE 0xc49632ff
 
-TileMap loadTileMap(Image* mapImage) {
-    TileMap tileMap;
-    tileMap.width = mapImage->width;
-    tileMap.height = mapImage->height;
+// Fewest minion slots worth a grid build job of their own
+#define GRID_BUILD_MIN_SLOTS_PER_JOB 64
 
-    tileMap.tiles = malloc(sizeof(TileData) * tileMap.width * tileMap.height);
+// What getTile returns for tiles in chunks that were never allocated, never written to
+TileData EMPTY_TILE = { GROUND_TILE };
 
+size_t getBakedLevelSize(int width, int height, int towerCount, int minionGroupCount, int trapCount) {
+    return sizeof(BakedLevelHeader)
+        + sizeof(unsigned int) * width * height
+        + sizeof(BakedTower) * towerCount
+        + sizeof(BakedMinionGroup) * minionGroupCount
+        + sizeof(BakedTrap) * trapCount;
+}
+
+bool isBakedLevelValid(const unsigned char* data, size_t size) {
+    if (size < sizeof(BakedLevelHeader)) return false;
+
+    const BakedLevelHeader* header = (const BakedLevelHeader*) data;
+    return header->magic == BAKED_LEVEL_MAGIC
+        && header->version == BAKED_LEVEL_VERSION
+        && header->width > 0 && header->height > 0
+        && header->towerCount >= 0 && header->minionGroupCount >= 0 && header->trapCount >= 0
+        && size == getBakedLevelSize(header->width, header->height, header->towerCount, header->minionGroupCount, header->trapCount);
+}
+
+// Decodes the colour codes of a map image, free the result when done
+unsigned char* createBakedLevel(Level* level, Image* mapImage, size_t* size) {
+    int tileCount = mapImage->width * mapImage->height;
+    int towerCount = 0;
+    int minionGroupCount = 0;
+    int trapCount = 0;
+
+    // Count first so the whole level is one allocation
     for ITERATE(x, mapImage->width) {
         for ITERATE(y, mapImage->height) {
-            TileData* tileData = getTile(&tileMap, x, y);
-
             Color color = GetImageColor(*mapImage, x, y);
-            tileData->type = ColorToInt(color);
-            initIntArray(& (tileData->minionIds), 1);
+            unsigned int type = ColorToInt(color);
+            if (color.g == 0 && color.b == 0) { towerCount++; type = GROUND_TILE; }
+            if (color.r == 0 && color.b == 0) { towerCount++; type = GROUND_TILE; }
+            if (color.r == 0 && color.g == 0) { towerCount++; type = GROUND_TILE; }
+            if (color.g == 0xEE && color.b == 0xEE) { minionGroupCount++; type = GROUND_TILE; }
+            if (type == TRAP_TILE) trapCount++;
+        }
+    }
 
-            Vector2 position = {
-                (x + 0.5) * TILE_SIZE,
-                (y + 0.5) * TILE_SIZE
-            };
+    *size = getBakedLevelSize(mapImage->width, mapImage->height, towerCount, minionGroupCount, trapCount);
+    unsigned char* data = allocateZeroed(LEVEL_MEMORY, 1, *size);
+
+    BakedLevelHeader* header = (BakedLevelHeader*) data;
+    header->magic = BAKED_LEVEL_MAGIC;
+    header->version = BAKED_LEVEL_VERSION;
+    header->width = mapImage->width;
+    header->height = mapImage->height;
+    header->startingMinionCount = level->startingMinionCount;
+    header->isDebugLevel = level->isDebugLevel;
+    header->towerCount = towerCount;
+    header->minionGroupCount = minionGroupCount;
+    header->trapCount = trapCount;
+    strncpy(header->description, level->description, BAKED_DESCRIPTION_LENGTH - 1);
+
+    unsigned int* tileTypes = (unsigned int*) (header + 1);
+    BakedTower* towers = (BakedTower*) (tileTypes + tileCount);
+    BakedMinionGroup* minionGroups = (BakedMinionGroup*) (towers + towerCount);
+    BakedTrap* traps = (BakedTrap*) (minionGroups + minionGroupCount);
+
+    // Same order as the spawns used to happen in, so tower ids stay the same
+    for ITERATE(x, mapImage->width) {
+        for ITERATE(y, mapImage->height) {
+            Color color = GetImageColor(*mapImage, x, y);
+            unsigned int type = ColorToInt(color);
 
             if (color.g == 0 && color.b == 0) {
-                // SPAWN ARCHER TOWER
-                spawnTower(ARCHER_TOWER_TYPE, position, color.r * 10);
-                tileData->type = GROUND_TILE;
+                // ARCHER TOWER
+                *towers++ = (BakedTower){ ARCHER_TOWER_TYPE, x, y, color.r * 10 };
+                type = GROUND_TILE;
+            }
+
+            if (color.r == 0 && color.b == 0) {
+                // BOMB TOWER
+                *towers++ = (BakedTower){ BOMB_TOWER_TYPE, x, y, color.g * 10 };
+                type = GROUND_TILE;
             }
 
-            if (color.r == 0 && color.b == 0) {
-                // SPAWN BOMB TOWER
-                spawnTower(BOMB_TOWER_TYPE, position, color.g * 10);
-                tileData->type = GROUND_TILE;
-            }
+            if (color.r == 0 && color.g == 0) {
+                // SUMMONER TOWER
+                *towers++ = (BakedTower){ SUMMONER_TOWER_TYPE, x, y, color.b * 10 };
+                type = GROUND_TILE;
+            }
+
+            if (color.g == 0xEE && color.b == 0xEE) {
+                // ENEMY MINIONS
+                *minionGroups++ = (BakedMinionGroup){ x, y, color.r };
+                type = GROUND_TILE;
+            }
+
+            if (type == TRAP_TILE) {
+                // TRAP
+                *traps++ = (BakedTrap){ x, y };
+                type = GROUND_TILE;
+            }
+
+            tileTypes[y * mapImage->width + x] = type;
+        }
+    }
+
+    return data;
+}
+
+TileChunk* getOrCreateChunk(TileMap* tileMap, int chunkIndex) {
+    TileChunk* chunk = tileMap->chunks[chunkIndex];
+    if (chunk != NULL) return chunk;
+
+    chunk = arenaAlloc(tileMap->arena, sizeof(TileChunk));
+    for ITERATE(i, TILE_CHUNK_AREA) {
+        chunk->tiles[i] = EMPTY_TILE;
+    }
+    chunk->gridBuild = NULLID;
+    tileMap->chunks[chunkIndex] = chunk;
+    return chunk;
+}
+
+// For writing, x and y must be on the map
+TileData* getOrCreateTile(TileMap* tileMap, int x, int y) {
+    TileChunk* chunk = getOrCreateChunk(tileMap, (y >> TILE_CHUNK_SHIFT) * tileMap->chunkColumns + (x >> TILE_CHUNK_SHIFT));
+    return &chunk->tiles[((y & TILE_CHUNK_MASK) << TILE_CHUNK_SHIFT) + (x & TILE_CHUNK_MASK)];
+}
+
+bool isChunkActive(TileMap* tileMap, int chunkX, int chunkY) {
+    TileChunk* chunk = tileMap->chunks[chunkY * tileMap->chunkColumns + chunkX];
+    return chunk != NULL && chunk->gridBuild == tileMap->gridBuild;
+}
+
+// All ground, nothing spawned. All the map's memory comes from arena
+TileMap createTileMap(int width, int height, Arena* arena) {
+    TileMap tileMap;
+    tileMap.arena = arena;
+    tileMap.width = width;
+    tileMap.height = height;
+
+    int minionBankSize = world->entityClasses[MINION_TYPE].bankSize;
+
+    tileMap.chunkColumns = (tileMap.width + TILE_CHUNK_MASK) >> TILE_CHUNK_SHIFT;
+    tileMap.chunkRows = (tileMap.height + TILE_CHUNK_MASK) >> TILE_CHUNK_SHIFT;
+    int chunkCount = tileMap.chunkColumns * tileMap.chunkRows;
+    tileMap.chunks = arenaAlloc(arena, sizeof(TileChunk*) * chunkCount);
+    memset(tileMap.chunks, 0, sizeof(TileChunk*) * chunkCount);
+    tileMap.activeChunks = arenaAlloc(arena, sizeof(int) * chunkCount);
+    tileMap.previousActiveChunks = arenaAlloc(arena, sizeof(int) * chunkCount);
+    tileMap.activeChunkCount = 0;
+    tileMap.previousActiveChunkCount = 0;
+    tileMap.gridBuild = 0;
+
+    tileMap.minionIds = arenaAlloc(arena, sizeof(int) * minionBankSize);
+    tileMap.minionCellIndices = arenaAlloc(arena, sizeof(int) * minionBankSize);
+    tileMap.chunkMinionIds = arenaAlloc(arena, sizeof(int) * minionBankSize);
+    tileMap.chunkMinionStarts = arenaAlloc(arena, sizeof(int) * (chunkCount + 1));
+    tileMap.minionXs = arenaAlloc(arena, sizeof(float) * minionBankSize);
+    tileMap.minionYs = arenaAlloc(arena, sizeof(float) * minionBankSize);
+    tileMap.minionAliveMasks = arenaAlloc(arena, sizeof(int) * minionBankSize);
+    tileMap.minionSlots = arenaAlloc(arena, sizeof(int) * minionBankSize);
+    for ITERATE(i, minionBankSize) {
+        tileMap.minionSlots[i] = NULLID;
+    }
+    tileMap.minionGridCount = 0;
+
+    // One job per worker unless the bank is too small to be worth splitting that far
+    tileMap.jobCount = imax(1, imin(getWorkerCount(), minionBankSize / GRID_BUILD_MIN_SLOTS_PER_JOB));
+    tileMap.jobChunkCountsCapacity = tileMap.jobCount;
+    tileMap.jobChunkCounts = arenaAlloc(arena, sizeof(int) * tileMap.jobChunkCountsCapacity);
+    tileMap.gridRowOffsetsCapacity = TILE_CHUNK_SIZE * FACTION_COUNT;
+    tileMap.gridRowOffsets = arenaAlloc(arena, sizeof(int) * tileMap.gridRowOffsetsCapacity);
+
+    // Flow field memory is allocated by the first build
+    tileMap.flowFieldCount = world->entityClasses[TOWER_TYPE].bankSize;
+    tileMap.flowFields = arenaAlloc(arena, sizeof(FlowField) * tileMap.flowFieldCount);
+    for ITERATE(i, tileMap.flowFieldCount) {
+        tileMap.flowFields[i].isValid = false;
+        tileMap.flowFields[i].goalTileIndex = NULLID;
+        tileMap.flowFields[i].directions = NULL;
+    }
+    tileMap.flowCosts = NULL;
+    tileMap.flowQueue = NULL;
+    tileMap.flowQueueCapacity = 0;
+
+    return tileMap;
+}
+
+// bakedLevel must have passed isBakedLevelValid
+TileMap loadTileMap(const unsigned char* bakedLevel, Arena* arena) {
+    const BakedLevelHeader* header = (const BakedLevelHeader*) bakedLevel;
+
+    TileMap tileMap = createTileMap(header->width, header->height, arena);
+    int tileCount = tileMap.width * tileMap.height;
+
+    // One linear pass over the baked level, ground needs no chunk
+    const unsigned int* tileTypes = (const unsigned int*) (header + 1);
+    for ITERATE(i, tileCount) {
+        if (tileTypes[i] == GROUND_TILE) continue;
+        getOrCreateTile(&tileMap, i % tileMap.width, i / tileMap.width)->type = tileTypes[i];
+    }
+
+    const BakedTower* towers = (const BakedTower*) (tileTypes + tileCount);
+    for ITERATE(i, header->towerCount) {
+        Vector2 position = { (towers[i].x + 0.5) * TILE_SIZE, (towers[i].y + 0.5) * TILE_SIZE };
+        spawnTower(towers[i].type, position, towers[i].health);
+    }
+
+    const BakedMinionGroup* minionGroups = (const BakedMinionGroup*) (towers + header->towerCount);
+    for ITERATE(i, header->minionGroupCount) {
+        int x = minionGroups[i].x;
+        int y = minionGroups[i].y;
+        for ITERATE(j, minionGroups[i].count) {
+            spawnMinionAt((Vector2) { randRange(x, x + 1)* TILE_SIZE, randRange(y, y + 1)* TILE_SIZE }, false);
+        }
+    }
+
+    const BakedTrap* traps = (const BakedTrap*) (minionGroups + header->minionGroupCount);
+    for ITERATE(i, header->trapCount) {
+        int id = createEntity(TRAP_TYPE);
+        getEntity(TRAP_TYPE, id)->position = (Vector2) { (traps[i].x + 0.5) * TILE_SIZE, (traps[i].y + 0.5) * TILE_SIZE };
+    }
+
+    return tileMap;
+}
+
+TileData* getTile(TileMap* tileMap, int x, int y) {
+    if (x < 0 || y < 0 || x >= tileMap->width || y >= tileMap->height)
+        return NULL;
+
+    TileChunk* chunk = tileMap->chunks[(y >> TILE_CHUNK_SHIFT) * tileMap->chunkColumns + (x >> TILE_CHUNK_SHIFT)];
+    if (chunk == NULL) return &EMPTY_TILE;
+    return &chunk->tiles[((y & TILE_CHUNK_MASK) << TILE_CHUNK_SHIFT) + (x & TILE_CHUNK_MASK)];
+}
+
+// Grid build
+// Two passes. First a counting sort of the minion bank by active chunk, split into contiguous
+// slot ranges (one per job): locate -> activate the chunks holding minions -> count per job &
+// chunk -> prefix sum -> bucket. Then each active chunk sorts its own bucket by tile, split
+// into runs of chunks: total per tile -> prefix sum over chunk rows -> scatter.
+// The serial steps (activating chunks and both prefix sums) only walk chunks and chunk rows,
+// and no job touches more than its share of slots or chunks, so the build scales with jobs.
+// Each job buckets its ids in slot order after the ids of the jobs before it, so every tile
+// lists its minions in ascending id order no matter how many jobs ran. Chunks without
+// minions cost nothing.
+
+// Jobs get the world, pool threads run on whichever world asked for the build
+TileMap* bindGridJobWorld(void* context) {
+    world = context;
+    return &world->currentTileMap;
+}
+
+void getGridBuildJobRange(TileMap* tileMap, int jobIndex, int* start, int* end) {
+    int bankSize = world->entityClasses[MINION_TYPE].bankSize;
+    int slotsPerJob = (bankSize + tileMap->jobCount - 1) / tileMap->jobCount;
+    *start = imin(jobIndex * slotsPerJob, bankSize);
+    *end = imin(*start + slotsPerJob, bankSize);
+}
+
+// minionCellIndices gets (chunk index * chunk area + tile in chunk) * faction count + faction
+void locateGridJob(void* context, int jobIndex) {
+    TileMap* tileMap = bindGridJobWorld(context);
+
+    int start, end;
+    getGridBuildJobRange(tileMap, jobIndex, &start, &end);
+    for (int id = start; id < end; id++) {
+        Minion* minion = getMinion(id);
+        tileMap->minionCellIndices[id] = NULLID;
+        if (!minion->entity.isSpawned) continue;
+
+        Vector2 position = getMinionPosition(minion);
+        if (position.x < 0 || position.y < 0) continue;
+        int x = position.x / TILE_SIZE;
+        int y = position.y / TILE_SIZE;
+        if (x >= tileMap->width || y >= tileMap->height) continue;
+
+        int chunkIndex = (y >> TILE_CHUNK_SHIFT) * tileMap->chunkColumns + (x >> TILE_CHUNK_SHIFT);
+        int chunkTile = ((y & TILE_CHUNK_MASK) << TILE_CHUNK_SHIFT) + (x & TILE_CHUNK_MASK);
+        int faction = minion->isPlayer ? PLAYER_FACTION : ENEMY_FACTION;
+        tileMap->minionCellIndices[id] = (chunkIndex * TILE_CHUNK_AREA + chunkTile) * FACTION_COUNT + faction;
+    }
+}
+
+int compareInts(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+void activateGridChunks(TileMap* tileMap) {
+    int* swap = tileMap->previousActiveChunks;
+    tileMap->previousActiveChunks = tileMap->activeChunks;
+    tileMap->previousActiveChunkCount = tileMap->activeChunkCount;
+    tileMap->activeChunks = swap;
+    tileMap->activeChunkCount = 0;
+    tileMap->gridBuild++;
+
+    for ITERATE(id, world->entityClasses[MINION_TYPE].bankSize) {
+        int location = tileMap->minionCellIndices[id];
+        if (location == NULLID) continue;
+
+        int chunkIndex = location / (TILE_CHUNK_AREA * FACTION_COUNT);
+        TileChunk* chunk = getOrCreateChunk(tileMap, chunkIndex);
+        if (chunk->gridBuild == tileMap->gridBuild) continue;
+        chunk->gridBuild = tileMap->gridBuild;
+        tileMap->activeChunks[tileMap->activeChunkCount++] = chunkIndex;
+    }
+
+    // Chunks that just emptied keep stale counts otherwise
+    for ITERATE(i, tileMap->previousActiveChunkCount) {
+        TileChunk* chunk = tileMap->chunks[tileMap->previousActiveChunks[i]];
+        if (chunk->gridBuild == tileMap->gridBuild) continue;
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            for ITERATE(faction, FACTION_COUNT) {
+                chunk->tiles[tile].minionCounts[faction] = 0;
+            }
+        }
+    }
+
+    // Row order over the map, so bands of chunks sharing a chunk row are contiguous
+    qsort(tileMap->activeChunks, tileMap->activeChunkCount, sizeof(int), compareInts);
+    for ITERATE(i, tileMap->activeChunkCount) {
+        tileMap->chunks[tileMap->activeChunks[i]]->activeIndex = i;
+    }
+
+    int countsNeeded = tileMap->activeChunkCount * tileMap->jobCount;
+    if (countsNeeded > tileMap->jobChunkCountsCapacity) {
+        while (tileMap->jobChunkCountsCapacity < countsNeeded) tileMap->jobChunkCountsCapacity *= 2;
+        tileMap->jobChunkCounts = arenaAlloc(tileMap->arena, sizeof(int) * tileMap->jobChunkCountsCapacity);
+    }
+
+    int rowsNeeded = tileMap->activeChunkCount * FACTION_COUNT * TILE_CHUNK_SIZE;
+    if (rowsNeeded > tileMap->gridRowOffsetsCapacity) {
+        while (tileMap->gridRowOffsetsCapacity < rowsNeeded) tileMap->gridRowOffsetsCapacity *= 2;
+        tileMap->gridRowOffsets = arenaAlloc(tileMap->arena, sizeof(int) * tileMap->gridRowOffsetsCapacity);
+    }
+}
+
+void countGridJob(void* context, int jobIndex) {
+    TileMap* tileMap = bindGridJobWorld(context);
+    int* chunkCounts = &tileMap->jobChunkCounts[jobIndex * tileMap->activeChunkCount];
+    memset(chunkCounts, 0, sizeof(int) * tileMap->activeChunkCount);
+
+    int start, end;
+    getGridBuildJobRange(tileMap, jobIndex, &start, &end);
+    for (int id = start; id < end; id++) {
+        int location = tileMap->minionCellIndices[id];
+        if (location == NULLID) continue;
+        chunkCounts[tileMap->chunks[location / (TILE_CHUNK_AREA * FACTION_COUNT)]->activeIndex]++;
+    }
+}
+
+void bucketGridJob(void* context, int jobIndex) {
+    TileMap* tileMap = bindGridJobWorld(context);
+    int* chunkOffsets = &tileMap->jobChunkCounts[jobIndex * tileMap->activeChunkCount];
+
+    int start, end;
+    getGridBuildJobRange(tileMap, jobIndex, &start, &end);
+    for (int id = start; id < end; id++) {
+        int location = tileMap->minionCellIndices[id];
+        tileMap->minionSlots[id] = NULLID;
+        if (location == NULLID) continue;
+        tileMap->chunkMinionIds[chunkOffsets[tileMap->chunks[location / (TILE_CHUNK_AREA * FACTION_COUNT)]->activeIndex]++] = id;
+    }
+}
+
+// Runs of active chunks, balanced by their tiles plus their minions
+void getGridChunkJobRange(TileMap* tileMap, int jobIndex, int* start, int* end) {
+    int chunkCount = tileMap->activeChunkCount;
+    long long totalWork = tileMap->chunkMinionStarts[chunkCount] + (long long) chunkCount * TILE_CHUNK_AREA;
+    int bounds[2];
+    for ITERATE(side, 2) {
+        long long work = totalWork * (jobIndex + side) / tileMap->jobCount;
+        int low = 0;
+        int high = chunkCount;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (tileMap->chunkMinionStarts[middle] + (long long) middle * TILE_CHUNK_AREA < work) low = middle + 1;
+            else high = middle;
+        }
+        bounds[side] = low;
+    }
+    *start = bounds[0];
+    *end = bounds[1];
+}
+
+// Each tile's count and the density layer from the chunk's bucket, and each tile row's
+// count into gridRowOffsets
+void totalGridChunksJob(void* context, int jobIndex) {
+    TileMap* tileMap = bindGridJobWorld(context);
+
+    int start, end;
+    getGridChunkJobRange(tileMap, jobIndex, &start, &end);
+    for (int i = start; i < end; i++) {
+        TileChunk* chunk = tileMap->chunks[tileMap->activeChunks[i]];
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            for ITERATE(faction, FACTION_COUNT) {
+                chunk->tiles[tile].minionCounts[faction] = 0;
+            }
+        }
+        for (int entry = tileMap->chunkMinionStarts[i]; entry < tileMap->chunkMinionStarts[i + 1]; entry++) {
+            int location = tileMap->minionCellIndices[tileMap->chunkMinionIds[entry]];
+            chunk->tiles[location / FACTION_COUNT % TILE_CHUNK_AREA].minionCounts[location % FACTION_COUNT]++;
+        }
+
+        for ITERATE(faction, FACTION_COUNT) {
+            for ITERATE(row, TILE_CHUNK_SIZE) {
+                TileData* rowTiles = &chunk->tiles[row << TILE_CHUNK_SHIFT];
+                int rowSum = 0;
+                for ITERATE(column, TILE_CHUNK_SIZE) {
+                    // The density layer comes along with the counts
+                    rowSum += rowTiles[column].minionCounts[faction];
+                    rowTiles[column].minionSums[faction] = rowSum + (row > 0 ? rowTiles[column - TILE_CHUNK_SIZE].minionSums[faction] : 0);
+                }
+                tileMap->gridRowOffsets[(faction * tileMap->activeChunkCount + i) * TILE_CHUNK_SIZE + row] = rowSum;
+            }
+        }
+    }
+}
+
+// From each row's first slot, the tiles' starts, then the chunk's bucket into place
+void scatterGridJob(void* context, int jobIndex) {
+    TileMap* tileMap = bindGridJobWorld(context);
+    int tileFills[TILE_CHUNK_AREA * FACTION_COUNT];
+
+    int start, end;
+    getGridChunkJobRange(tileMap, jobIndex, &start, &end);
+    for (int i = start; i < end; i++) {
+        TileChunk* chunk = tileMap->chunks[tileMap->activeChunks[i]];
+        for ITERATE(faction, FACTION_COUNT) {
+            for ITERATE(row, TILE_CHUNK_SIZE) {
+                TileData* rowTiles = &chunk->tiles[row << TILE_CHUNK_SHIFT];
+                int offset = tileMap->gridRowOffsets[(faction * tileMap->activeChunkCount + i) * TILE_CHUNK_SIZE + row];
+                for ITERATE(column, TILE_CHUNK_SIZE) {
+                    rowTiles[column].minionStarts[faction] = offset;
+                    offset += rowTiles[column].minionCounts[faction];
+                }
+            }
+        }
+        memset(tileFills, 0, sizeof(tileFills));
+
+        for (int entry = tileMap->chunkMinionStarts[i]; entry < tileMap->chunkMinionStarts[i + 1]; entry++) {
+            int id = tileMap->chunkMinionIds[entry];
+            int location = tileMap->minionCellIndices[id];
+            int chunkCell = location % (TILE_CHUNK_AREA * FACTION_COUNT);
+            int slot = chunk->tiles[chunkCell / FACTION_COUNT].minionStarts[chunkCell % FACTION_COUNT] + tileFills[chunkCell]++;
+
+            Vector2 position = getMinionPosition(getMinion(id));
+            tileMap->minionIds[slot] = id;
+            tileMap->minionXs[slot] = position.x;
+            tileMap->minionYs[slot] = position.y;
+            tileMap->minionAliveMasks[slot] = -1;
+            tileMap->minionSlots[id] = slot;
+        }
+    }
+}
+
+// tileMap is the bound world's map, the build jobs reach it through the world
+void updateTileMap(TileMap* tileMap) {
+    runParallelJobs(locateGridJob, world, tileMap->jobCount);
+    activateGridChunks(tileMap);
+    runParallelJobs(countGridJob, world, tileMap->jobCount);
+
+    // Prefix sum in chunk order, turns each job's counts into its bucket offsets
+    int entry = 0;
+    for ITERATE(i, tileMap->activeChunkCount) {
+        tileMap->chunkMinionStarts[i] = entry;
+        for ITERATE(job, tileMap->jobCount) {
+            int* count = &tileMap->jobChunkCounts[job * tileMap->activeChunkCount + i];
+            int jobCount = *count;
+            *count = entry;
+            entry += jobCount;
+        }
+    }
+    tileMap->chunkMinionStarts[tileMap->activeChunkCount] = entry;
+
+    runParallelJobs(bucketGridJob, world, tileMap->jobCount);
+    runParallelJobs(totalGridChunksJob, world, tileMap->jobCount);
+
+    // Prefix sum over the chunk rows in grid order, each row's total becomes its first slot
+    int offset = 0;
+    for ITERATE(faction, FACTION_COUNT) {
+        int bandStart = 0;
+        while (bandStart < tileMap->activeChunkCount) {
+            int chunkRow = tileMap->activeChunks[bandStart] / tileMap->chunkColumns;
+            int bandEnd = bandStart;
+            while (bandEnd < tileMap->activeChunkCount && tileMap->activeChunks[bandEnd] / tileMap->chunkColumns == chunkRow) bandEnd++;
+
+            for ITERATE(row, TILE_CHUNK_SIZE) {
+                for (int i = bandStart; i < bandEnd; i++) {
+                    int* rowOffset = &tileMap->gridRowOffsets[(faction * tileMap->activeChunkCount + i) * TILE_CHUNK_SIZE + row];
+                    int rowCount = *rowOffset;
+                    *rowOffset = offset;
+                    offset += rowCount;
+                }
+            }
+            bandStart = bandEnd;
+        }
+    }
+    tileMap->minionGridCount = offset;
+
+    runParallelJobs(scatterGridJob, world, tileMap->jobCount);
+}
+
+// Slice of the tile's minions matching the mode
+int* getTileMinionIds(TileMap* tileMap, TileData* tile, int faction, int* count) {
+    *count = tile->minionCounts[faction];
+    return &tileMap->minionIds[tile->minionStarts[faction]];
+}
+
+// Queries skip it from now on, the grid drops it for good on the next rebuild
+void removeMinionFromGrid(int id) {
+    int slot = world->currentTileMap.minionSlots[id];
+    if (slot != NULLID) world->currentTileMap.minionAliveMasks[slot] = 0;
+}
+
+#if defined(SIMD_SSE2)
+// For each 4 bit lane mask, the set lanes packed to the front
+const unsigned char COMPRESS_LANES[16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0},
+    {2, 0, 0, 0}, {0, 2, 0, 0}, {1, 2, 0, 0}, {0, 1, 2, 0},
+    {3, 0, 0, 0}, {0, 3, 0, 0}, {1, 3, 0, 0}, {0, 1, 3, 0},
+    {2, 3, 0, 0}, {0, 2, 3, 0}, {1, 2, 3, 0}, {0, 1, 2, 3}
+};
+const unsigned char LANE_COUNT[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// Compress store, writes all 4 lanes and keeps the set ones, slots and distances need 4 spare entries
+int storeMatchingLanes(int mask, int firstSlot, __m128 distancesSqr, int* slots, float* slotDistancesSqr, int count) {
+    float lanes[4];
+    _mm_storeu_ps(lanes, distancesSqr);
+
+    for ITERATE(i, 4) {
+        int lane = COMPRESS_LANES[mask][i];
+        slots[count + i] = firstSlot + lane;
+        slotDistancesSqr[count + i] = lanes[lane];
+    }
+    return count + LANE_COUNT[mask];
+}
+#endif
+
+// Writes the alive grid slots in [start, end) within the radius, returns how many.
+// slots and distances need room for end - start + 4 entries
+int findSlotsInRange(TileMap* tileMap, int start, int end, Vector2 position, float radiusSqr, int* slots, float* distancesSqr) {
+    float* xs = tileMap->minionXs;
+    float* ys = tileMap->minionYs;
+    int* aliveMasks = tileMap->minionAliveMasks;
+    int count = 0;
+    int i = start;
+
+#if defined(SIMD_AVX2)
+    __m256 px8 = _mm256_set1_ps(position.x);
+    __m256 py8 = _mm256_set1_ps(position.y);
+    __m256 radiusSqr8 = _mm256_set1_ps(radiusSqr);
+
+    for (; i + 8 <= end; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&xs[i]), px8);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&ys[i]), py8);
+        __m256 distanceSqr = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 inRange = _mm256_cmp_ps(distanceSqr, radiusSqr8, _CMP_LE_OQ);
+        __m256 alive = _mm256_castsi256_ps(_mm256_loadu_si256((__m256i*) &aliveMasks[i]));
+        int mask = _mm256_movemask_ps(_mm256_and_ps(inRange, alive));
+        if (mask == 0) continue;
+
+        count = storeMatchingLanes(mask & 0xF, i, _mm256_castps256_ps128(distanceSqr), slots, distancesSqr, count);
+        count = storeMatchingLanes(mask >> 4, i + 4, _mm256_extractf128_ps(distanceSqr, 1), slots, distancesSqr, count);
+    }
+#endif
+
+#if defined(SIMD_SSE2)
+    __m128 px = _mm_set1_ps(position.x);
+    __m128 py = _mm_set1_ps(position.y);
+    __m128 radiusSqr4 = _mm_set1_ps(radiusSqr);
+
+    for (; i + 4 <= end; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&xs[i]), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&ys[i]), py);
+        __m128 distanceSqr = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 inRange = _mm_cmple_ps(distanceSqr, radiusSqr4);
+        __m128 alive = _mm_castsi128_ps(_mm_loadu_si128((__m128i*) &aliveMasks[i]));
+        int mask = _mm_movemask_ps(_mm_and_ps(inRange, alive));
+        if (mask == 0) continue;
+
+        count = storeMatchingLanes(mask, i, distanceSqr, slots, distancesSqr, count);
+    }
+#endif
+
+    for (; i < end; i++) {
+        float dx = xs[i] - position.x;
+        float dy = ys[i] - position.y;
+        float distanceSqr = dx * dx + dy * dy;
+        if (distanceSqr <= radiusSqr && aliveMasks[i]) {
+            slots[count] = i;
+            distancesSqr[count] = distanceSqr;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+// Tile range covered by a world rectangle, false if it misses the map
+bool getTileRange(TileMap* tileMap, Rectangle area, int* minX, int* minY, int* maxX, int* maxY) {
+    *minX = imax(floorf(area.x / TILE_SIZE), 0);
+    *minY = imax(floorf(area.y / TILE_SIZE), 0);
+    *maxX = imin(floorf((area.x + area.width) / TILE_SIZE), tileMap->width - 1);
+    *maxY = imin(floorf((area.y + area.height) / TILE_SIZE), tileMap->height - 1);
+    return *minX <= *maxX && *minY <= *maxY;
+}
+
+void drawTileMap(TileMap* tileMap, Rectangle view) {
+
+    static int borderAmount = 10;
+
+    DrawRectangle(-borderAmount, -borderAmount, tileMap->width * TILE_SIZE + borderAmount * 2, tileMap->height * TILE_SIZE + borderAmount * 2, BLACK);
+
+    int minX, minY, maxX, maxY;
+    int tileCount = tileMap->width * tileMap->height;
+    if (!getTileRange(tileMap, view, &minX, &minY, &maxX, &maxY)) {
+        cullStats.culledTiles += tileCount;
+        return;
+    }
+    int visibleCount = (maxX - minX + 1) * (maxY - minY + 1);
+    cullStats.drawnTiles += visibleCount;
+    cullStats.culledTiles += tileCount - visibleCount;
+
+    for (int x = minX; x <= maxX; x++) {
+        for (int y = minY; y <= maxY; y++) {
+            TileData* tile = getTile(tileMap, x, y);
+            bool isDark = ((x / 3) % 2) ^ ((y / 3) % 2);
+            Rectangle tileBounds = { 
+                x * TILE_SIZE, y * TILE_SIZE,
+                TILE_SIZE, TILE_SIZE,
+            };
+
+            switch(tile->type) {
+                case GROUND_TILE:
+                    DrawRectangleRec(tileBounds, GetColor(isDark ? GROUND_COLOR_2 : GROUND_COLOR));
+                    break;
+                case PLACEABLE_TILE:
+                    DrawRectangleRec(tileBounds, GetColor(isDark ? PLACEABLE_COLOR_2 : PLACEABLE_COLOR));
+                    break;
+            }
+
+            if (DEBUG_MODE) {
+                char str[16];
+                sprintf(str, "%d", tile->minionCounts[PLAYER_FACTION] + tile->minionCounts[ENEMY_FACTION]);
+                DrawText(str, tileBounds.x, tileBounds.y, 10, BLACK);
+            }
+        }
+    }
+}
+
+// Render worlds don't copy the minion grid, so this walks the bank
+void getVisibleMinionIds(IntArray* result, Rectangle view) {
+    result->used = 0;
+    for ITERATE(id, world->entityClasses[MINION_TYPE].bankSize) {
+        Entity* entity = getEntity(MINION_TYPE, id);
+        if (entity->isSpawned && CheckCollisionPointRec(entity->position, view)) insertIntArray(result, id);
+    }
+}
+
+TileData* getTileAt(TileMap* tileMap, Vector2 position) {
+    if (position.x >= 0 && position.y >= 0)
+        return getTile(tileMap, position.x / TILE_SIZE, position.y / TILE_SIZE);
+    return NULL;
+}
+
+// x + y * width, NULLID off the map
+int getTileIndexAt(TileMap* tileMap, Vector2 position) {
+    if (getTileAt(tileMap, position) == NULL) return NULLID;
+    return (int) (position.x / TILE_SIZE) + (int) (position.y / TILE_SIZE) * tileMap->width;
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C FlowField
+//------------------------------------------------------------------------------------
+
+// One flow field per tower slot over the tile grid. Every tile stores the neighbour to step
+// to on the cheapest path to the tower, or FLOW_DIRECT when the tower can be walked to in a
+// straight line from that tile. Fields are only rebuilt when a tower appears on a new tile
+// or a tile type changes, so steering costs one lookup per minion however many share a tower.
+// A field only covers the square FLOW_FIELD_REACH tiles around its tower, about a screen each
+// way at the default zoom. Further out minions head straight for the tower, so a field's
+// memory and build time don't grow with the map.
+
+#define FLOW_DIRECT 8
+#define FLOW_NONE 9
+
+#define FLOW_FIELD_REACH 64
+#define FLOW_FIELD_SIZE (FLOW_FIELD_REACH * 2 + 1)
+
+// Line of sight walks this many rings toward the goal before reusing the answer of the tile
+// it got to. Those lines only differ from the full one where it grazes a corner
+#define FLOW_SIGHT_STEPS 8
+
+#define FLOW_STRAIGHT_COST 10
+#define FLOW_DIAGONAL_COST 14
+
+const int FLOW_OFFSETS[8][2] = {
+    { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 }
+};
+
+bool isTileWalkable(TileData* tile) {
+    return tile != NULL && (tile->type == GROUND_TILE || tile->type == PLACEABLE_TILE);
+}
+
+void invalidateFlowFields(TileMap* tileMap) {
+    for ITERATE(i, tileMap->flowFieldCount) {
+        tileMap->flowFields[i].isValid = false;
+    }
+}
+
+void setTileType(TileMap* tileMap, Vector2 position, unsigned int type) {
+    TileData* tile = getTileAt(tileMap, position);
+    if (tile == NULL || tile->type == type) return;
+
+    getOrCreateTile(tileMap, position.x / TILE_SIZE, position.y / TILE_SIZE)->type = type;
+    invalidateFlowFields(tileMap);
+}
+
+// Min heap of (cost, field index) pairs in tileMap->flowQueue
+void pushFlowQueue(TileMap* tileMap, int* queueSize, int cost, int tileIndex) {
+    if (*queueSize == tileMap->flowQueueCapacity) {
+        tileMap->flowQueueCapacity = imax(tileMap->flowQueueCapacity * 2, 1024);
+        tileMap->flowQueue = arenaGrow(tileMap->arena, tileMap->flowQueue,
+            sizeof(int) * 2 * *queueSize, sizeof(int) * 2 * tileMap->flowQueueCapacity);
+    }
+
+    int* queue = tileMap->flowQueue;
+    int i = (*queueSize)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (queue[parent * 2] <= cost) break;
+        queue[i * 2] = queue[parent * 2];
+        queue[i * 2 + 1] = queue[parent * 2 + 1];
+        i = parent;
+    }
+    queue[i * 2] = cost;
+    queue[i * 2 + 1] = tileIndex;
+}
+
+void popFlowQueue(TileMap* tileMap, int* queueSize, int* cost, int* tileIndex) {
+    int* queue = tileMap->flowQueue;
+    *cost = queue[0];
+    *tileIndex = queue[1];
+
+    int size = --(*queueSize);
+    int lastCost = queue[size * 2];
+    int lastIndex = queue[size * 2 + 1];
+    int i = 0;
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= size) break;
+        if (child + 1 < size && queue[(child + 1) * 2] < queue[child * 2]) child++;
+        if (queue[child * 2] >= lastCost) break;
+        queue[i * 2] = queue[child * 2];
+        queue[i * 2 + 1] = queue[child * 2 + 1];
+        i = child;
+    }
+    queue[i * 2] = lastCost;
+    queue[i * 2 + 1] = lastIndex;
+}
+
+// Steps along the line between the two tile centers, through every tile it touches, until
+// it's within ring tiles of the goal (x1, y1). Passing exactly through a corner needs both
+// side tiles to be walkable, same as diagonal steps. False if a tile on the way isn't
+// walkable, otherwise the tile index it stopped on goes in inner
+bool isFlowLineClear(TileMap* tileMap, int x0, int y0, int x1, int y1, int ring, int* inner) {
+    int nx = abs(x1 - x0);
+    int ny = abs(y1 - y0);
+    int stepX = x1 > x0 ? 1 : -1;
+    int stepY = y1 > y0 ? 1 : -1;
+
+    int x = x0;
+    int y = y0;
+    int ix = 0;
+    int iy = 0;
+    while (abs(x1 - x) > ring || abs(y1 - y) > ring) {
+        int decision = (1 + 2 * ix) * ny - (1 + 2 * iy) * nx;
+        if (decision == 0) {
+            if (!isTileWalkable(getTile(tileMap, x + stepX, y)) || !isTileWalkable(getTile(tileMap, x, y + stepY)))
+                return false;
+            x += stepX;
+            y += stepY;
+            ix++;
+            iy++;
+        } else if (decision < 0) {
+            x += stepX;
+            ix++;
+        } else {
+            y += stepY;
+            iy++;
+        }
+        if (!isTileWalkable(getTile(tileMap, x, y))) return false;
+    }
+    *inner = x + y * tileMap->width;
+    return true;
+}
+
+// Index into the field's directions, NULLID if the tile isn't covered
+int getFlowFieldIndex(FlowField* field, int x, int y) {
+    if (x < field->minX || x > field->maxX || y < field->minY || y > field->maxY) return NULLID;
+    return (x - field->minX) + (y - field->minY) * FLOW_FIELD_SIZE;
+}
+
+void buildFlowField(TileMap* tileMap, FlowField* field, int goalTileIndex) {
+    int fieldArea = FLOW_FIELD_SIZE * FLOW_FIELD_SIZE;
+    if (tileMap->flowCosts == NULL) tileMap->flowCosts = arenaAlloc(tileMap->arena, sizeof(int) * fieldArea);
+    if (field->directions == NULL) field->directions = arenaAlloc(tileMap->arena, sizeof(unsigned char) * fieldArea);
+    int* costs = tileMap->flowCosts;
+    unsigned char* directions = field->directions;
+
+    for ITERATE(i, fieldArea) {
+        costs[i] = INT_MAX;
+        directions[i] = FLOW_NONE;
+    }
+
+    int goalX = goalTileIndex % tileMap->width;
+    int goalY = goalTileIndex / tileMap->width;
+    field->minX = imax(goalX - FLOW_FIELD_REACH, 0);
+    field->minY = imax(goalY - FLOW_FIELD_REACH, 0);
+    field->maxX = imin(goalX + FLOW_FIELD_REACH, tileMap->width - 1);
+    field->maxY = imin(goalY + FLOW_FIELD_REACH, tileMap->height - 1);
+
+    // Dijkstra out from the goal
+    int queueSize = 0;
+    int goalIndex = getFlowFieldIndex(field, goalX, goalY);
+    costs[goalIndex] = 0;
+    pushFlowQueue(tileMap, &queueSize, 0, goalIndex);
+
+    while (queueSize > 0) {
+        int cost, index;
+        popFlowQueue(tileMap, &queueSize, &cost, &index);
+        if (cost > costs[index]) continue;
+
+        int x = field->minX + index % FLOW_FIELD_SIZE;
+        int y = field->minY + index / FLOW_FIELD_SIZE;
+
+        for ITERATE(direction, 8) {
+            int dx = FLOW_OFFSETS[direction][0];
+            int dy = FLOW_OFFSETS[direction][1];
+            int neighbourIndex = getFlowFieldIndex(field, x + dx, y + dy);
+            if (neighbourIndex == NULLID || !isTileWalkable(getTile(tileMap, x + dx, y + dy))) continue;
+
+            bool isDiagonal = dx != 0 && dy != 0;
+            if (isDiagonal && (!isTileWalkable(getTile(tileMap, x + dx, y)) || !isTileWalkable(getTile(tileMap, x, y + dy))))
+                continue;
+
+            int newCost = cost + (isDiagonal ? FLOW_DIAGONAL_COST : FLOW_STRAIGHT_COST);
+            if (newCost < costs[neighbourIndex]) {
+                costs[neighbourIndex] = newCost;
+                // Neighbour steps back toward this tile
+                directions[neighbourIndex] = (direction + 4) % 8;
+                pushFlowQueue(tileMap, &queueSize, newCost, neighbourIndex);
+            }
+        }
+    }
+
+    // Tiles that can see the goal walk straight at it. Worked out ring by ring out from the
+    // goal: the line toward the goal is walked for FLOW_SIGHT_STEPS rings at most, and the
+    // tile sees the goal if that stretch is clear and the tile it ends on does
+    directions[goalIndex] = FLOW_DIRECT;
+    for (int ring = 1; ring <= FLOW_FIELD_REACH; ring++) {
+        for (int dy = -ring; dy <= ring; dy++) {
+            int columnStep = dy == -ring || dy == ring ? 1 : ring * 2;
+            for (int dx = -ring; dx <= ring; dx += columnStep) {
+                int index = getFlowFieldIndex(field, goalX + dx, goalY + dy);
+                if (index == NULLID || directions[index] == FLOW_NONE) continue;
+
+                int inner;
+                if (isFlowLineClear(tileMap, goalX + dx, goalY + dy, goalX, goalY, imax(ring - FLOW_SIGHT_STEPS, 0), &inner)
+                    && directions[getFlowFieldIndex(field, inner % tileMap->width, inner / tileMap->width)] == FLOW_DIRECT)
+                    directions[index] = FLOW_DIRECT;
+            }
+        }
+    }
+
+    field->goalTileIndex = goalTileIndex;
+    field->isValid = true;
+}
+
+void updateFlowFields(TileMap* tileMap) {
+    for ITERATE(id, tileMap->flowFieldCount) {
+        Entity* tower = getEntity(TOWER_TYPE, id);
+        if (!tower->isSpawned) continue;
+
+        int tileIndex = getTileIndexAt(tileMap, tower->position);
+        if (tileIndex == NULLID) continue;
+
+        FlowField* field = &tileMap->flowFields[id];
+        if (!field->isValid || field->goalTileIndex != tileIndex)
+            buildFlowField(tileMap, field, tileIndex);
+    }
+}
+
+// Normalized direction to move in from position to reach the tower
+Vector2 getFlowDirection(TileMap* tileMap, int towerId, Vector2 position, Vector2 targetPosition) {
+    Vector2 directDirection = Vector2Normalize(Vector2Subtract(targetPosition, position));
+
+    FlowField* field = &tileMap->flowFields[towerId];
+    int tileIndex = getTileIndexAt(tileMap, position);
+    if (!field->isValid || tileIndex == NULLID) return directDirection;
+
+    int x = tileIndex % tileMap->width;
+    int y = tileIndex / tileMap->width;
+    int index = getFlowFieldIndex(field, x, y);
+    if (index == NULLID) return directDirection;
+
+    int direction = field->directions[index];
+    if (direction == FLOW_DIRECT || direction == FLOW_NONE) return directDirection;
+
+    // Head for the center of the next tile
+    Vector2 nextTileCenter = {
+        (x + FLOW_OFFSETS[direction][0] + 0.5) * TILE_SIZE,
+        (y + FLOW_OFFSETS[direction][1] + 0.5) * TILE_SIZE
+    };
+    return Vector2Normalize(Vector2Subtract(nextTileCenter, position));
+}
+
+bool hasDirectFlow(TileMap* tileMap, int towerId, Vector2 position) {
+    FlowField* field = &tileMap->flowFields[towerId];
+    int tileIndex = getTileIndexAt(tileMap, position);
+    if (!field->isValid || tileIndex == NULLID) return false;
+
+    // Outside the field nothing says the way is clear
+    int index = getFlowFieldIndex(field, tileIndex % tileMap->width, tileIndex / tileMap->width);
+    return index != NULLID && field->directions[index] == FLOW_DIRECT;
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C Telemetry
+//------------------------------------------------------------------------------------
+
+// How full the fixed size pools get, and the check that a warmed up frame doesn't touch the
+// heap. Peaks are kept over the whole run and logged at exit with the allocation counts.
+
+#define ALLOCATION_WARMUP_TIME 5.0 // Seconds into a level before frames should stop allocating
+#define ALLOCATION_WARNING_INTERVAL 1.0
+
+const char* TYPE_NAMES[TYPE_COUNT] = { "Minion", "Tower", "Projectile", "Trap" };
+
+typedef struct CapacityStats {
+    int bankPeaks[TYPE_COUNT]; // Most slots spawned at once
+    int chunkCount;
+    int allocatedChunkCount;
+    int activeChunkPeak;
+    int gridMinionPeak;
+} CapacityStats;
+
+typedef struct AllocationStats {
+    long lastCounts[MEMORY_SUBSYSTEM_COUNT];
+    long frameCounts[MEMORY_SUBSYSTEM_COUNT]; // Made during the last frame, on any thread
+    long frameCount;
+    int lateFrameCount; // Frames past the warm up that allocated anyway
+    double lastWarningTime;
+} AllocationStats;
+
+CapacityStats capacityStats; // Simulation thread, read by the overlay
+AllocationStats allocationStats; // Render thread
+
+// After each tick of the real world
+void updateCapacityStats() {
+    for ITERATE(type, TYPE_COUNT) {
+        capacityStats.bankPeaks[type] = imax(capacityStats.bankPeaks[type], world->entityClasses[type].spawnCount);
+    }
+
+    TileMap* tileMap = &world->currentTileMap;
+    int allocatedChunkCount = 0;
+    for ITERATE(i, tileMap->chunkColumns * tileMap->chunkRows) {
+        if (tileMap->chunks[i] != NULL) allocatedChunkCount++;
+    }
+    capacityStats.chunkCount = tileMap->chunkColumns * tileMap->chunkRows;
+    capacityStats.allocatedChunkCount = allocatedChunkCount;
+    capacityStats.activeChunkPeak = imax(capacityStats.activeChunkPeak, tileMap->activeChunkCount);
+    capacityStats.gridMinionPeak = imax(capacityStats.gridMinionPeak, tileMap->minionGridCount);
+}
+
+// Render thread, once per frame (or per tick when headless). isWarmedUp is false while a level
+// change is on its way and for a while after, loads allocate
+void updateAllocationStats(bool isWarmedUp, double time) {
+    allocationStats.frameCount = 0;
+    for ITERATE(i, MEMORY_SUBSYSTEM_COUNT) {
+        long count = atomicAdd(&allocationCounts[i], 0);
+        allocationStats.frameCounts[i] = count - allocationStats.lastCounts[i];
+        allocationStats.lastCounts[i] = count;
+        allocationStats.frameCount += allocationStats.frameCounts[i];
+    }
+
+    if (allocationStats.frameCount == 0 || !isWarmedUp) return;
+
+    allocationStats.lateFrameCount++;
+    if (time - allocationStats.lastWarningTime < ALLOCATION_WARNING_INTERVAL) return;
+    allocationStats.lastWarningTime = time;
+
+    char subsystems[256] = "";
+    int length = 0;
+    for ITERATE(i, MEMORY_SUBSYSTEM_COUNT) {
+        if (allocationStats.frameCounts[i] == 0) continue;
+        length += snprintf(subsystems + length, sizeof(subsystems) - length, " %s %ld",
+            MEMORY_SUBSYSTEM_NAMES[i], allocationStats.frameCounts[i]);
+    }
+    TraceLog(LOG_WARNING, "Warmed up frame made %ld heap allocations:%s", allocationStats.frameCount, subsystems);
+}
+
+void logTelemetry() {
+    TraceLog(LOG_INFO, "Heap allocations by subsystem");
+    for ITERATE(i, MEMORY_SUBSYSTEM_COUNT) {
+        TraceLog(LOG_INFO, "    %-10s %8ld allocations %12ld bytes", MEMORY_SUBSYSTEM_NAMES[i], allocationCounts[i], allocationBytes[i]);
+    }
+    TraceLog(LOG_INFO, "Warmed up frames that allocated: %d", allocationStats.lateFrameCount);
+
+    TraceLog(LOG_INFO, "Entity bank peaks");
+    for ITERATE(type, TYPE_COUNT) {
+        TraceLog(LOG_INFO, "    %-10s %5d of %5d slots", TYPE_NAMES[type], capacityStats.bankPeaks[type], mainWorld.entityClasses[type].bankSize);
+    }
+    TraceLog(LOG_INFO, "Tile chunks: %d of %d allocated, at most %d with minions, at most %d minions on the grid",
+        capacityStats.allocatedChunkCount, capacityStats.chunkCount, capacityStats.activeChunkPeak, capacityStats.gridMinionPeak);
+}
+
+
+
+
+//------------------------------------------------------------------------------------
+// C Simulation
+//------------------------------------------------------------------------------------
+
+float simulationTimeAccumulator;
+
+// One fixed step of TICK_DELTA seconds
+void updateSimulation() {
+    // Rebuild flow fields for new towers / changed tiles
+    updateFlowFields(&world->currentTileMap);
+
+    // Tower attacks, projectile impacts
+    advanceTimers();
+
+    // Update Entities, one batch per type
+    for ITERATE(type, TYPE_COUNT) {
+        EntityClass* entityClass = &world->entityClasses[type];
+        if (entityClass->updateAll != NULL) entityClass->updateAll(TICK_DELTA);
+    }
+    // Every player minion has picked its target again
+    world->isMinionTargetRecalculationPending = false;
+
+    // Apply spawns / destroys / damage recorded during the update
+    applyCommands();
+
+    // The render thread moves the simulation thread's particles
+    if (!isGhostThread && !isSimulationThread) updateParticles(TICK_DELTA);
+
+    // Update Tilemap
+    updateTileMap(&world->currentTileMap);
+
+    if (!isGhostThread) updateCapacityStats();
+
+    world->simulationTick++;
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C Snapshot
+//------------------------------------------------------------------------------------
+
+// The whole simulation state copied into one buffer between ticks: entity banks, timers,
+// tile types and the level counters. Entities only refer to each other (and to their
+// sprites) by type and id, so restoring is a straight copy back. Particles, sounds and
+// the camera are cosmetic and left out. A snapshot can only be restored onto the level
+// it was taken on, the minion grid and flow fields are rebuilt from the restored state.
+
+typedef struct WorldSnapshotHeader {
+    int levelNumber;
+    int width;
+    int height;
+    unsigned int simulationTick;
+    int minionInventoryCount;
+    int enemyMinionCount;
+    bool hasPlacedMinion;
+    bool isMinionTargetRecalculationPending;
+    int lastSpawnedIds[TYPE_COUNT];
+    int spawnCounts[TYPE_COUNT];
+    int timerSlots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    unsigned int timerCurrentTick;
+    int timerEventCapacity;
+    int timerFreeEvent;
+    int chunkCount; // Allocated tile chunks
+} WorldSnapshotHeader;
+
+// After the header: each bank, the timer events, then per chunk its index and tile types
+typedef struct WorldSnapshot {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} WorldSnapshot;
+
+// Taken by loadLevel, restored by restarts
+WorldSnapshot levelStartSnapshot;
+
+size_t getWorldSnapshotSize(int chunkCount) {
+    size_t size = sizeof(WorldSnapshotHeader);
+    for ITERATE(type, TYPE_COUNT) {
+        size += world->entityClasses[type].bankSize * world->entityClasses[type].structSize;
+    }
+    size += sizeof(TimerEvent) * world->timerWheel.eventCapacity;
+    size += (sizeof(int) + sizeof(unsigned int) * TILE_CHUNK_AREA) * chunkCount;
+    return size;
+}
+
+void saveWorldSnapshot(WorldSnapshot* snapshot) {
+    TileMap* tileMap = &world->currentTileMap;
+    int chunkCount = 0;
+    for ITERATE(i, tileMap->chunkColumns * tileMap->chunkRows) {
+        if (tileMap->chunks[i] != NULL) chunkCount++;
+    }
+
+    snapshot->size = getWorldSnapshotSize(chunkCount);
+    if (snapshot->size > snapshot->capacity) {
+        snapshot->capacity = snapshot->size;
+        snapshot->data = reallocate(SNAPSHOT_MEMORY, snapshot->data, snapshot->capacity);
+    }
+
+    WorldSnapshotHeader* header = (WorldSnapshotHeader*) snapshot->data;
+    header->levelNumber = world->levelNumber;
+    header->width = tileMap->width;
+    header->height = tileMap->height;
+    header->simulationTick = world->simulationTick;
+    header->minionInventoryCount = world->minionInventoryCount;
+    header->enemyMinionCount = world->enemyMinionCount;
+    header->hasPlacedMinion = world->hasPlacedMinion;
+    header->isMinionTargetRecalculationPending = world->isMinionTargetRecalculationPending;
+    for ITERATE(type, TYPE_COUNT) {
+        header->lastSpawnedIds[type] = world->entityClasses[type].lastSpawnedId;
+        header->spawnCounts[type] = world->entityClasses[type].spawnCount;
+    }
+    memcpy(header->timerSlots, world->timerWheel.slots, sizeof(world->timerWheel.slots));
+    header->timerCurrentTick = world->timerWheel.currentTick;
+    header->timerEventCapacity = world->timerWheel.eventCapacity;
+    header->timerFreeEvent = world->timerWheel.freeEvent;
+    header->chunkCount = chunkCount;
+
+    unsigned char* data = (unsigned char*) (header + 1);
+    for ITERATE(type, TYPE_COUNT) {
+        size_t bankSize = world->entityClasses[type].bankSize * world->entityClasses[type].structSize;
+        memcpy(data, world->entityClasses[type].bank, bankSize);
+        data += bankSize;
+    }
+
+    memcpy(data, world->timerWheel.events, sizeof(TimerEvent) * world->timerWheel.eventCapacity);
+    data += sizeof(TimerEvent) * world->timerWheel.eventCapacity;
+
+    for ITERATE(i, tileMap->chunkColumns * tileMap->chunkRows) {
+        TileChunk* chunk = tileMap->chunks[i];
+        if (chunk == NULL) continue;
+
+        memcpy(data, &i, sizeof(int));
+        unsigned int* tileTypes = (unsigned int*) (data + sizeof(int));
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            tileTypes[tile] = chunk->tiles[tile].type;
+        }
+        data += sizeof(int) + sizeof(unsigned int) * TILE_CHUNK_AREA;
+    }
+}
+
+// NULLID if nothing has been saved
+int getWorldSnapshotLevel(WorldSnapshot* snapshot) {
+    if (snapshot->size == 0) return NULLID;
+    return ((WorldSnapshotHeader*) snapshot->data)->levelNumber;
+}
+
+// Onto the bound world, whose map must be the snapshot level's size. False if it isn't
+bool restoreWorldSnapshot(WorldSnapshot* snapshot) {
+    TileMap* tileMap = &world->currentTileMap;
+    WorldSnapshotHeader* header = (WorldSnapshotHeader*) snapshot->data;
+    if (snapshot->size == 0 || header->width != tileMap->width || header->height != tileMap->height)
+        return false;
+
+    world->simulationTick = header->simulationTick;
+    world->minionInventoryCount = header->minionInventoryCount;
+    world->enemyMinionCount = header->enemyMinionCount;
+    world->hasPlacedMinion = header->hasPlacedMinion;
+    world->isMinionTargetRecalculationPending = header->isMinionTargetRecalculationPending;
+    for ITERATE(type, TYPE_COUNT) {
+        world->entityClasses[type].lastSpawnedId = header->lastSpawnedIds[type];
+        world->entityClasses[type].spawnCount = header->spawnCounts[type];
+    }
+
+    unsigned char* data = (unsigned char*) (header + 1);
+    for ITERATE(type, TYPE_COUNT) {
+        size_t bankSize = world->entityClasses[type].bankSize * world->entityClasses[type].structSize;
+        memcpy(world->entityClasses[type].bank, data, bankSize);
+        data += bankSize;
+    }
+
+    if (header->timerEventCapacity > world->timerWheel.eventCapacity)
+        world->timerWheel.events = reallocate(TIMER_MEMORY, world->timerWheel.events, sizeof(TimerEvent) * header->timerEventCapacity);
+    world->timerWheel.eventCapacity = header->timerEventCapacity;
+    memcpy(world->timerWheel.events, data, sizeof(TimerEvent) * world->timerWheel.eventCapacity);
+    data += sizeof(TimerEvent) * world->timerWheel.eventCapacity;
+    memcpy(world->timerWheel.slots, header->timerSlots, sizeof(world->timerWheel.slots));
+    world->timerWheel.currentTick = header->timerCurrentTick;
+    world->timerWheel.freeEvent = header->timerFreeEvent;
+
+    // Chunks allocated since the snapshot go back to ground
+    for ITERATE(i, tileMap->chunkColumns * tileMap->chunkRows) {
+        TileChunk* chunk = tileMap->chunks[i];
+        if (chunk == NULL) continue;
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            chunk->tiles[tile].type = GROUND_TILE;
+        }
+    }
+    for ITERATE(i, header->chunkCount) {
+        int chunkIndex;
+        memcpy(&chunkIndex, data, sizeof(int));
+        TileChunk* chunk = getOrCreateChunk(tileMap, chunkIndex);
+        unsigned int* tileTypes = (unsigned int*) (data + sizeof(int));
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            chunk->tiles[tile].type = tileTypes[tile];
+        }
+        data += sizeof(int) + sizeof(unsigned int) * TILE_CHUNK_AREA;
+    }
+
+    world->tileVersion++;
+
+    clearCommandBuffers();
+    invalidateFlowFields(tileMap);
+    updateTileMap(tileMap);
+    return true;
+}
+
+void freeWorldSnapshot(WorldSnapshot* snapshot) {
+    free(snapshot->data);
+    snapshot->data = NULL;
+    snapshot->size = snapshot->capacity = 0;
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C Preview
+//------------------------------------------------------------------------------------
+
+// While preview mode is on, the world under the cursor is forked onto a thread of its own
+// and simulated PREVIEW_SECONDS ahead as fast as it can go, as if the player dropped
+// PREVIEW_MINION_COUNT minions there. The ghost world has its own banks, timers and map;
+// the fork is a world snapshot, so the main world is never touched. A newer request
+// cancels the run in progress.
+
+#define PREVIEW_SECONDS 10
+#define PREVIEW_TICKS (PREVIEW_SECONDS * SIMULATION_TICK_RATE)
+#define PREVIEW_MINION_COUNT 10
+#define PREVIEW_REFRESH_DISTANCE 24
+
+typedef struct PreviewResult {
+    int requestNumber; // NULLID until a run finishes
+    int levelNumber;
+    Vector2 position;
+    int placedMinionCount;
+    int survivingMinionCount; // Of the placed ones
+    bool* towerFalls; // Per tower slot, alive when forked and gone by the end
+    float speedup; // Simulated seconds per real second
+} PreviewResult;
+
+typedef struct Preview {
+    Thread* thread;
+    Mutex* mutex;
+    Condition* requestReady;
+    bool isShuttingDown;
+
+    // Written by requestPreview, read by the thread under the lock
+    WorldSnapshot requestSnapshot;
+    Vector2 requestPosition;
+    int requestMinionCount;
+    bool hasRequest;
+    volatile long requestNumber;
+
+    PreviewResult result; // Under the lock
+} Preview;
+
+World ghostWorld;
+Preview preview;
+
+// Render thread side
+bool isPreviewEnabled;
+PreviewResult shownPreview; // Copy of the last result
+Vector2 lastPreviewPosition;
+unsigned int previewRequestTick;
+
+bool isPreviewCancelled(long requestNumber) {
+    return atomicAdd(&preview.requestNumber, 0) != requestNumber;
+}
+
+// Runs on the preview thread with the ghost world bound
+void runPreview(WorldSnapshot* snapshot, Vector2 position, int minionCount, long requestNumber, PreviewResult* result) {
+    WorldSnapshotHeader* header = (WorldSnapshotHeader*) snapshot->data;
+    if (header->width != world->currentTileMap.width || header->height != world->currentTileMap.height) {
+        resetArena(&world->levelArena);
+        world->currentTileMap = createTileMap(header->width, header->height, &world->levelArena);
+        initArenaIntArray(&world->minionIdsInRange, &world->levelArena, 128);
+    }
+    restoreWorldSnapshot(snapshot);
+    // Same fork and placement, same outcome
+    threadRandomState = 0x9E3779B9;
+
+    int towerBankSize = world->entityClasses[TOWER_TYPE].bankSize;
+    for ITERATE(id, towerBankSize) {
+        Entity* tower = getEntity(TOWER_TYPE, id);
+        result->towerFalls[id] = tower->isSpawned && !tower->isDestroyQueued;
+    }
+
+    // Dropped in a small cluster, like a short drag
+    int placedIds[PREVIEW_MINION_COUNT];
+    unsigned int placedGenerations[PREVIEW_MINION_COUNT];
+    int placedCount = 0;
+    for ITERATE(i, imin(minionCount, world->minionInventoryCount)) {
+        Vector2 offset = { randRange(-spawnDeltaDis, spawnDeltaDis), randRange(-spawnDeltaDis, spawnDeltaDis) };
+        int id = spawnMinionAt(Vector2Add(position, offset), true);
+        if (id == NULLID) break;
+        world->minionInventoryCount--;
+        world->hasPlacedMinion = true;
+        placedIds[placedCount] = id;
+        placedGenerations[placedCount] = getEntity(MINION_TYPE, id)->generation;
+        placedCount++;
+    }
+
+    double startTime = GetTime();
+    int tick = 0;
+    for (; tick < PREVIEW_TICKS; tick++) {
+        if (tick % SIMULATION_TICK_RATE == 0 && isPreviewCancelled(requestNumber)) return;
+        updateSimulation();
+    }
+
+    result->requestNumber = requestNumber;
+    result->levelNumber = header->levelNumber;
+    result->position = position;
+    result->placedMinionCount = placedCount;
+    result->survivingMinionCount = 0;
+    for ITERATE(i, placedCount) {
+        Entity* minion = getEntity(MINION_TYPE, placedIds[i]);
+        if (minion->isSpawned && minion->generation == placedGenerations[i]) result->survivingMinionCount++;
+    }
+    for ITERATE(id, towerBankSize) {
+        Entity* tower = getEntity(TOWER_TYPE, id);
+        result->towerFalls[id] = result->towerFalls[id] && !tower->isSpawned;
+    }
+    result->speedup = (float) tick / SIMULATION_TICK_RATE / fmax(GetTime() - startTime, 0.001);
+}
+
+void previewLoop(void* argument) {
+    isGhostThread = true;
+    world = &ghostWorld;
+
+    for ITERATE(type, TYPE_COUNT) {
+        initClass(type);
+    }
+    initCommandBuffers();
+    initTimers();
+
+    WorldSnapshot snapshot = { 0 };
+    PreviewResult result = { 0 };
+    result.towerFalls = allocate(PREVIEW_MEMORY, sizeof(bool) * world->entityClasses[TOWER_TYPE].bankSize);
+
+    lockMutex(preview.mutex);
+    while (true) {
+        while (!preview.hasRequest && !preview.isShuttingDown) {
+            waitCondition(preview.requestReady, preview.mutex);
+        }
+        if (preview.isShuttingDown) break;
+
+        // Swap buffers so the main thread can write the next request while this one runs
+        WorldSnapshot swap = snapshot;
+        snapshot = preview.requestSnapshot;
+        preview.requestSnapshot = swap;
+        Vector2 position = preview.requestPosition;
+        int minionCount = preview.requestMinionCount;
+        long requestNumber = preview.requestNumber;
+        preview.hasRequest = false;
+        unlockMutex(preview.mutex);
+
+        result.requestNumber = NULLID;
+        runPreview(&snapshot, position, minionCount, requestNumber, &result);
+
+        lockMutex(preview.mutex);
+        if (result.requestNumber != NULLID) {
+            bool* towerFalls = preview.result.towerFalls;
+            memcpy(towerFalls, result.towerFalls, sizeof(bool) * world->entityClasses[TOWER_TYPE].bankSize);
+            preview.result = result;
+            preview.result.towerFalls = towerFalls;
+        }
+    }
+    unlockMutex(preview.mutex);
+
+    free(result.towerFalls);
+    freeWorldSnapshot(&snapshot);
+    destroyArena(&world->levelArena);
+    destroyCommandBuffers();
+    destroyTimers();
+    for ITERATE(type, TYPE_COUNT) {
+        destroyClass(type);
+    }
+}
+
+void initPreview() {
+    int towerBankSize = world->entityClasses[TOWER_TYPE].bankSize;
+    preview.mutex = createMutex();
+    preview.requestReady = createCondition();
+    preview.result.requestNumber = NULLID;
+    preview.result.towerFalls = allocate(PREVIEW_MEMORY, sizeof(bool) * towerBankSize);
+    shownPreview.requestNumber = NULLID;
+    shownPreview.towerFalls = allocate(PREVIEW_MEMORY, sizeof(bool) * towerBankSize);
+    preview.thread = createThread(previewLoop, NULL);
+}
+
+void destroyPreview() {
+    lockMutex(preview.mutex);
+    preview.isShuttingDown = true;
+    signalCondition(preview.requestReady);
+    unlockMutex(preview.mutex);
+
+    if (preview.thread != NULL) joinThread(preview.thread);
+
+    freeWorldSnapshot(&preview.requestSnapshot);
+    free(preview.result.towerFalls);
+    free(shownPreview.towerFalls);
+    destroyCondition(preview.requestReady);
+    destroyMutex(preview.mutex);
+}
+
+// Forks the bound world as it is now, so only between ticks
+void requestPreview(Vector2 position, int minionCount) {
+    if (preview.thread == NULL) return;
+
+    lockMutex(preview.mutex);
+    saveWorldSnapshot(&preview.requestSnapshot);
+    preview.requestPosition = position;
+    preview.requestMinionCount = minionCount;
+    preview.hasRequest = true;
+    atomicAdd(&preview.requestNumber, 1);
+    signalCondition(preview.requestReady);
+    unlockMutex(preview.mutex);
+}
+
+// Copies the latest finished result into shownPreview
+void pollPreview() {
+    lockMutex(preview.mutex);
+    if (preview.result.requestNumber != shownPreview.requestNumber) {
+        bool* towerFalls = shownPreview.towerFalls;
+        memcpy(towerFalls, preview.result.towerFalls, sizeof(bool) * world->entityClasses[TOWER_TYPE].bankSize);
+        shownPreview = preview.result;
+        shownPreview.towerFalls = towerFalls;
+    }
+    unlockMutex(preview.mutex);
+}
+
+void drawPreview() {
+    if (!isPreviewEnabled || shownPreview.requestNumber == NULLID || shownPreview.levelNumber != world->levelNumber)
+        return;
+
+    for ITERATE(id, world->entityClasses[TOWER_TYPE].bankSize) {
+        Entity* tower = getEntity(TOWER_TYPE, id);
+        if (!tower->isSpawned) continue;
+
+        bool falls = shownPreview.towerFalls[id];
+        Vector2 labelPosition = Vector2Add(tower->position, (Vector2) { 0, -TILE_SIZE * 1.5 });
+        drawTextAnchored(labelPosition, (Vector2) { 0.5, 1.0 }, MAIN_FONT, falls ? "falls" : "holds", 24, 0, falls ? GREEN : RED);
+    }
+
+    char str[32];
+    sprintf(str, "%d/%d survive", shownPreview.survivingMinionCount, shownPreview.placedMinionCount);
+    drawTextAnchored(shownPreview.position, (Vector2) { 0.5, 1.0 }, MAIN_FONT, str, 24, 0, WHITE);
+}
+
+
+
+//------------------------------------------------------------------------------------
+// C LoadLevel
+//------------------------------------------------------------------------------------
+
+
+
+
+
+
+void initLevels() {
+    levels[0] = (Level){
+        .imagePath = "Images/Maps/Level0.png",
+        .bakedPath = "Images/Maps/Level0.level",
+        .startingMinionCount = 100,
+        .description = "Click and Drag on the Blue Region",
+        .isDebugLevel = false
+    };
+    levels[1] = (Level){ 
+        .imagePath = "Images/Maps/Level1.png",
+        .bakedPath = "Images/Maps/Level1.level", 
+        .startingMinionCount = 40,
+        .description = "Choose Wisely",
+        .isDebugLevel = false
+    };
+    levels[2] = (Level){
+        .imagePath = "Images/Maps/Level2.png",
+        .bakedPath = "Images/Maps/Level2.level",
+        .startingMinionCount = 70,
+        .description = "Watch out!",
+        .isDebugLevel = false
+    };
+    levels[3] = (Level){
+        .imagePath = "Images/Maps/Level3.png",
+        .bakedPath = "Images/Maps/Level3.level",
+        .startingMinionCount = 80,
+        .description = "Double Trouble",
+        .isDebugLevel = false
+    };
+    levels[4] = (Level){
+        .imagePath = "Images/Maps/Level4.png",
+        .bakedPath = "Images/Maps/Level4.level",
+        .startingMinionCount = 120,
+        .description = "You and what army?",
+        .isDebugLevel = false
+    };
+    levels[5] = (Level){
+        .imagePath = "Images/Maps/Level5.png",
+        .bakedPath = "Images/Maps/Level5.level",
+        .startingMinionCount = 70,
+        .description = "I Summon Thee!",
+        .isDebugLevel = false
+    };
+    levels[6] = (Level){
+        .imagePath = "Images/Maps/Level6.png",
+        .bakedPath = "Images/Maps/Level6.level",
+        .startingMinionCount = 100,
+        .description = "The Final Challenge",
+        .isDebugLevel = false
+    };
+    levels[7] = (Level){
+        .imagePath = "Images/Maps/Freeplay.png",
+        .bakedPath = "Images/Maps/Freeplay.level",
+        .startingMinionCount = 1000,
+        .description = "Freeplay Unlocked! (Num Keys to Spawn)",
+        .isDebugLevel = true
+    };
+}
+
+// The baked files' metadata overrides the table above. Read once on the main thread before
+// the simulation thread starts, after that levels[] is read only
+void readBakedLevelInfo() {
+    for ITERATE(i, LEVEL_COUNT) {
+        Level* level = &levels[i];
+        MappedFile bakedFile = { 0 };
+        if (!mapFile(level->bakedPath, &bakedFile)) continue;
+
+        if (isBakedLevelValid(bakedFile.data, bakedFile.size)) {
+            const BakedLevelHeader* header = (const BakedLevelHeader*) bakedFile.data;
+            level->startingMinionCount = header->startingMinionCount;
+            level->isDebugLevel = header->isDebugLevel;
+            memcpy(level->bakedDescription, header->description, BAKED_DESCRIPTION_LENGTH);
+            level->bakedDescription[BAKED_DESCRIPTION_LENGTH - 1] = '\0';
+            level->description = level->bakedDescription;
+        }
+        unmapFile(&bakedFile);
+    }
+}
+
+// Offline step, writes every level's baked file next to its image
+int bakeLevels() {
+    int failedCount = 0;
+    for ITERATE(i, LEVEL_COUNT) {
+        Level* level = &levels[i];
+        Image mapImage = LoadImage(level->imagePath);
+        if (mapImage.data == NULL) {
+            printf("Couldn't load %s\n", level->imagePath);
+            failedCount++;
+            continue;
+        }
+
+        size_t size;
+        unsigned char* bakedLevel = createBakedLevel(level, &mapImage, &size);
+        if (SaveFileData(level->bakedPath, bakedLevel, size)) {
+            printf("Baked %s -> %s (%d bytes)\n", level->imagePath, level->bakedPath, (int) size);
+        } else {
+            printf("Couldn't write %s\n", level->bakedPath);
+            failedCount++;
+        }
+
+        free(bakedLevel);
+        UnloadImage(mapImage);
+    }
+    return failedCount == 0 ? 0 : 1;
+}
+
+void reloadLevel() {
+    LEVEL_TRANSITION_TIME_MAX = 1.5;
+    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
+    pendingLevelNumber = currentLevelNumber;
+}
+
+void gotoNextLevel() {
+    if (currentLevelNumber + 1 >= LEVEL_COUNT) return;
+    LEVEL_TRANSITION_TIME_MAX = 3.0;
+    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
+    pendingLevelNumber = max(0, currentLevelNumber + 1);
+}
+
+void gotoPreviousLevel() {
+    if (currentLevelNumber - 1 < 0) return;
+    LEVEL_TRANSITION_TIME_MAX = 1.0;
+    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
+    pendingLevelNumber = min(currentLevelNumber - 1, LEVEL_COUNT - 1);
+}
+
+void resetLevelView() {
+    levelStartTime = GetTime();
+    timeSinceLastInventoryIncrease = GetTime();
+    timeSinceLastInventoryDecrease = GetTime();
+
+    camera.zoom = 0.5;
+    setCameraCenter(&camera, (Vector2) {
+        world->currentTileMap.width * TILE_SIZE / 2,
+        world->currentTileMap.height * TILE_SIZE / 2
+    });
+}
+
+void loadLevel(Level* level) {
+
+    world->simulationTick = 0;
+    world->enemyMinionCount = 0;
+
+    // Reset classes
+    for ITERATE(type, TYPE_COUNT) {
+        resetClass(type);
+    }
+    clearCommandBuffers();
+    clearTimers();
+    simulationTimeAccumulator = 0;
+
+    // Drops the previous level's map and arrays
+    resetArena(&world->levelArena);
+
+    // Load map
+    MappedFile bakedFile = { 0 };
+    if (mapFile(level->bakedPath, &bakedFile) && isBakedLevelValid(bakedFile.data, bakedFile.size)) {
+        world->currentTileMap = loadTileMap(bakedFile.data, &world->levelArena);
+        unmapFile(&bakedFile);
+    } else {
+        // Not baked yet (or stale), decode the image like the bake would
+        if (bakedFile.data != NULL) unmapFile(&bakedFile);
+
+        Image tilemapImage = LoadImage(level->imagePath);
+        size_t size;
+        unsigned char* bakedLevel = createBakedLevel(level, &tilemapImage, &size);
+        world->currentTileMap = loadTileMap(bakedLevel, &world->levelArena);
+        free(bakedLevel);
+        UnloadImage(tilemapImage);
+    }
+
+    // Reset Array
+    initArenaIntArray(&world->minionIdsInRange, &world->levelArena, 128);
+
+    // Reset Values
+    world->isMinionTargetRecalculationPending = false;
+    world->minionInventoryCount = level->startingMinionCount;
+    world->hasPlacedMinion = false;
+    world->tileVersion++;
+    world->levelLoadCount++;
+
+    // Restarts go back to here
+    saveWorldSnapshot(&levelStartSnapshot);
+}
+
+// Back to how the current level was right after loading, without touching the map file.
+// False if there's no snapshot of it
+bool restartLevel() {
+    if (getWorldSnapshotLevel(&levelStartSnapshot) != world->levelNumber) return false;
+    if (!restoreWorldSnapshot(&levelStartSnapshot)) return false;
+
+    simulationTimeAccumulator = 0;
+    world->levelLoadCount++;
+    return true;
+}
+
+// The render thread resets the camera and particles once it sees the new levelLoadCount
+void enterLevel(int levelNumber) {
+    world->levelNumber = levelNumber;
+    if (!restartLevel()) loadLevel(&levels[levelNumber]);
+}
+
+
+
+
+//------------------------------------------------------------------------------------
+// C Lockstep
+//------------------------------------------------------------------------------------
+
+// Two peers run the same deterministic simulation and only exchange PlayerActions. Ticks are
+// grouped into turns: actions made during turn n are scheduled for turn n + LOCKSTEP_TURN_DELAY
+// and sent to the peer, and a turn only starts once both peers' actions for it are in. Both
+// apply them in player order at the start of the turn. Each scheduled turn also carries the
+// sender's world hash from the end of the turn it was made in, so a desync is caught one
+// delay after it happens. Every packet repeats the turns the peer hasn't acknowledged yet,
+// which covers lost packets without a separate resend protocol.
+
+#define LOCKSTEP_TURN_TICKS 8
+#define LOCKSTEP_TURN_DELAY 2
+#define LOCKSTEP_HISTORY 16 // Turns kept per player, comfortably more than twice the delay
+#define LOCKSTEP_MAX_TURN_ACTIONS 32 // Per player, the rest waits for the next turn
+#define LOCKSTEP_MAX_PACKET_SIZE 1200
+#define LOCKSTEP_RESEND_TIME 0.1
+#define LOCKSTEP_TIMEOUT 5.0
+#define LOCKSTEP_SEED 0x4d494e49
+#define LOCKSTEP_MAGIC 0x4c
+#define LOCKSTEP_RELATIVE_ACTION 0x80 // Position is a byte offset from the previous action's
+
+// Kind, then 2 position bytes relative or 4 absolute, then the value
+#define LOCKSTEP_MAX_ACTION_SIZE 9
+#define LOCKSTEP_MAX_TURN_SIZE (5 + LOCKSTEP_MAX_TURN_ACTIONS * LOCKSTEP_MAX_ACTION_SIZE)
+
+typedef struct LockstepTurn {
+    unsigned int turn; // Which turn the slot holds, once isKnown
+    bool isKnown;
+    unsigned int hash; // Sender's world at the end of turn - LOCKSTEP_TURN_DELAY
+    int actionCount;
+    PlayerAction actions[LOCKSTEP_MAX_TURN_ACTIONS];
+} LockstepTurn;
+
+typedef struct LockstepPacket {
+    unsigned char data[LOCKSTEP_MAX_PACKET_SIZE];
+    int size;
+    int cursor;
+    bool isTruncated;
+} LockstepPacket;
+
+typedef struct Lockstep {
+    volatile bool isActive; // Cleared by the simulation thread if the peer times out
+    int playerIndex; // Player 0 hosts and is the only one changing levels
+    UdpSocket* socket;
+    char remoteHost[64];
+    int remotePort;
+
+    // Simulation thread only
+    unsigned int tick; // Ticks run this session, unlike simulationTick not reset by loads
+    LockstepTurn turns[2][LOCKSTEP_HISTORY]; // By player
+    unsigned int turnHashes[LOCKSTEP_HISTORY]; // Own world at the end of each turn
+    unsigned int nextLocalTurn; // Own turns below this are scheduled
+    unsigned int remoteTurnCount; // Peer's turns below this have all arrived
+    unsigned int remoteAckedTurn; // Peer has all our turns below this
+    PlayerAction* pendingActions; // Made since the last turn ended
+    int pendingCount;
+    int pendingCapacity;
+    double lastSendTime;
+    double lastReceiveTime; // 0 until the peer is first heard from
+    double lastRateTime;
+    int sentBytes; // Since lastRateTime
+
+    // Read by the render thread
+    volatile long desyncTurn; // NULLID while in sync
+    volatile long bytesPerSecond;
+} Lockstep;
+
+Lockstep lockstep;
+
+// Opens the socket, the session starts with the simulation thread
+bool initLockstep(int playerIndex, int localPort, const char* remoteHost, int remotePort) {
+    lockstep.socket = openUdpSocket(localPort);
+    if (lockstep.socket == NULL) return false;
+
+    lockstep.isActive = true;
+    lockstep.playerIndex = playerIndex;
+    snprintf(lockstep.remoteHost, sizeof(lockstep.remoteHost), "%s", remoteHost);
+    lockstep.remotePort = remotePort;
+
+    // The first turns have no input from anyone
+    lockstep.nextLocalTurn = LOCKSTEP_TURN_DELAY;
+    lockstep.remoteTurnCount = LOCKSTEP_TURN_DELAY;
+    lockstep.remoteAckedTurn = LOCKSTEP_TURN_DELAY;
+    lockstep.desyncTurn = NULLID;
+    return true;
+}
+
+void destroyLockstep() {
+    if (lockstep.socket != NULL) closeUdpSocket(lockstep.socket);
+    free(lockstep.pendingActions);
+    lockstep = (Lockstep){ 0 };
+}
+
+// Only the host changes levels, so both peers see the same ENTER_LEVEL_ACTIONs
+bool isLevelHost() {
+    return !lockstep.isActive || lockstep.playerIndex == 0;
+}
+
+unsigned int hashWord(unsigned int hash, unsigned int word) {
+    // FNV-1a, a byte at a time
+    for ITERATE(i, 4) {
+        hash = (hash ^ ((word >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    return hash;
+}
+
+unsigned int hashFloat(unsigned int hash, float value) {
+    unsigned int word;
+    memcpy(&word, &value, sizeof(word));
+    return hashWord(hash, word);
+}
+
+// Slots, generations and positions of everything alive plus the counters, anything that
+// drifts shows up in one of them sooner or later
+unsigned int hashWorld() {
+    unsigned int hash = 2166136261u;
+    for ITERATE(type, TYPE_COUNT) {
+        EntityClass* entityClass = &world->entityClasses[type];
+        hash = hashWord(hash, entityClass->spawnCount);
+
+        for ITERATE(id, entityClass->bankSize) {
+            Entity* entity = getEntity(type, id);
+            if (!entity->isSpawned) continue;
+
+            hash = hashWord(hash, id);
+            hash = hashWord(hash, entity->generation);
+            hash = hashFloat(hash, entity->position.x);
+            hash = hashFloat(hash, entity->position.y);
+            if (type == TOWER_TYPE) hash = hashWord(hash, ((Tower*) entity)->health);
+        }
+    }
+    hash = hashWord(hash, world->simulationTick);
+    hash = hashWord(hash, world->minionInventoryCount);
+    hash = hashWord(hash, world->levelNumber);
+    return hash;
+}
+
+void writePacketBytes(LockstepPacket* packet, unsigned int value, int size) {
+    for ITERATE(i, size) {
+        packet->data[packet->size++] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+// Little endian, 0 and isTruncated set past the end
+unsigned int readPacketBytes(LockstepPacket* packet, int size) {
+    if (packet->cursor + size > packet->size) {
+        packet->isTruncated = true;
+        return 0;
+    }
+
+    unsigned int value = 0;
+    for ITERATE(i, size) {
+        value |= (unsigned int) packet->data[packet->cursor++] << (i * 8);
+    }
+    return value;
+}
+
+int getActionValueSize(int kind) {
+    switch (kind) {
+        case SET_TILE_ACTION: return 4; // Tile types are colors
+        case SPAWN_TOWER_ACTION:
+        case ENTER_LEVEL_ACTION: return 1;
+        default: return 0;
+    }
+}
+
+// Placement strokes move a few pixels per action, so most positions fit in two bytes
+void writeTurn(LockstepPacket* packet, LockstepTurn* input) {
+    writePacketBytes(packet, input->hash, 4);
+    writePacketBytes(packet, input->actionCount, 1);
+
+    int previousX = 0;
+    int previousY = 0;
+    for ITERATE(i, input->actionCount) {
+        PlayerAction* action = &input->actions[i];
+        int x = (int) action->position.x;
+        int y = (int) action->position.y;
+        int dx = x - previousX;
+        int dy = y - previousY;
+
+        if (i > 0 && dx >= -128 && dx < 128 && dy >= -128 && dy < 128) {
+            writePacketBytes(packet, action->kind | LOCKSTEP_RELATIVE_ACTION, 1);
+            writePacketBytes(packet, (unsigned int) dx, 1);
+            writePacketBytes(packet, (unsigned int) dy, 1);
+        } else {
+            writePacketBytes(packet, action->kind, 1);
+            writePacketBytes(packet, (unsigned int) x, 2);
+            writePacketBytes(packet, (unsigned int) y, 2);
+        }
+        writePacketBytes(packet, (unsigned int) action->value, getActionValueSize(action->kind));
+
+        previousX = x;
+        previousY = y;
+    }
+}
+
+// Anything the peer could not have sent, checked before it gets near the simulation
+bool isRemoteActionValid(PlayerAction* action) {
+    switch (action->kind) {
+        case SPAWN_PLAYER_MINION_ACTION:
+        case SPAWN_ENEMY_MINION_ACTION:
+        case SPAWN_TRAP_ACTION:
+            return true;
+        case SPAWN_TOWER_ACTION:
+            return action->value >= 0 && action->value < TOWER_TYPE_COUNT;
+        case SET_TILE_ACTION:
+            // The editor only paints these two
+            return (unsigned int) action->value == GROUND_TILE || (unsigned int) action->value == PLACEABLE_TILE;
+        case ENTER_LEVEL_ACTION:
+            // Only the host changes levels
+            return lockstep.playerIndex != 0 && action->value >= 0 && action->value < LEVEL_COUNT;
+        default:
+            return false;
+    }
+}
+
+// False if the turn holds an action that fails isRemoteActionValid
+bool readTurn(LockstepPacket* packet, LockstepTurn* input) {
+    input->hash = readPacketBytes(packet, 4);
+    input->actionCount = imin(readPacketBytes(packet, 1), LOCKSTEP_MAX_TURN_ACTIONS);
+
+    int x = 0;
+    int y = 0;
+    for ITERATE(i, input->actionCount) {
+        PlayerAction* action = &input->actions[i];
+        int kind = readPacketBytes(packet, 1);
+        if (kind & LOCKSTEP_RELATIVE_ACTION) {
+            x += (signed char) readPacketBytes(packet, 1);
+            y += (signed char) readPacketBytes(packet, 1);
+        } else {
+            x = (short) readPacketBytes(packet, 2);
+            y = (short) readPacketBytes(packet, 2);
+        }
+
+        action->kind = kind & ~LOCKSTEP_RELATIVE_ACTION;
+        action->position = (Vector2){ x, y };
+        action->value = (int) readPacketBytes(packet, getActionValueSize(action->kind));
+        if (!isRemoteActionValid(action)) return false;
+    }
+    return true;
+}
+
+// Our ack, then every scheduled turn the peer hasn't acknowledged that fits
+void sendLockstepTurns() {
+    LockstepPacket packet;
+    packet.size = 0;
+
+    unsigned int firstTurn = lockstep.remoteAckedTurn;
+    int turnCount = imin(lockstep.nextLocalTurn - firstTurn, LOCKSTEP_HISTORY);
+    int maxTurnCount = (LOCKSTEP_MAX_PACKET_SIZE - 10) / LOCKSTEP_MAX_TURN_SIZE;
+    turnCount = imin(turnCount, maxTurnCount);
+
+    writePacketBytes(&packet, LOCKSTEP_MAGIC, 1);
+    writePacketBytes(&packet, lockstep.remoteTurnCount, 4);
+    writePacketBytes(&packet, firstTurn, 4);
+    writePacketBytes(&packet, turnCount, 1);
+    for ITERATE(i, turnCount) {
+        writeTurn(&packet, &lockstep.turns[lockstep.playerIndex][(firstTurn + i) % LOCKSTEP_HISTORY]);
+    }
+
+    sendUdp(lockstep.socket, lockstep.remoteHost, lockstep.remotePort, packet.data, packet.size);
+    lockstep.sentBytes += packet.size;
+    lockstep.lastSendTime = GetTime();
+}
+
+// Compares the peer's hash carried by its scheduled turn with ours, once both exist
+void checkLockstepHash(unsigned int turn) {
+    LockstepTurn* input = &lockstep.turns[1 - lockstep.playerIndex][turn % LOCKSTEP_HISTORY];
+    if (turn < LOCKSTEP_TURN_DELAY || !input->isKnown || input->turn != turn) return;
+
+    unsigned int hashedTurn = turn - LOCKSTEP_TURN_DELAY;
+    if (hashedTurn >= lockstep.tick / LOCKSTEP_TURN_TICKS) return;
+
+    if (input->hash != lockstep.turnHashes[hashedTurn % LOCKSTEP_HISTORY] && lockstep.desyncTurn == NULLID) {
+        lockstep.desyncTurn = hashedTurn;
+        TraceLog(LOG_ERROR, "Lockstep desync at the end of turn %u", hashedTurn);
+    }
+}
+
+void receiveLockstepPacket(LockstepPacket* packet) {
+    packet->cursor = 0;
+    packet->isTruncated = false;
+    if (readPacketBytes(packet, 1) != LOCKSTEP_MAGIC) return;
+
+    unsigned int ackedTurn = readPacketBytes(packet, 4);
+    unsigned int firstTurn = readPacketBytes(packet, 4);
+    int turnCount = readPacketBytes(packet, 1);
+    if (packet->isTruncated) return;
+
+    // Checked whole before anything is kept. A peer that only sends bad packets times out
+    LockstepTurn inputs[LOCKSTEP_HISTORY];
+    if (turnCount > LOCKSTEP_HISTORY) return;
+    for ITERATE(i, turnCount) {
+        bool isValid = readTurn(packet, &inputs[i]);
+        if (packet->isTruncated) return;
+        if (!isValid) {
+            TraceLog(LOG_WARNING, "Lockstep dropped a packet with an invalid action in turn %u", firstTurn + i);
+            return;
+        }
+    }
+
+    lockstep.lastReceiveTime = GetTime();
+    if (ackedTurn > lockstep.remoteAckedTurn && ackedTurn <= lockstep.nextLocalTurn) lockstep.remoteAckedTurn = ackedTurn;
+
+    unsigned int currentTurn = lockstep.tick / LOCKSTEP_TURN_TICKS;
+    for ITERATE(i, turnCount) {
+        LockstepTurn input = inputs[i];
+
+        // Already have it, or so far ahead its slot is still in use
+        unsigned int turn = firstTurn + i;
+        if (turn < lockstep.remoteTurnCount || turn >= currentTurn + LOCKSTEP_HISTORY) continue;
+
+        LockstepTurn* slot = &lockstep.turns[1 - lockstep.playerIndex][turn % LOCKSTEP_HISTORY];
+        *slot = input;
+        slot->turn = turn;
+        slot->isKnown = true;
+        checkLockstepHash(turn);
+    }
+
+    while (true) {
+        LockstepTurn* slot = &lockstep.turns[1 - lockstep.playerIndex][lockstep.remoteTurnCount % LOCKSTEP_HISTORY];
+        if (!slot->isKnown || slot->turn != lockstep.remoteTurnCount) break;
+        lockstep.remoteTurnCount++;
+    }
+}
+
+// Simulation thread, instead of applying the action right away. Positions are rounded here
+// so this peer applies exactly what the other one decodes
+void scheduleLockstepAction(PlayerAction* action) {
+    if (lockstep.pendingCount == lockstep.pendingCapacity) {
+        lockstep.pendingCapacity = imax(16, lockstep.pendingCapacity * 2);
+        lockstep.pendingActions = reallocate(NETWORK_MEMORY, lockstep.pendingActions, sizeof(PlayerAction) * lockstep.pendingCapacity);
+    }
+
+    PlayerAction* pending = &lockstep.pendingActions[lockstep.pendingCount++];
+    *pending = *action;
+    pending->position.x = Clamp(roundf(action->position.x), SHRT_MIN, SHRT_MAX);
+    pending->position.y = Clamp(roundf(action->position.y), SHRT_MIN, SHRT_MAX);
+}
+
+// Simulation thread, between ticks
+void pollLockstep() {
+    LockstepPacket packet;
+    while ((packet.size = receiveUdp(lockstep.socket, lockstep.remoteHost, lockstep.remotePort, packet.data, LOCKSTEP_MAX_PACKET_SIZE)) > 0) {
+        receiveLockstepPacket(&packet);
+    }
+
+    double time = GetTime();
+    if (time - lockstep.lastSendTime >= LOCKSTEP_RESEND_TIME) sendLockstepTurns();
+
+    if (time - lockstep.lastRateTime >= 1.0) {
+        lockstep.bytesPerSecond = lockstep.sentBytes / (time - lockstep.lastRateTime);
+        lockstep.sentBytes = 0;
+        lockstep.lastRateTime = time;
+    }
+
+    // A peer that was never heard from may still be in the menu
+    if (lockstep.lastReceiveTime > 0 && time - lockstep.lastReceiveTime > LOCKSTEP_TIMEOUT) {
+        TraceLog(LOG_WARNING, "Lockstep peer timed out, playing on alone");
+        for ITERATE(i, lockstep.pendingCount) {
+            applyPlayerAction(&lockstep.pendingActions[i]);
+        }
+        lockstep.pendingCount = 0;
+        lockstep.isActive = false;
+    }
+}
+
+// False while the peer's actions for the turn starting at this tick are missing
+bool beginLockstepTick() {
+    if (lockstep.tick % LOCKSTEP_TURN_TICKS != 0) return true;
+
+    unsigned int turn = lockstep.tick / LOCKSTEP_TURN_TICKS;
+    if (turn < LOCKSTEP_TURN_DELAY) return true;
+    if (turn >= lockstep.remoteTurnCount) return false;
+
+    for ITERATE(player, 2) {
+        LockstepTurn* input = &lockstep.turns[player][turn % LOCKSTEP_HISTORY];
+        for ITERATE(i, input->actionCount) {
+            applyPlayerAction(&input->actions[i]);
+        }
+    }
+    return true;
+}
+
+// Closes the turn on its last tick: hashes the world and schedules what was made during it
+void endLockstepTick() {
+    lockstep.tick++;
+    if (lockstep.tick % LOCKSTEP_TURN_TICKS != 0) return;
+
+    unsigned int turn = lockstep.tick / LOCKSTEP_TURN_TICKS - 1;
+    unsigned int hash = hashWorld();
+    lockstep.turnHashes[turn % LOCKSTEP_HISTORY] = hash;
+    checkLockstepHash(turn + LOCKSTEP_TURN_DELAY);
+
+    LockstepTurn* input = &lockstep.turns[lockstep.playerIndex][lockstep.nextLocalTurn % LOCKSTEP_HISTORY];
+    input->turn = lockstep.nextLocalTurn;
+    input->isKnown = true;
+    input->hash = hash;
+    input->actionCount = imin(lockstep.pendingCount, LOCKSTEP_MAX_TURN_ACTIONS);
+    memcpy(input->actions, lockstep.pendingActions, sizeof(PlayerAction) * input->actionCount);
+    lockstep.pendingCount -= input->actionCount;
+    memmove(lockstep.pendingActions, lockstep.pendingActions + input->actionCount, sizeof(PlayerAction) * lockstep.pendingCount);
+    lockstep.nextLocalTurn++;
+
+    sendLockstepTurns();
+}
+
+
+
+
+//------------------------------------------------------------------------------------
+// C Recording
+//------------------------------------------------------------------------------------
+
+// With --record <file> every simulated tick is written to disk for offline analysis. The
+// simulation thread only quantises the banks into a queued frame, one fixed-size record per
+// slot. A writer thread diffs each frame against the one before and writes the changed
+// fields of the changed slots as zigzag varints. Every RECORDING_KEYFRAME_INTERVAL frames,
+// and on every level load, a keyframe is diffed against an empty frame instead, so a
+// reader can start decoding there. Each frame starts with its size, so seeking is a walk
+// over frame headers to the last keyframe before the wanted frame.
+//
+// File: magic, version, type count, bank sizes, position scale, then the frames
+// Frame: u32 size, u8 isKeyframe, varint frame number, simulation tick, level, load count,
+//        then per changed slot: varint slot gap, u8 field mask, the masked field deltas,
+//        ending with a 0 gap
+
+#define RECORDING_MAGIC 0x524d4d54
+#define RECORDING_VERSION 1
+#define RECORDING_KEYFRAME_INTERVAL SIMULATION_TICK_RATE
+#define RECORDING_QUEUE_SIZE 8
+#define RECORDING_POSITION_SCALE 8 // Eighths of a pixel
+
+#define RECORDED_SPAWNED 0
+#define RECORDED_X 1
+#define RECORDED_Y 2
+#define RECORDED_HEIGHT 3
+#define RECORDED_TARGET 4 // Minion or projectile target, tower health
+#define RECORDED_KIND 5 // Player minion, tower or projectile type
+#define RECORDED_FIELD_COUNT 6
+
+// Unspawned slots are all zeros
+typedef struct RecordedEntity {
+    int fields[RECORDED_FIELD_COUNT];
+} RecordedEntity;
+
+typedef struct RecordedFrame {
+    unsigned int frameNumber;
+    unsigned int simulationTick;
+    int levelNumber;
+    int levelLoadCount;
+    RecordedEntity* entities; // Every bank slot, type after type
+} RecordedFrame;
+
+typedef struct ByteBuffer {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+typedef struct Recorder {
+    FILE* file;
+    Thread* thread;
+    Mutex* mutex;
+    Condition* frameQueued;
+    Condition* frameWritten;
+    int slotCount; // Per frame
+    unsigned int frameNumber; // Simulation thread only
+
+    // Under the lock
+    RecordedFrame queue[RECORDING_QUEUE_SIZE];
+    int queueStart;
+    int queueCount;
+    bool isShuttingDown;
+    int stallCount; // Times the simulation waited for the writer
+} Recorder;
+
+Recorder recorder;
+
+void writeBufferByte(ByteBuffer* buffer, unsigned char value) {
+    if (buffer->size == buffer->capacity) {
+        buffer->capacity = imax(1024, buffer->capacity * 2);
+        buffer->data = reallocate(RECORDING_MEMORY, buffer->data, buffer->capacity);
+    }
+    buffer->data[buffer->size++] = value;
+}
+
+void writeBufferInt(ByteBuffer* buffer, unsigned int value) {
+    for ITERATE(i, 4) {
+        writeBufferByte(buffer, (value >> (i * 8)) & 0xff);
+    }
+}
+
+void writeVarint(ByteBuffer* buffer, unsigned int value) {
+    while (value >= 0x80) {
+        writeBufferByte(buffer, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    writeBufferByte(buffer, value);
+}
+
+// Small negative deltas stay small
+unsigned int zigzag(int value) {
+    return ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+}
+
+int unzigzag(unsigned int value) {
+    return (int) (value >> 1) ^ -(int) (value & 1);
+}
+
+// Bound to end, reads past it return 0
+unsigned int readVarint(const unsigned char** cursor, const unsigned char* end) {
+    unsigned int value = 0;
+    for (int shift = 0; *cursor < end && shift < 32; shift += 7) {
+        unsigned char byte = *(*cursor)++;
+        value |= (unsigned int) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+unsigned int readInt(const unsigned char** cursor, const unsigned char* end) {
+    unsigned int value = 0;
+    for (int i = 0; i < 4 && *cursor < end; i++) {
+        value |= (unsigned int) *(*cursor)++ << (i * 8);
+    }
+    return value;
+}
+
+int quantise(float value) {
+    return (int) roundf(value * RECORDING_POSITION_SCALE);
+}
+
+// Reads the bound world without evaluating it, lazily moved entities are worked out here
+void captureEntity(int type, int id, RecordedEntity* recorded) {
+    Entity* entity = getEntity(type, id);
+    *recorded = (RecordedEntity){ 0 };
+    if (!entity->isSpawned) return;
+
+    Vector2 position = entity->position;
+    float height = entity->height;
+    int target = 0;
+    int kind = 0;
+    switch (type) {
+        case MINION_TYPE: {
+            Minion* minion = (Minion*) entity;
+            position = getMinionPosition(minion);
+            target = minion->targetId;
+            kind = minion->isPlayer;
+            break;
+        }
+        case TOWER_TYPE: {
+            Tower* tower = (Tower*) entity;
+            target = tower->health;
+            kind = tower->type;
+            break;
+        }
+        case PROJECTILE_TYPE: {
+            Projectile* projectile = (Projectile*) entity;
+            float alivePercentage = Clamp(getLifeTime(entity) / projectile->totalAliveTime, 0, 1);
+            position = Vector2Lerp(projectile->startPosition, projectile->targetPosition, alivePercentage);
+            height = calculateProjectileHeight(alivePercentage);
+            target = projectile->targetMinionId;
+            kind = projectile->type;
+            break;
+        }
+    }
+
+    recorded->fields[RECORDED_SPAWNED] = 1;
+    recorded->fields[RECORDED_X] = quantise(position.x);
+    recorded->fields[RECORDED_Y] = quantise(position.y);
+    recorded->fields[RECORDED_HEIGHT] = quantise(height);
+    recorded->fields[RECORDED_TARGET] = target;
+    recorded->fields[RECORDED_KIND] = kind;
+}
+
+void encodeFrame(ByteBuffer* buffer, RecordedFrame* frame, RecordedEntity* previous, bool isKeyframe) {
+    size_t sizeOffset = buffer->size;
+    writeBufferInt(buffer, 0);
+    writeBufferByte(buffer, isKeyframe);
+    writeVarint(buffer, frame->frameNumber);
+    writeVarint(buffer, frame->simulationTick);
+    writeVarint(buffer, zigzag(frame->levelNumber));
+    writeVarint(buffer, frame->levelLoadCount);
+
+    if (isKeyframe) memset(previous, 0, sizeof(RecordedEntity) * recorder.slotCount);
+
+    int previousSlot = -1;
+    for ITERATE(slot, recorder.slotCount) {
+        int* fields = frame->entities[slot].fields;
+        int* previousFields = previous[slot].fields;
+
+        unsigned char mask = 0;
+        for ITERATE(field, RECORDED_FIELD_COUNT) {
+            if (fields[field] != previousFields[field]) mask |= 1 << field;
+        }
+        if (mask == 0) continue;
+
+        writeVarint(buffer, slot - previousSlot);
+        writeBufferByte(buffer, mask);
+        for ITERATE(field, RECORDED_FIELD_COUNT) {
+            if (mask & (1 << field)) writeVarint(buffer, zigzag(fields[field] - previousFields[field]));
+        }
+        previousSlot = slot;
+    }
+    writeVarint(buffer, 0);
+
+    unsigned int frameSize = buffer->size - sizeOffset - 4;
+    for ITERATE(i, 4) {
+        buffer->data[sizeOffset + i] = (frameSize >> (i * 8)) & 0xff;
+    }
+}
+
+void recordingWriterLoop(void* argument) {
+    RecordedEntity* previous = allocateZeroed(RECORDING_MEMORY, recorder.slotCount, sizeof(RecordedEntity));
+    ByteBuffer buffer = { 0 };
+    int lastLevelLoadCount = NULLID;
+
+    lockMutex(recorder.mutex);
+    while (true) {
+        while (recorder.queueCount == 0 && !recorder.isShuttingDown) {
+            waitCondition(recorder.frameQueued, recorder.mutex);
+        }
+        if (recorder.queueCount == 0) break;
+
+        // The slot stays queued while it's encoded, so the simulation won't refill it
+        RecordedFrame* frame = &recorder.queue[recorder.queueStart];
+        unlockMutex(recorder.mutex);
+
+        bool isKeyframe = frame->frameNumber % RECORDING_KEYFRAME_INTERVAL == 0 || frame->levelLoadCount != lastLevelLoadCount;
+        lastLevelLoadCount = frame->levelLoadCount;
+        buffer.size = 0;
+        encodeFrame(&buffer, frame, previous, isKeyframe);
+        memcpy(previous, frame->entities, sizeof(RecordedEntity) * recorder.slotCount);
+        fwrite(buffer.data, 1, buffer.size, recorder.file);
+
+        lockMutex(recorder.mutex);
+        recorder.queueStart = (recorder.queueStart + 1) % RECORDING_QUEUE_SIZE;
+        recorder.queueCount--;
+        signalCondition(recorder.frameWritten);
+    }
+    unlockMutex(recorder.mutex);
+
+    free(previous);
+    free(buffer.data);
+}
+
+// Writes the header and starts the writer, false if the file can't be created
+bool startRecording(const char* path) {
+    recorder.file = fopen(path, "wb");
+    if (recorder.file == NULL) return false;
+
+    ByteBuffer header = { 0 };
+    writeBufferInt(&header, RECORDING_MAGIC);
+    writeBufferInt(&header, RECORDING_VERSION);
+    writeBufferInt(&header, TYPE_COUNT);
+    for ITERATE(type, TYPE_COUNT) {
+        writeBufferInt(&header, world->entityClasses[type].bankSize);
+        recorder.slotCount += world->entityClasses[type].bankSize;
+    }
+    writeBufferInt(&header, RECORDING_POSITION_SCALE);
+    fwrite(header.data, 1, header.size, recorder.file);
+    free(header.data);
+
+    for ITERATE(i, RECORDING_QUEUE_SIZE) {
+        recorder.queue[i].entities = allocate(RECORDING_MEMORY, sizeof(RecordedEntity) * recorder.slotCount);
+    }
+    recorder.mutex = createMutex();
+    recorder.frameQueued = createCondition();
+    recorder.frameWritten = createCondition();
+    recorder.thread = createThread(recordingWriterLoop, NULL);
+    return true;
+}
+
+// Writes out what's still queued
+void stopRecording() {
+    if (recorder.file == NULL) return;
+
+    lockMutex(recorder.mutex);
+    recorder.isShuttingDown = true;
+    signalCondition(recorder.frameQueued);
+    unlockMutex(recorder.mutex);
+    joinThread(recorder.thread);
 
-            if (color.r == 0 && color.g == 0) {
-                // SPAWN SUMMONER TOWER
-                spawnTower(SUMMONER_TOWER_TYPE, position, color.b * 10);
-                tileData->type = GROUND_TILE;
-            }
+    if (recorder.stallCount > 0) TraceLog(LOG_WARNING, "Recording stalled the simulation %d times", recorder.stallCount);
+    fclose(recorder.file);
+    for ITERATE(i, RECORDING_QUEUE_SIZE) {
+        free(recorder.queue[i].entities);
+    }
+    destroyCondition(recorder.frameQueued);
+    destroyCondition(recorder.frameWritten);
+    destroyMutex(recorder.mutex);
+    recorder = (Recorder){ 0 };
+}
 
-            if (color.g == 0xEE && color.b == 0xEE) {
-                // SPAWN ENEMY MINIONS
-                for ITERATE(i, color.r) {
-                    spawnMinionAt((Vector2) { randRange(x, x + 1)* TILE_SIZE, randRange(y, y + 1)* TILE_SIZE }, false);
-                }
-                tileData->type = GROUND_TILE;
-            }
+// Simulation thread, after each tick
+void recordFrame() {
+    lockMutex(recorder.mutex);
+    if (recorder.queueCount == RECORDING_QUEUE_SIZE) recorder.stallCount++;
+    while (recorder.queueCount == RECORDING_QUEUE_SIZE) {
+        waitCondition(recorder.frameWritten, recorder.mutex);
+    }
+    RecordedFrame* frame = &recorder.queue[(recorder.queueStart + recorder.queueCount) % RECORDING_QUEUE_SIZE];
+    unlockMutex(recorder.mutex);
 
-            if (tileData->type == TRAP_TILE) {
-                // SPAWN TRAP
-                int id = createEntity(TRAP_TYPE);
-                getEntity(TRAP_TYPE, id)->position = position;
-                tileData->type = GROUND_TILE;
-            }
+    frame->frameNumber = recorder.frameNumber++;
+    frame->simulationTick = world->simulationTick;
+    frame->levelNumber = world->levelNumber;
+    frame->levelLoadCount = world->levelLoadCount;
 
-            
+    RecordedEntity* recorded = frame->entities;
+    for ITERATE(type, TYPE_COUNT) {
+        for ITERATE(id, world->entityClasses[type].bankSize) {
+            captureEntity(type, id, recorded++);
         }
     }
 
-    return tileMap;
+    lockMutex(recorder.mutex);
+    recorder.queueCount++;
+    signalCondition(recorder.frameQueued);
+    unlockMutex(recorder.mutex);
 }
 
-TileData* getTile(TileMap* tileMap, int x, int y) {
-    if (x < 0 || y < 0 || x >= tileMap->width || y >= tileMap->height)
-        return NULL;
-    return & tileMap->tiles[x + y * tileMap->width];
-}
+// Offline tool, prints every entity alive in frameNumber. Keyframes reset the state, so
+// decoding starts at the last one before it
+int readRecording(const char* path, unsigned int frameNumber) {
+    MappedFile file;
+    if (!mapFile(path, &file)) {
+        printf("Couldn't open %s\n", path);
+        return 1;
+    }
 
-void updateTileMap(TileMap* tileMap) {
-    for ITERATE(x, tileMap->width) {
-        for ITERATE(y, tileMap->height) {
-            TileData* tile = getTile(tileMap, x, y);
-            tile->minionIds.used = 0;
+    const unsigned char* cursor = file.data;
+    const unsigned char* end = file.data + file.size;
+    unsigned int magic = readInt(&cursor, end);
+    unsigned int version = readInt(&cursor, end);
+    unsigned int typeCount = readInt(&cursor, end);
+    if (magic != RECORDING_MAGIC || version != RECORDING_VERSION || typeCount != TYPE_COUNT) {
+        printf("%s isn't a version %d recording\n", path, RECORDING_VERSION);
+        unmapFile(&file);
+        return 1;
+    }
+
+    int bankSizes[TYPE_COUNT];
+    int slotCount = 0;
+    for ITERATE(type, TYPE_COUNT) {
+        bankSizes[type] = readInt(&cursor, end);
+        slotCount += bankSizes[type];
+    }
+    float positionScale = readInt(&cursor, end);
+
+    // Last keyframe at or before the wanted frame, frames are in order
+    const unsigned char* keyframe = NULL;
+    const unsigned char* frameStart = cursor;
+    while (end - frameStart >= 6) {
+        const unsigned char* header = frameStart;
+        unsigned int frameSize = readInt(&header, end);
+        bool isKeyframe = *header++;
+        unsigned int number = readVarint(&header, end);
+        if (number > frameNumber || frameSize > (size_t) (end - frameStart - 4)) break;
+        if (isKeyframe) keyframe = frameStart;
+        frameStart += 4 + frameSize;
+    }
+    if (keyframe == NULL) {
+        printf("No keyframe before frame %u\n", frameNumber);
+        unmapFile(&file);
+        return 1;
+    }
+
+    RecordedEntity* state = allocateZeroed(RECORDING_MEMORY, slotCount, sizeof(RecordedEntity));
+    unsigned int number = 0;
+    unsigned int simulationTick = 0;
+    int levelNumber = 0;
+    cursor = keyframe;
+    while (cursor < frameStart) {
+        unsigned int frameSize = readInt(&cursor, end);
+        const unsigned char* frameEnd = cursor + frameSize;
+        if (*cursor++) memset(state, 0, sizeof(RecordedEntity) * slotCount);
+        number = readVarint(&cursor, frameEnd);
+        simulationTick = readVarint(&cursor, frameEnd);
+        levelNumber = unzigzag(readVarint(&cursor, frameEnd));
+        readVarint(&cursor, frameEnd);
+
+        int slot = -1;
+        while (true) {
+            unsigned int gap = readVarint(&cursor, frameEnd);
+            if (gap == 0 || cursor >= frameEnd) break;
+            slot += gap;
+            unsigned char mask = *cursor++;
+            for ITERATE(field, RECORDED_FIELD_COUNT) {
+                if (!(mask & (1 << field))) continue;
+                int delta = unzigzag(readVarint(&cursor, frameEnd));
+                if (slot < slotCount) state[slot].fields[field] += delta;
+            }
         }
+        cursor = frameEnd;
     }
 
-    for ITERATE(id, entityClasses[MINION_TYPE].bankSize) {
-        Entity* entity = getEntity(MINION_TYPE, id);
-        if (!entity->isSpawned) continue;
-        TileData* tile = getTileAt(tileMap, entity->position);
-        if (tile == NULL) continue;
-        insertIntArray(& (tile->minionIds), id);
+    printf("frame %u tick %u level %d\n", number, simulationTick, levelNumber);
+    printf("type,id,x,y,height,target,kind\n");
+    RecordedEntity* recorded = state;
+    for ITERATE(type, TYPE_COUNT) {
+        for ITERATE(id, bankSizes[type]) {
+            int* fields = recorded++->fields;
+            if (!fields[RECORDED_SPAWNED]) continue;
+            printf("%d,%d,%.3f,%.3f,%.3f,%d,%d\n", type, id, fields[RECORDED_X] / positionScale, fields[RECORDED_Y] / positionScale,
+                fields[RECORDED_HEIGHT] / positionScale, fields[RECORDED_TARGET], fields[RECORDED_KIND]);
+        }
     }
-}
 
-void drawTileMap(TileMap* tileMap) {
+    free(state);
+    unmapFile(&file);
+    return number == frameNumber ? 0 : 1;
+}
 
-    static int borderAmount = 10;
 
-    DrawRectangle(-borderAmount, -borderAmount, tileMap->width * TILE_SIZE + borderAmount * 2, tileMap->height * TILE_SIZE + borderAmount * 2, BLACK);
 
-    for ITERATE(x, tileMap->width) {
-        for ITERATE(y, tileMap->height) {
-            TileData* tile = getTile(tileMap, x, y);
-            bool isDark = ((x / 3) % 2) ^ ((y / 3) % 2);
-            Rectangle tileBounds = { 
-                x * TILE_SIZE, y * TILE_SIZE,
-                TILE_SIZE, TILE_SIZE,
-            };
 
-            switch(tile->type) {
-                case GROUND_TILE:
-                    DrawRectangleRec(tileBounds, GetColor(isDark ? GROUND_COLOR_2 : GROUND_COLOR));
-                    break;
-                case PLACEABLE_TILE:
-                    DrawRectangleRec(tileBounds, GetColor(isDark ? PLACEABLE_COLOR_2 : PLACEABLE_COLOR));
-                    break;
-            }
+//------------------------------------------------------------------------------------
+// C SimulationThread
+//------------------------------------------------------------------------------------
 
-            if (DEBUG_MODE) {
-                char str[16];
-                sprintf(str, "%d/%d", tile->minionIds.used, tile->minionIds.size);
-                DrawText(str, tileBounds.x, tileBounds.y, 10, BLACK);
-            }
+// Once the game starts, mainWorld belongs to the simulation thread, which ticks at its own
+// fixed rate. After each batch of ticks it copies what drawing needs (entity banks, tile
+// types, the counters) into a render world. The render worlds are triple buffered: the
+// simulation always has one to write, the render thread always has a complete one to draw,
+// and they only meet to swap indices. The render thread binds the newest render world and
+// runs the usual draw code on it. Input goes the other way as PlayerActions, applied by the
+// simulation thread before its next tick.
+
+#define RENDER_BUFFER_COUNT 3
+
+typedef struct SimulationThread {
+    Thread* thread;
+    Mutex* mutex;
+    unsigned int randomSeed;
+
+    // Under the lock
+    bool isShuttingDown;
+    PlayerAction* actions;
+    int actionCount;
+    int actionCapacity;
+    EffectQueue effects; // Published, not taken by the render thread yet
+    int readyIndex; // Newest published render world
+    bool isReadyNew;
+
+    World renderWorlds[RENDER_BUFFER_COUNT];
+    int writeIndex; // Simulation thread only
+    int readIndex; // Render thread only
+} SimulationThread;
+
+SimulationThread simulationThread;
+
+// Render thread side
+EffectQueue renderEffects;
+int expectedLevelLoadCount; // Including ENTER_LEVEL_ACTIONs not simulated yet
+int shownLevelLoadCount;
+int shownInventoryCount;
+
+void initSimulationThread() {
+    simulationThread.mutex = createMutex();
+    simulationThread.writeIndex = 0;
+    simulationThread.readyIndex = 1;
+    simulationThread.readIndex = 2;
+
+    World* boundWorld = world;
+    for ITERATE(i, RENDER_BUFFER_COUNT) {
+        world = &simulationThread.renderWorlds[i];
+        for ITERATE(type, TYPE_COUNT) {
+            initClass(type);
         }
     }
+    world = boundWorld;
 }
 
-void destroyTileMap(TileMap* tileMap) {
-    for ITERATE(x, tileMap->width) {
-        for ITERATE(y, tileMap->height) {
-            freeIntArray(&getTile(tileMap, x, y)->minionIds);
+// Only tile types, a render world's map has no minion grid or flow fields
+void copyRenderTiles(World* target, World* source) {
+    TileMap* from = &source->currentTileMap;
+    TileMap* to = &target->currentTileMap;
+    if (to->width != from->width || to->height != from->height) {
+        resetArena(&target->levelArena);
+        *to = createTileMap(from->width, from->height, &target->levelArena);
+    }
+
+    for ITERATE(i, from->chunkColumns * from->chunkRows) {
+        if (from->chunks[i] == NULL && to->chunks[i] == NULL) continue;
+
+        TileChunk* chunk = getOrCreateChunk(to, i);
+        for ITERATE(tile, TILE_CHUNK_AREA) {
+            chunk->tiles[tile].type = from->chunks[i] != NULL ? from->chunks[i]->tiles[tile].type : GROUND_TILE;
         }
     }
+}
+
+void copyRenderWorld(World* target, World* source) {
+    for ITERATE(type, TYPE_COUNT) {
+        EntityClass* from = &source->entityClasses[type];
+        EntityClass* to = &target->entityClasses[type];
+        memcpy(to->bank, from->bank, from->bankSize * from->structSize);
+        to->lastSpawnedId = from->lastSpawnedId;
+        to->spawnCount = from->spawnCount;
+    }
+
+    target->simulationTick = source->simulationTick;
+    target->minionInventoryCount = source->minionInventoryCount;
+    target->enemyMinionCount = source->enemyMinionCount;
+    target->hasPlacedMinion = source->hasPlacedMinion;
+    target->levelNumber = source->levelNumber;
+    target->levelLoadCount = source->levelLoadCount;
 
-    free(tileMap->tiles);
+    if (target->tileVersion != source->tileVersion) {
+        copyRenderTiles(target, source);
+        target->tileVersion = source->tileVersion;
+    }
 }
 
-TileData* getTileAt(TileMap* tileMap, Vector2 position) {
-    if (position.x >= 0 && position.y >= 0)
-        return getTile(tileMap, position.x / TILE_SIZE, position.y / TILE_SIZE);
-    return NULL;
+// From the bound world, between ticks
+void publishRenderWorld() {
+    copyRenderWorld(&simulationThread.renderWorlds[simulationThread.writeIndex], world);
+
+    lockMutex(simulationThread.mutex);
+    int publishedIndex = simulationThread.writeIndex;
+    simulationThread.writeIndex = simulationThread.readyIndex;
+    simulationThread.readyIndex = publishedIndex;
+    simulationThread.isReadyNew = true;
+    appendEffectQueue(&simulationThread.effects, &simulationEffects);
+    unlockMutex(simulationThread.mutex);
 }
 
+// Binds the newest render world and moves the effects published with it into effects
+void acquireRenderWorld(EffectQueue* effects) {
+    lockMutex(simulationThread.mutex);
+    if (simulationThread.isReadyNew) {
+        int readIndex = simulationThread.readIndex;
+        simulationThread.readIndex = simulationThread.readyIndex;
+        simulationThread.readyIndex = readIndex;
+        simulationThread.isReadyNew = false;
+    }
+    appendEffectQueue(effects, &simulationThread.effects);
+    unlockMutex(simulationThread.mutex);
 
+    world = &simulationThread.renderWorlds[simulationThread.readIndex];
+}
 
-//------------------------------------------------------------------------------------
-// C LoadLevel
-//------------------------------------------------------------------------------------
+void queuePlayerAction(int kind, Vector2 position, int value) {
+    lockMutex(simulationThread.mutex);
+    if (simulationThread.actionCount == simulationThread.actionCapacity) {
+        simulationThread.actionCapacity = imax(16, simulationThread.actionCapacity * 2);
+        simulationThread.actions = reallocate(INPUT_MEMORY, simulationThread.actions, sizeof(PlayerAction) * simulationThread.actionCapacity);
+    }
+    simulationThread.actions[simulationThread.actionCount++] = (PlayerAction){ kind, position, value };
+    unlockMutex(simulationThread.mutex);
+}
 
+void applyPlayerAction(PlayerAction* action) {
+    switch (action->kind) {
+        case SPAWN_PLAYER_MINION_ACTION:
+            if (world->minionInventoryCount <= 0) break;
+            if (spawnMinionAt(action->position, true) != NULLID) {
+                playSoundInstance(MINION_WALK_SOUND, 1.0, randRange(0.9, 1.1));
+                shakeCamera(1.0, 0.1);
+                world->minionInventoryCount--;
+                world->hasPlacedMinion = true;
+            }
+            break;
+        case SPAWN_ENEMY_MINION_ACTION:
+            if (spawnMinionAt(action->position, false) != NULLID) {
+                playSoundInstance(MINION_WALK_SOUND, 1.0, randRange(0.9, 1.1));
+                shakeCamera(1.0, 0.1);
+            }
+            break;
+        case SPAWN_TOWER_ACTION:
+            if (spawnTower(action->value, action->position, 50) != NULLID)
+                playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
+            break;
+        case SPAWN_TRAP_ACTION: {
+            int id = createEntity(TRAP_TYPE);
+            if (id != NULLID) {
+                getEntity(TRAP_TYPE, id)->position = action->position;
+                playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
+            }
+            break;
+        }
+        case SET_TILE_ACTION: {
+            TileData* tile = getTileAt(&world->currentTileMap, action->position);
+            if (tile == NULL || tile->type == action->value) break;
+            setTileType(&world->currentTileMap, action->position, action->value);
+            world->tileVersion++;
+            playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
+            break;
+        }
+        case ENTER_LEVEL_ACTION:
+            enterLevel(action->value);
+            break;
+        case PREVIEW_ACTION:
+            requestPreview(action->position, action->value);
+            break;
+    }
+}
 
+void simulationLoop(void* argument) {
+    isSimulationThread = true;
+    threadRandomState = simulationThread.randomSeed;
 
+    // Swapped with the queue so the render thread can add actions while these are applied
+    PlayerAction* actions = NULL;
+    int actionCapacity = 0;
 
+    double lastTime = GetTime();
+    while (true) {
+        lockMutex(simulationThread.mutex);
+        if (simulationThread.isShuttingDown) {
+            unlockMutex(simulationThread.mutex);
+            break;
+        }
+        PlayerAction* queuedActions = simulationThread.actions;
+        int queuedCapacity = simulationThread.actionCapacity;
+        int actionCount = simulationThread.actionCount;
+        simulationThread.actions = actions;
+        simulationThread.actionCapacity = actionCapacity;
+        simulationThread.actionCount = 0;
+        actions = queuedActions;
+        actionCapacity = queuedCapacity;
+        unlockMutex(simulationThread.mutex);
+
+        // Previews only read the world, they stay local
+        for ITERATE(i, actionCount) {
+            if (lockstep.isActive && actions[i].kind != PREVIEW_ACTION) scheduleLockstepAction(&actions[i]);
+            else applyPlayerAction(&actions[i]);
+        }
+        if (lockstep.isActive) pollLockstep();
+
+        // Fixed steps, carrying the remainder over to the next wake up
+        double time = GetTime();
+        simulationTimeAccumulator += time - lastTime;
+        lastTime = time;
+        int tickCount = 0;
+        while (simulationTimeAccumulator >= TICK_DELTA && tickCount < MAX_TICKS_PER_FRAME) {
+            // Waiting on the peer, don't bank the time and race ahead once its input is in
+            if (lockstep.isActive && !beginLockstepTick()) {
+                simulationTimeAccumulator = 0;
+                break;
+            }
+            updateSimulation();
+            if (lockstep.isActive) endLockstepTick();
+            if (recorder.file != NULL) recordFrame();
+            simulationTimeAccumulator -= TICK_DELTA;
+            tickCount++;
+        }
+        // Drop time we couldn't catch up on instead of spiralling
+        if (tickCount == MAX_TICKS_PER_FRAME) simulationTimeAccumulator = 0;
 
+        if (tickCount > 0 || actionCount > 0) publishRenderWorld();
 
-void initLevels() {
-    levels[0] = (Level){
-        .imagePath = "Images/Maps/Level0.png",
-        .startingMinionCount = 100,
-        .description = "Click and Drag on the Blue Region",
-        .isDebugLevel = false
-    };
-    levels[1] = (Level){ 
-        .imagePath = "Images/Maps/Level1.png", 
-        .startingMinionCount = 40,
-        .description = "Choose Wisely",
-        .isDebugLevel = false
-    };
-    levels[2] = (Level){
-        .imagePath = "Images/Maps/Level2.png",
-        .startingMinionCount = 70,
-        .description = "Watch out!",
-        .isDebugLevel = false
-    };
-    levels[3] = (Level){
-        .imagePath = "Images/Maps/Level3.png",
-        .startingMinionCount = 80,
-        .description = "Double Trouble",
-        .isDebugLevel = false
-    };
-    levels[4] = (Level){
-        .imagePath = "Images/Maps/Level4.png",
-        .startingMinionCount = 120,
-        .description = "You and what army?",
-        .isDebugLevel = false
-    };
-    levels[5] = (Level){
-        .imagePath = "Images/Maps/Level5.png",
-        .startingMinionCount = 70,
-        .description = "I Summon Thee!",
-        .isDebugLevel = false
-    };
-    levels[6] = (Level){
-        .imagePath = "Images/Maps/Level6.png",
-        .startingMinionCount = 100,
-        .description = "The Final Challenge",
-        .isDebugLevel = false
-    };
-    levels[7] = (Level){
-        .imagePath = "Images/Maps/Freeplay.png",
-        .startingMinionCount = 1000,
-        .description = "Freeplay Unlocked! (Num Keys to Spawn)",
-        .isDebugLevel = true
-    };
+        WaitTime(TICK_DELTA - simulationTimeAccumulator);
+    }
+
+    free(actions);
 }
 
-void reloadLevel() {
-    LEVEL_TRANSITION_TIME_MAX = 1.5;
-    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
-    pendingLevelNumber = currentLevelNumber;
+void startSimulationThread() {
+    // Lockstep peers need the same random numbers
+    simulationThread.randomSeed = lockstep.isActive ? LOCKSTEP_SEED : GetRandomValue(1, INT_MAX);
+    simulationThread.thread = createThread(simulationLoop, NULL);
 }
 
-void gotoNextLevel() {
-    if (currentLevelNumber + 1 >= LEVEL_COUNT) return;
-    LEVEL_TRANSITION_TIME_MAX = 3.0;
-    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
-    pendingLevelNumber = max(0, currentLevelNumber + 1);
+void destroySimulationThread() {
+    if (simulationThread.thread != NULL) {
+        lockMutex(simulationThread.mutex);
+        simulationThread.isShuttingDown = true;
+        unlockMutex(simulationThread.mutex);
+        joinThread(simulationThread.thread);
+    }
+
+    World* boundWorld = world;
+    for ITERATE(i, RENDER_BUFFER_COUNT) {
+        world = &simulationThread.renderWorlds[i];
+        for ITERATE(type, TYPE_COUNT) {
+            destroyClass(type);
+        }
+        destroyArena(&world->levelArena);
+    }
+    world = boundWorld;
+
+    free(simulationThread.actions);
+    freeEffectQueue(&simulationThread.effects);
+    freeEffectQueue(&simulationEffects);
+    freeEffectQueue(&renderEffects);
+    destroyMutex(simulationThread.mutex);
 }
 
-void gotoPreviousLevel() {
-    if (currentLevelNumber - 1 < 0) return;
-    LEVEL_TRANSITION_TIME_MAX = 1.0;
-    levelTransitionTime = LEVEL_TRANSITION_TIME_MAX;
-    pendingLevelNumber = min(currentLevelNumber - 1, LEVEL_COUNT - 1);
+// Render thread, after acquireRenderWorld
+void playEffects(EffectQueue* effects) {
+    for ITERATE(i, effects->soundCount) {
+        SoundEffect* sound = &effects->sounds[i];
+        playSoundInstance(sound->sound, sound->volume, sound->pitch);
+    }
+    for ITERATE(i, effects->particleCount) {
+        ParticleSpawn* particle = &effects->particles[i];
+        spawnParticle(particle->emitter, particle->position, particle->sprite, particle->velocity, particle->acceleration,
+            particle->duration, particle->dampening, particle->startColor, particle->endColor, particle->startScale, particle->endScale);
+    }
+    if (effects->shakeTime > 0) shakeCamera(effects->shakeIntensity, effects->shakeTime);
+    if (effects->isLevelWon) onLevelWon();
+    clearEffectQueue(effects);
 }
 
-void loadLevel(Level* level) {
+// Render thread, reacts to what changed in the bound render world since the last frame
+void updateLevelView() {
+    if (world->levelLoadCount != shownLevelLoadCount) {
+        clearParticles();
+        resetLevelView();
+        shownLevelLoadCount = world->levelLoadCount;
+
+        // Level changes come from the host, this one follows along
+        if (!isLevelHost()) {
+            currentLevelNumber = world->levelNumber;
+            pendingLevelNumber = NULLID;
+            expectedLevelLoadCount = world->levelLoadCount;
+        }
+    } else if (world->minionInventoryCount > shownInventoryCount) {
+        timeSinceLastInventoryIncrease = GetTime();
+    } else if (world->minionInventoryCount < shownInventoryCount) {
+        timeSinceLastInventoryDecrease = GetTime();
+    }
+    shownInventoryCount = world->minionInventoryCount;
+}
 
-    levelStartTime = GetTime();
-    enemyMinionCount = 0;
+// Headless, plays a level with a player that keeps placing minions and publishes every tick
+// like the simulation thread does. Fails if a tick past the warm up touched the heap
+int checkAllocations(int levelNumber, int tickCount) {
+    if (levelNumber < 0 || levelNumber >= LEVEL_COUNT) {
+        printf("No level %d\n", levelNumber);
+        return 1;
+    }
 
-    // Reset classes
     for ITERATE(type, TYPE_COUNT) {
-        resetClass(type);
+        initClass(type);
     }
+    initWorkerPool(getProcessorCount() - 1);
+    initCommandBuffers();
+    initTimers();
+    initLevels();
+    readBakedLevelInfo();
+    initSimulationThread();
+
+    // Effects queue up for the render thread instead of playing
+    isSimulationThread = true;
+    threadRandomState = LOCKSTEP_SEED;
+    EffectQueue effects = { 0 };
+
+    int warmupTicks = ALLOCATION_WARMUP_TIME * SIMULATION_TICK_RATE;
+    int levelStartTick = 0;
+    enterLevel(levelNumber);
+    for ITERATE(tick, tickCount) {
+        TileMap* tileMap = &world->currentTileMap;
+        if (world->entityClasses[MINION_TYPE].spawnCount - world->enemyMinionCount == 0 && world->minionInventoryCount == 0) {
+            enterLevel(levelNumber);
+            levelStartTick = tick;
+        } else if (world->minionInventoryCount > 0) {
+            // A few tries at landing on the placeable region
+            for ITERATE(attempt, 16) {
+                Vector2 position = { randRange(0, tileMap->width * TILE_SIZE), randRange(0, tileMap->height * TILE_SIZE) };
+                TileData* tile = getTileAt(tileMap, position);
+                if (tile == NULL || tile->type != PLACEABLE_TILE) continue;
+                applyPlayerAction(&(PlayerAction){ SPAWN_PLAYER_MINION_ACTION, position, 0 });
+                break;
+            }
+        }
 
-    // Load map
-    Image tilemapImage = LoadImage(level->imagePath);
-    currentTileMap = loadTileMap(&tilemapImage);
-    UnloadImage(tilemapImage);
-
-    // Reset Array
-    freeIntArray(&minionIdsInRange);
-    initIntArray(&minionIdsInRange, 128);
-
-    freeGlobalIdArray(&allEntities);
-    initGlobalIdArray(&allEntities, 128);
+        updateSimulation();
+        publishRenderWorld();
+        acquireRenderWorld(&effects);
+        clearEffectQueue(&effects);
+        world = &mainWorld;
 
-    // Reset Values
-    isMinionTargetRecalculationPending = false;
-    minionInventoryCount = level->startingMinionCount;
-    timeSinceLastInventoryIncrease = GetTime();
-    timeSinceLastInventoryDecrease = GetTime();
-    hasPlacedMinion = false;
-   
+        updateAllocationStats(tick - levelStartTick >= warmupTicks, tick * TICK_DELTA);
+    }
 
-    camera.zoom = 0.5;
-    setCameraCenter(&camera, (Vector2) {
-        currentTileMap.width * TILE_SIZE / 2,
-        currentTileMap.height * TILE_SIZE / 2
-    });
-    
+    logTelemetry();
+    printf("Level %d, %d ticks: %d warmed up ticks allocated\n", levelNumber, tickCount, allocationStats.lateFrameCount);
+    return allocationStats.lateFrameCount > 0 ? 1 : 0;
 }
 
 
@@ -1694,7 +6115,32 @@ void loadLevel(Level* level) {
 //------------------------------------------------------------------------------------
 // Program main entry point
 //------------------------------------------------------------------------------------
-int main(void) {
+int main(int argc, char** argv) {
+    // Bake tool, run by the post build step
+    if (argc > 1 && strcmp(argv[1], "--bake-levels") == 0) {
+        initLevels();
+        return bakeLevels();
+    }
+
+    // Offline tool, prints one frame of a recording
+    if (argc > 3 && strcmp(argv[1], "--read-recording") == 0) {
+        return readRecording(argv[2], strtoul(argv[3], NULL, 10));
+    }
+
+    // --check-allocations <level> <ticks>, headless, also run by the post build step
+    if (argc > 3 && strcmp(argv[1], "--check-allocations") == 0) {
+        return checkAllocations(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    // --lockstep <player 0 or 1> <local port> <remote port> [remote address]
+    if (argc > 4 && strcmp(argv[1], "--lockstep") == 0) {
+        const char* remoteHost = argc > 5 && argv[5][0] != '-' ? argv[5] : "127.0.0.1";
+        if (!initLockstep(atoi(argv[2]) != 0, atoi(argv[3]), remoteHost, atoi(argv[4]))) {
+            TraceLog(LOG_ERROR, "Lockstep can't bind port %s", argv[3]);
+            return 1;
+        }
+    }
+
     // Initialization
     //--------------------------------------------------------------------------------------
 
@@ -1708,11 +6154,24 @@ int main(void) {
     for ITERATE(type, TYPE_COUNT) {
         initClass(type);
     }
+
+    initWorkerPool(getProcessorCount() - 1);
     
-    initIntArray(&minionIdsInRange, 128);
-    initGlobalIdArray(&allEntities, 128);
+    initCommandBuffers();
+    initParticles();
+    initTimers();
 
     initLevels();
+    readBakedLevelInfo();
+    initPreview();
+    initSimulationThread();
+
+    // --record <file>, after the other options
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0 && !startRecording(argv[i + 1])) {
+            TraceLog(LOG_ERROR, "Can't record to %s", argv[i + 1]);
+        }
+    }
     
     worldRenderTexture = LoadRenderTexture(SCREEN_SIZE.x, SCREEN_SIZE.y);
 
@@ -1727,7 +6186,16 @@ int main(void) {
         UnloadImage(iconImg);
     }
 
-    loadLevel(&levels[currentLevelNumber]);
+    initAnimationTables();
+    initIntArray(&visibleMinionIds, 128);
+    initGlobalIdArray(&allEntities, 128);
+
+    // The simulation thread takes mainWorld over once the game starts
+    if (lockstep.isActive) SetRandomSeed(LOCKSTEP_SEED);
+    enterLevel(currentLevelNumber);
+    expectedLevelLoadCount = world->levelLoadCount;
+    publishRenderWorld();
+
     // Main game loop
     while (!WindowShouldClose())    // Detect window close button or ESC key
     {
@@ -1738,26 +6206,41 @@ int main(void) {
         
 
         float delta = GetFrameTime();
+        double frameStartTime = GetTime();
 
         if (!inMenu) {
-            if (entityClasses[MINION_TYPE].spawnCount - enemyMinionCount == 0 && minionInventoryCount == 0 && pendingLevelNumber == NULLID) {
+            acquireRenderWorld(&renderEffects);
+            updateLevelView();
+            playEffects(&renderEffects);
+
+            // Until the simulation has caught up with the last level change
+            bool isRenderWorldCurrent = world->levelLoadCount == expectedLevelLoadCount;
+
+            if (world->entityClasses[MINION_TYPE].spawnCount - world->enemyMinionCount == 0 && world->minionInventoryCount == 0
+                && pendingLevelNumber == NULLID && isRenderWorldCurrent) {
                 playSoundInstance(LOSE_SOUND, 1.0, 1.0);
                 shakeCamera(8.0, 0.5);
                 reloadLevel();
             }
 
-            if (IsKeyPressed(KEY_R)) {
+            if (IsKeyPressed(KEY_R) && isLevelHost()) {
                 reloadLevel();
                 levelTransitionTime = 0.0;
             }
-            if (IsKeyPressed(KEY_M)) {
+            if (IsKeyPressed(KEY_M) && isLevelHost()) {
                 gotoNextLevel();
                 levelTransitionTime = 0.0;
             }
-            if (IsKeyPressed(KEY_N)) {
+            if (IsKeyPressed(KEY_N) && isLevelHost()) {
                 gotoPreviousLevel();
                 levelTransitionTime = 0.0;
             }
+            if (IsKeyPressed(KEY_F3)) {
+                isDebugOverlayVisible = !isDebugOverlayVisible;
+            }
+            if (IsKeyPressed(KEY_P)) {
+                isPreviewEnabled = !isPreviewEnabled;
+            }
             if (IsKeyPressed(KEY_L)) {
                 isSoundOn = !isSoundOn;
                 SetMasterVolume(isSoundOn ? 1.0 : 0.0);
@@ -1766,11 +6249,13 @@ int main(void) {
         
             if (pendingLevelNumber != NULLID) {
                 levelTransitionTime -= delta;
-                if (levelTransitionTime <= 0.0)
+                // A lockstep client waits for the host's level change instead
+                if (levelTransitionTime <= 0.0 && isLevelHost())
                 {
                     currentLevelNumber = pendingLevelNumber;
                     pendingLevelNumber = NULLID;
-                    loadLevel(&levels[currentLevelNumber]);
+                    queuePlayerAction(ENTER_LEVEL_ACTION, Vector2Zero(), currentLevelNumber);
+                    expectedLevelLoadCount++;
                 }
             }
 
@@ -1780,11 +6265,11 @@ int main(void) {
 
             Vector2 mouseWorldPosition = Vector2Add(GetScreenToWorld2D(GetMousePosition(), camera), Vector2Scale(shakeOffset, 1.0/ camera.zoom));
 
-            TileData* tileAtMouse = getTileAt(&currentTileMap, mouseWorldPosition);
+            TileData* tileAtMouse = getTileAt(&world->currentTileMap, mouseWorldPosition);
 
             bool hasDebugControl = DEBUG_MODE || levels[currentLevelNumber].isDebugLevel;
             bool canSpawnDebug = tileAtMouse != NULL;
-            bool canSpawn = minionInventoryCount > 0 && canSpawnDebug && tileAtMouse->type == PLACEABLE_TILE;
+            bool canSpawn = world->minionInventoryCount > 0 && canSpawnDebug && tileAtMouse->type == PLACEABLE_TILE;
 
             if (
                 canSpawn
@@ -1792,16 +6277,7 @@ int main(void) {
                 || (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && Vector2Distance(mouseWorldPosition, lastSpawnPoint) >= spawnDeltaDis))) {
                 Vector2 spawnPoint = mouseWorldPosition;
                 lastSpawnPoint = spawnPoint;
-            
-            
-                if (spawnMinionAt(spawnPoint, true) != NULLID)
-                {
-                    playSoundInstance(MINION_WALK_SOUND, 1.0, randRange(0.9, 1.1));
-                    shakeCamera(1.0, 0.1);
-                    minionInventoryCount--;
-                    timeSinceLastInventoryDecrease = GetTime();
-                    hasPlacedMinion = true;
-                }
+                queuePlayerAction(SPAWN_PLAYER_MINION_ACTION, spawnPoint, 0);
             }
 
             if (
@@ -1810,70 +6286,51 @@ int main(void) {
                     || (IsKeyDown(KEY_FIVE) && Vector2Distance(mouseWorldPosition, lastSpawnPoint) >= spawnDeltaDis))) {
                 Vector2 spawnPoint = mouseWorldPosition;
                 lastSpawnPoint = spawnPoint;
-            
-                if(spawnMinionAt(spawnPoint, false) != NULLID)
-                {
-                    playSoundInstance(MINION_WALK_SOUND, 1.0, randRange(0.9, 1.1));
-                    shakeCamera(1.0, 0.1);
-                }
+                queuePlayerAction(SPAWN_ENEMY_MINION_ACTION, spawnPoint, 0);
             }
 
             if (IsKeyPressed(KEY_ONE) && hasDebugControl && canSpawnDebug) {
-                if(spawnTower(ARCHER_TOWER_TYPE, mouseWorldPosition, 50) != NULLID)
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
-            
+                queuePlayerAction(SPAWN_TOWER_ACTION, mouseWorldPosition, ARCHER_TOWER_TYPE);
             }
 
             if (IsKeyPressed(KEY_TWO) && hasDebugControl && canSpawnDebug) {
-                if(spawnTower(BOMB_TOWER_TYPE, mouseWorldPosition, 50) != NULLID);
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
+                queuePlayerAction(SPAWN_TOWER_ACTION, mouseWorldPosition, BOMB_TOWER_TYPE);
             }
 
             if (IsKeyPressed(KEY_THREE) && hasDebugControl && canSpawnDebug) {
-                if(spawnTower(SUMMONER_TOWER_TYPE, mouseWorldPosition, 50) != NULLID);
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
+                queuePlayerAction(SPAWN_TOWER_ACTION, mouseWorldPosition, SUMMONER_TOWER_TYPE);
             }
 
             if (IsKeyPressed(KEY_FOUR) && hasDebugControl && canSpawnDebug) {
-                int id = createEntity(TRAP_TYPE);
-                if (id != NULLID)
-                {
-                    getEntity(TRAP_TYPE, id)->position = mouseWorldPosition;
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
-                }
+                queuePlayerAction(SPAWN_TRAP_ACTION, mouseWorldPosition, 0);
             }
 
-            if (IsKeyDown(KEY_SIX) && hasDebugControl && canSpawnDebug) {
-                if (getTileAt(&currentTileMap, mouseWorldPosition)->type != PLACEABLE_TILE)
-                {
-                    getTileAt(&currentTileMap, mouseWorldPosition)->type = PLACEABLE_TILE;
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
-                }
+            if (IsKeyDown(KEY_SIX) && hasDebugControl && canSpawnDebug && tileAtMouse->type != PLACEABLE_TILE) {
+                queuePlayerAction(SET_TILE_ACTION, mouseWorldPosition, PLACEABLE_TILE);
             }
 
-            if (IsKeyDown(KEY_SEVEN) && hasDebugControl && canSpawnDebug) {
-                if (getTileAt(&currentTileMap, mouseWorldPosition)->type != GROUND_TILE)
-                {
-                    getTileAt(&currentTileMap, mouseWorldPosition)->type = GROUND_TILE;
-                    playSoundInstance(PLACE_SOUND, 1.0, randRange(0.9, 1.1));
-                }
+            if (IsKeyDown(KEY_SEVEN) && hasDebugControl && canSpawnDebug && tileAtMouse->type != GROUND_TILE) {
+                queuePlayerAction(SET_TILE_ACTION, mouseWorldPosition, GROUND_TILE);
             }
 
-            // Update Entities
-            for ITERATE(type, TYPE_COUNT) {
-                EntityClass* entityClass = &entityClasses[type];
-                for ITERATE(id, entityClass->bankSize) {
-                    Entity* entity = getEntity(type, id);
-                    if (!entity->isSpawned) continue;
-                    entity->lifeTime += delta;
-                    entityClass->update(id, delta);
+            // Fork again when the cursor moves on, or a second after the last result came in
+            if (isPreviewEnabled && canSpawn && pendingLevelNumber == NULLID && isRenderWorldCurrent) {
+                pollPreview();
+                long latestPreviewRequest = atomicAdd(&preview.requestNumber, 0);
+                bool isPreviewStale = latestPreviewRequest == 0
+                    || (shownPreview.requestNumber == latestPreviewRequest
+                        && world->simulationTick - previewRequestTick >= SIMULATION_TICK_RATE);
+                if (Vector2Distance(mouseWorldPosition, lastPreviewPosition) >= PREVIEW_REFRESH_DISTANCE || isPreviewStale) {
+                    queuePlayerAction(PREVIEW_ACTION, mouseWorldPosition, PREVIEW_MINION_COUNT);
+                    lastPreviewPosition = mouseWorldPosition;
+                    previewRequestTick = world->simulationTick;
                 }
             }
 
-            // Update Tilemap
-            updateTileMap(&currentTileMap);
+            // Cosmetic, so they move with the frames
+            updateParticles(delta);
         }
-        //printf("%d\n", entityClasses[MINION_TYPE].spawnCount);
+        //printf("%d\n", world->entityClasses[MINION_TYPE].spawnCount);
 
         //----------------------------------------------------------------------------------
         // M Draw
@@ -1907,54 +6364,50 @@ int main(void) {
         ClearBackground((Color){0, 0, 0, 0});
         BeginMode2D(camera);       
         if (!inMenu) {
-            drawTileMap(&currentTileMap);
-
-            // Shadows
-            for ITERATE(id, entityClasses[MINION_TYPE].bankSize) {
-                Entity* entity = getEntity(MINION_TYPE, id);
-                if (!entity->isSpawned) continue;
-                drawSpriteAnchored(MINION_SHADOW_SPRITE, entity->position, 0, (Vector2) { 0.5, 0.5 }, WHITE);
-            }
+            Rectangle view = getCameraView(&camera, SCREEN_SIZE, VIEW_CULL_MARGIN);
+            cullStats = (CullStats){ 0 };
 
-            for ITERATE(id, entityClasses[TOWER_TYPE].bankSize) {
-                Entity* entity = getEntity(TOWER_TYPE, id);
-                if (!entity->isSpawned) continue;
-                drawSpriteAnchored(TOWER_SHADOW_SPRITE, entity->position, 0, (Vector2) { 0.5, 0.5 }, WHITE);
-            }
+            drawTileMap(&world->currentTileMap, view);
 
-            for ITERATE(id, entityClasses[TRAP_TYPE].bankSize) {
-                Entity* entity = getEntity(TRAP_TYPE, id);
-                if (!entity->isSpawned) continue;
-                drawSpriteAnchored(TRAP_SHADOW_SPRITE, entity->position, 0, (Vector2) { 0.5, 0.5 }, WHITE);
+            // Work out lazily computed positions before anything reads them
+            for ITERATE(type, TYPE_COUNT) {
+                EntityClass* entityClass = &world->entityClasses[type];
+                if (entityClass->evaluateAll != NULL) entityClass->evaluateAll();
             }
 
-
-            // Main Draw
-            //printf("%d\n", enemyMinionCount);
-        
+            // Visible entities
             allEntities.used = 0;
 
+            getVisibleMinionIds(&visibleMinionIds, view);
+            for ITERATE(i, visibleMinionIds.used) {
+                insertGlobalIdArray(&allEntities, (GlobalId){ MINION_TYPE, visibleMinionIds.array[i] });
+            }
+            cullStats.culledSprites += world->entityClasses[MINION_TYPE].spawnCount - visibleMinionIds.used;
+
             for ITERATE(type, TYPE_COUNT) {
-                EntityClass* entityClass = &entityClasses[type];
+                if (type == MINION_TYPE) continue;
+
+                EntityClass* entityClass = &world->entityClasses[type];
                 for ITERATE(id, entityClass->bankSize) {
                     Entity* entity = getEntity(type, id);
                     if (!entity->isSpawned) continue;
 
-                    //entityClass->draw(id);
+                    if (!CheckCollisionPointRec(entity->position, view)) {
+                        cullStats.culledSprites++;
+                        continue;
+                    }
                     insertGlobalIdArray(&allEntities, (GlobalId){type, id});
                 }
             }
-            sortGlobalIdArrayByDepth(&allEntities);
+            cullStats.drawnSprites += allEntities.used;
 
-            for ITERATE(i, allEntities.used) {
-                GlobalId globalId = allEntities.array[i];
-                int type = globalId.type;
-                int id = globalId.id;
+            // Depth sorted, so the list comes out in draw order
+            sortGlobalIdArrayByDepth(&allEntities);
+            buildRenderList(&allEntities, view);
+            submitRenderList();
 
-                Entity* entity = getEntity(type, id);
-                if (!entity->isSpawned) continue;
-                entityClasses[type].draw(id);
-            }
+            drawParticles(view);
+            drawPreview();
         }
         EndMode2D(camera);
         EndTextureMode();
@@ -1985,12 +6438,39 @@ int main(void) {
         
         
             char str[8];
-            sprintf(str, "%d", minionInventoryCount);
+            sprintf(str, "%d", world->minionInventoryCount);
             drawTextAnchored((Vector2) { SCREEN_SIZE.x / 2, SCREEN_SIZE.y - 10 }, (Vector2) { 0.5, 1.0 }, MAIN_FONT, str, fontScale * 128 * camera.zoom, 0, WHITE);
 
-            char* controlsString = "L to Mute\nR to Reset \nM to Skip \nN to Go Back";
+            char* controlsString = "L to Mute\nR to Reset \nM to Skip \nN to Go Back\nP to Preview";
             drawTextAnchored((Vector2) { 10, SCREEN_SIZE.y - 45 }, (Vector2) { 0.0, 1.0 }, MAIN_FONT, controlsString, 32 * camera.zoom, 0, WHITE);
             //DrawFPS(10, 10);
+
+            if (isDebugOverlayVisible) {
+                char debugString[512];
+                int length = sprintf(debugString, "%d FPS\nSprites %d drawn %d culled\nTiles %d drawn %d culled\nQuality %d/%d %.2f ms", GetFPS(),
+                    cullStats.drawnSprites, cullStats.culledSprites, cullStats.drawnTiles, cullStats.culledTiles,
+                    quality.level, MAX_QUALITY_LEVEL, quality.averageFrameTime * 1000);
+                length += sprintf(debugString + length, "\nAllocations %ld this frame, %d late frames\nChunks %d/%d, peak %d active",
+                    allocationStats.frameCount, allocationStats.lateFrameCount,
+                    capacityStats.allocatedChunkCount, capacityStats.chunkCount, capacityStats.activeChunkPeak);
+                int droppedCount = 0;
+                int thinnedCount = 0;
+                for ITERATE(i, EMITTER_COUNT) {
+                    droppedCount += particleEmitters[i].droppedCount;
+                    thinnedCount += particleEmitters[i].thinnedCount;
+                }
+                length += sprintf(debugString + length, "\nParticles %d, %d dropped %d thinned", particles.count, droppedCount, thinnedCount);
+                for ITERATE(type, TYPE_COUNT) {
+                    EntityClass* entityClass = &world->entityClasses[type];
+                    length += sprintf(debugString + length, "\n%s %d/%d, peak %d", TYPE_NAMES[type],
+                        entityClass->spawnCount, entityClass->bankSize, capacityStats.bankPeaks[type]);
+                }
+                if (lockstep.isActive) {
+                    length += sprintf(debugString + length, "\nLockstep player %d %ld B/s", lockstep.playerIndex, lockstep.bytesPerSecond);
+                    if (lockstep.desyncTurn != NULLID) sprintf(debugString + length, "\nDESYNC at turn %ld", lockstep.desyncTurn);
+                }
+                DrawText(debugString, 10, 10, 20, WHITE);
+            }
         } else {
             drawSpriteAnchoredScaled(TITLE_SPRITE, (Vector2) { SCREEN_SIZE.x / 2, 130 + sin(GetTime()) * 10 }, 0, (Vector2){ camera.zoom , camera.zoom
             }, (Vector2) { 0.5, 0.5 }, WHITE);
@@ -2001,12 +6481,18 @@ int main(void) {
 
             drawTextAnchored((Vector2) { SCREEN_SIZE.x / 2, SCREEN_SIZE.y - 70 }, (Vector2) { 0.5, 1.0 }, MAIN_FONT, "Click to Start", 64 * camera.zoom, 0, ColorLerp(WHITE, GetColor(0xFFFFFF00), pow(sin(GetTime() * 2.5), 2)));
         }
+        if (!inMenu) {
+            updateQuality(GetTime() - frameStartTime);
+            bool isSteady = pendingLevelNumber == NULLID && world->levelLoadCount == expectedLevelLoadCount;
+            updateAllocationStats(isSteady && GetTime() - levelStartTime >= ALLOCATION_WARMUP_TIME, GetTime());
+        }
         EndDrawing();
 		//----------------------------------------------------------------------------------
 
         if (inMenu && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
             inMenu = false;
             PlaySound(GAIN_MINIONS_SOUND);
+            startSimulationThread();
         }
 	}
 
@@ -2015,21 +6501,35 @@ int main(void) {
     // De-Initialization
     //--------------------------------------------------------------------------------------
 
+    destroySimulationThread();
+    stopRecording();
+    logTelemetry();
+    destroyLockstep();
+    world = &mainWorld;
+
     unloadSprites();
     unloadSounds();
     unloadFonts();
 
     UnloadRenderTexture(worldRenderTexture);
 
-    freeIntArray(&minionIdsInRange);
-    freeGlobalIdArray(&allEntities);
+    destroyCommandBuffers();
+    destroyParticles();
+    destroyTimers();
 
-    destroyTileMap(&currentTileMap);
+    destroyArena(&world->levelArena);
+    freeWorldSnapshot(&levelStartSnapshot);
+    freeIntArray(&visibleMinionIds);
+    freeGlobalIdArray(&allEntities);
+    destroyRenderList();
 
     for ITERATE(type, TYPE_COUNT) {
         destroyClass(type);
     }
 
+    destroyPreview();
+    destroyWorkerPool();
+
     CloseAudioDevice();
     CloseWindow();        // Close window and OpenGL context
     //--------------------------------------------------------------------------------------
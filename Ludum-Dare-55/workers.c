@@ -0,0 +1,441 @@
+#include "workers.h"
+
+#include <stdlib.h>
+
+
+//------------------------------------------------------------------------------------
+// C Platform
+//------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+struct Thread { HANDLE handle; void (*function)(void*); void* argument; };
+struct Mutex { SRWLOCK lock; };
+struct Condition { CONDITION_VARIABLE variable; };
+
+static DWORD WINAPI threadEntry(LPVOID argument) {
+    Thread* thread = argument;
+    thread->function(thread->argument);
+    return 0;
+}
+
+Thread* createThread(void (*function)(void*), void* argument) {
+    Thread* thread = malloc(sizeof(Thread));
+    thread->function = function;
+    thread->argument = argument;
+    thread->handle = CreateThread(NULL, 0, threadEntry, thread, 0, NULL);
+    if (thread->handle == NULL) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void joinThread(Thread* thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    free(thread);
+}
+
+Mutex* createMutex() {
+    Mutex* mutex = malloc(sizeof(Mutex));
+    InitializeSRWLock(&mutex->lock);
+    return mutex;
+}
+
+void destroyMutex(Mutex* mutex) { free(mutex); }
+void lockMutex(Mutex* mutex) { AcquireSRWLockExclusive(&mutex->lock); }
+void unlockMutex(Mutex* mutex) { ReleaseSRWLockExclusive(&mutex->lock); }
+
+Condition* createCondition() {
+    Condition* condition = malloc(sizeof(Condition));
+    InitializeConditionVariable(&condition->variable);
+    return condition;
+}
+
+void destroyCondition(Condition* condition) { free(condition); }
+void waitCondition(Condition* condition, Mutex* mutex) { SleepConditionVariableSRW(&condition->variable, &mutex->lock, INFINITE, 0); }
+void signalCondition(Condition* condition) { WakeConditionVariable(&condition->variable); }
+void broadcastCondition(Condition* condition) { WakeAllConditionVariable(&condition->variable); }
+
+int getProcessorCount() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+long atomicAdd(volatile long* value, long amount) {
+    return InterlockedExchangeAdd(value, amount) + amount;
+}
+
+bool mapFile(const char* path, MappedFile* file) {
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    // The view keeps the file open
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if (mapping == NULL) return false;
+
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL) return false;
+
+    file->data = data;
+    file->size = (size_t) size.QuadPart;
+    return true;
+}
+
+void unmapFile(MappedFile* file) {
+    UnmapViewOfFile(file->data);
+    file->data = NULL;
+    file->size = 0;
+}
+
+struct UdpSocket { SOCKET handle; };
+
+UdpSocket* openUdpSocket(int port) {
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) return NULL;
+
+    SOCKET handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (handle == INVALID_SOCKET) {
+        WSACleanup();
+        return NULL;
+    }
+
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short) port);
+    u_long isNonBlocking = 1;
+    if (bind(handle, (struct sockaddr*) &address, sizeof(address)) != 0 || ioctlsocket(handle, FIONBIO, &isNonBlocking) != 0) {
+        closesocket(handle);
+        WSACleanup();
+        return NULL;
+    }
+
+    UdpSocket* udpSocket = malloc(sizeof(UdpSocket));
+    udpSocket->handle = handle;
+    return udpSocket;
+}
+
+void closeUdpSocket(UdpSocket* udpSocket) {
+    closesocket(udpSocket->handle);
+    free(udpSocket);
+    WSACleanup();
+}
+
+bool sendUdp(UdpSocket* udpSocket, const char* host, int port, const void* data, int size) {
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short) port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) return false;
+    return sendto(udpSocket->handle, data, size, 0, (struct sockaddr*) &address, sizeof(address)) == size;
+}
+
+int receiveUdp(UdpSocket* udpSocket, const char* host, int port, void* buffer, int capacity) {
+    struct in_addr peer;
+    if (inet_pton(AF_INET, host, &peer) != 1) return 0;
+
+    while (true) {
+        struct sockaddr_in sender;
+        int senderSize = sizeof(sender);
+        int size = recvfrom(udpSocket->handle, buffer, capacity, 0, (struct sockaddr*) &sender, &senderSize);
+        if (size < 0) {
+            // Reported for an earlier send the peer wasn't listening for yet
+            if (WSAGetLastError() == WSAECONNRESET) continue;
+            return 0;
+        }
+        if (sender.sin_addr.s_addr != peer.s_addr || sender.sin_port != htons((unsigned short) port)) continue;
+        return size;
+    }
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+struct Thread { pthread_t handle; void (*function)(void*); void* argument; };
+struct Mutex { pthread_mutex_t lock; };
+struct Condition { pthread_cond_t variable; };
+
+static void* threadEntry(void* argument) {
+    Thread* thread = argument;
+    thread->function(thread->argument);
+    return NULL;
+}
+
+Thread* createThread(void (*function)(void*), void* argument) {
+    Thread* thread = malloc(sizeof(Thread));
+    thread->function = function;
+    thread->argument = argument;
+    if (pthread_create(&thread->handle, NULL, threadEntry, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void joinThread(Thread* thread) {
+    pthread_join(thread->handle, NULL);
+    free(thread);
+}
+
+Mutex* createMutex() {
+    Mutex* mutex = malloc(sizeof(Mutex));
+    pthread_mutex_init(&mutex->lock, NULL);
+    return mutex;
+}
+
+void destroyMutex(Mutex* mutex) {
+    pthread_mutex_destroy(&mutex->lock);
+    free(mutex);
+}
+
+void lockMutex(Mutex* mutex) { pthread_mutex_lock(&mutex->lock); }
+void unlockMutex(Mutex* mutex) { pthread_mutex_unlock(&mutex->lock); }
+
+Condition* createCondition() {
+    Condition* condition = malloc(sizeof(Condition));
+    pthread_cond_init(&condition->variable, NULL);
+    return condition;
+}
+
+void destroyCondition(Condition* condition) {
+    pthread_cond_destroy(&condition->variable);
+    free(condition);
+}
+
+void waitCondition(Condition* condition, Mutex* mutex) { pthread_cond_wait(&condition->variable, &mutex->lock); }
+void signalCondition(Condition* condition) { pthread_cond_signal(&condition->variable); }
+void broadcastCondition(Condition* condition) { pthread_cond_broadcast(&condition->variable); }
+
+int getProcessorCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+long atomicAdd(volatile long* value, long amount) {
+    return __atomic_add_fetch(value, amount, __ATOMIC_SEQ_CST);
+}
+
+bool mapFile(const char* path, MappedFile* file) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat info;
+    if (fstat(descriptor, &info) != 0 || info.st_size == 0) {
+        close(descriptor);
+        return false;
+    }
+
+    // The mapping keeps the file open
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) return false;
+
+    file->data = data;
+    file->size = info.st_size;
+    return true;
+}
+
+void unmapFile(MappedFile* file) {
+    munmap((void*) file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+struct UdpSocket { int handle; };
+
+UdpSocket* openUdpSocket(int port) {
+    int handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (handle < 0) return NULL;
+
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short) port);
+    if (bind(handle, (struct sockaddr*) &address, sizeof(address)) != 0
+        || fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK) != 0) {
+        close(handle);
+        return NULL;
+    }
+
+    UdpSocket* udpSocket = malloc(sizeof(UdpSocket));
+    udpSocket->handle = handle;
+    return udpSocket;
+}
+
+void closeUdpSocket(UdpSocket* udpSocket) {
+    close(udpSocket->handle);
+    free(udpSocket);
+}
+
+bool sendUdp(UdpSocket* udpSocket, const char* host, int port, const void* data, int size) {
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short) port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) return false;
+    return sendto(udpSocket->handle, data, size, 0, (struct sockaddr*) &address, sizeof(address)) == size;
+}
+
+int receiveUdp(UdpSocket* udpSocket, const char* host, int port, void* buffer, int capacity) {
+    struct in_addr peer;
+    if (inet_pton(AF_INET, host, &peer) != 1) return 0;
+
+    while (true) {
+        struct sockaddr_in sender;
+        socklen_t senderSize = sizeof(sender);
+        ssize_t size = recvfrom(udpSocket->handle, buffer, capacity, 0, (struct sockaddr*) &sender, &senderSize);
+        if (size <= 0) return 0;
+        if (sender.sin_addr.s_addr != peer.s_addr || sender.sin_port != htons((unsigned short) port)) continue;
+        return (int) size;
+    }
+}
+
+#endif
+
+
+//------------------------------------------------------------------------------------
+// C Worker Pool
+//------------------------------------------------------------------------------------
+
+#define MAX_WORKER_THREADS 31
+
+typedef struct WorkerPool {
+    Thread* threads[MAX_WORKER_THREADS];
+    int threadCount;
+    Mutex* mutex;
+    Condition* workAvailable;
+    Condition* workDone;
+    JobFunction job;
+    void* context;
+    int jobCount;
+    int nextJob;
+    int jobsRemaining;
+    bool isShuttingDown;
+} WorkerPool;
+
+static WorkerPool pool;
+
+// Grabs and runs jobs until none are left. Called with the pool mutex held.
+static void runAvailableJobs() {
+    while (pool.job != NULL && pool.nextJob < pool.jobCount) {
+        int jobIndex = pool.nextJob++;
+        JobFunction job = pool.job;
+        void* context = pool.context;
+
+        unlockMutex(pool.mutex);
+        job(context, jobIndex);
+        lockMutex(pool.mutex);
+
+        pool.jobsRemaining--;
+        if (pool.jobsRemaining == 0) broadcastCondition(pool.workDone);
+    }
+}
+
+static void workerLoop(void* argument) {
+    lockMutex(pool.mutex);
+    while (!pool.isShuttingDown) {
+        runAvailableJobs();
+        if (pool.isShuttingDown) break;
+        waitCondition(pool.workAvailable, pool.mutex);
+    }
+    unlockMutex(pool.mutex);
+}
+
+void initWorkerPool(int threadCount) {
+    if (threadCount > MAX_WORKER_THREADS) threadCount = MAX_WORKER_THREADS;
+    if (threadCount < 0) threadCount = 0;
+
+    pool.mutex = createMutex();
+    pool.workAvailable = createCondition();
+    pool.workDone = createCondition();
+    pool.job = NULL;
+    pool.jobCount = 0;
+    pool.nextJob = 0;
+    pool.jobsRemaining = 0;
+    pool.isShuttingDown = false;
+
+    pool.threadCount = 0;
+    for (int i = 0; i < threadCount; i++) {
+        Thread* thread = createThread(workerLoop, NULL);
+        if (thread == NULL) break;
+        pool.threads[pool.threadCount++] = thread;
+    }
+}
+
+void destroyWorkerPool() {
+    lockMutex(pool.mutex);
+    pool.isShuttingDown = true;
+    broadcastCondition(pool.workAvailable);
+    unlockMutex(pool.mutex);
+
+    for (int i = 0; i < pool.threadCount; i++) {
+        joinThread(pool.threads[i]);
+    }
+    pool.threadCount = 0;
+
+    destroyCondition(pool.workAvailable);
+    destroyCondition(pool.workDone);
+    destroyMutex(pool.mutex);
+}
+
+// Including the calling thread
+int getWorkerCount() {
+    return pool.threadCount + 1;
+}
+
+void runParallelJobs(JobFunction job, void* context, int jobCount) {
+    if (jobCount <= 0) return;
+
+    if (pool.mutex == NULL || pool.threadCount == 0 || jobCount == 1) {
+        for (int i = 0; i < jobCount; i++) job(context, i);
+        return;
+    }
+
+    lockMutex(pool.mutex);
+    if (pool.job != NULL) {
+        // Pool busy with another caller
+        unlockMutex(pool.mutex);
+        for (int i = 0; i < jobCount; i++) job(context, i);
+        return;
+    }
+
+    pool.job = job;
+    pool.context = context;
+    pool.jobCount = jobCount;
+    pool.nextJob = 0;
+    pool.jobsRemaining = jobCount;
+    broadcastCondition(pool.workAvailable);
+
+    runAvailableJobs();
+    while (pool.jobsRemaining > 0) {
+        waitCondition(pool.workDone, pool.mutex);
+    }
+
+    pool.job = NULL;
+    pool.context = NULL;
+    unlockMutex(pool.mutex);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Threads / Locks
+// Kept out of main.c because windows.h and raylib.h can't be included together.
+
+typedef struct Thread Thread;
+typedef struct Mutex Mutex;
+typedef struct Condition Condition;
+
+Thread* createThread(void (*function)(void*), void* argument);
+void joinThread(Thread* thread);
+
+Mutex* createMutex();
+void destroyMutex(Mutex* mutex);
+void lockMutex(Mutex* mutex);
+void unlockMutex(Mutex* mutex);
+
+Condition* createCondition();
+void destroyCondition(Condition* condition);
+void waitCondition(Condition* condition, Mutex* mutex);
+void signalCondition(Condition* condition);
+void broadcastCondition(Condition* condition);
+
+int getProcessorCount();
+
+// Returns the new value
+long atomicAdd(volatile long* value, long amount);
+
+
+// Files
+// Read only memory mapping, false if the file can't be opened or is empty
+
+typedef struct MappedFile {
+    const unsigned char* data;
+    size_t size;
+} MappedFile;
+
+bool mapFile(const char* path, MappedFile* file);
+void unmapFile(MappedFile* file);
+
+
+// UDP
+// Non-blocking IPv4 datagram sockets
+
+typedef struct UdpSocket UdpSocket;
+
+// Bound to port on every interface, NULL if the port can't be bound
+UdpSocket* openUdpSocket(int port);
+void closeUdpSocket(UdpSocket* udpSocket);
+// host is a dotted address like 127.0.0.1
+bool sendUdp(UdpSocket* udpSocket, const char* host, int port, const void* data, int size);
+// Size of the datagram from host:port copied into buffer, 0 if none is waiting.
+// Datagrams from any other sender are dropped
+int receiveUdp(UdpSocket* udpSocket, const char* host, int port, void* buffer, int capacity);
+
+
+// Worker Pool
+// runParallelJobs calls job(context, i) for every i in [0, jobCount) spread over the
+// pool threads and the calling thread, and returns once they have all finished.
+// If another thread is already running jobs, the jobs run inline on the caller.
+
+typedef void (*JobFunction)(void* context, int jobIndex);
+
+void initWorkerPool(int threadCount);
+void destroyWorkerPool();
+int getWorkerCount();
+void runParallelJobs(JobFunction job, void* context, int jobCount);